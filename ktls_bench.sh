@@ -0,0 +1,59 @@
+#!/bin/sh
+# Sends a file over loopback the two ways data_ktls picks between for an
+# outgoing ssl transfer: SSL_write with openssl encrypting, and
+# SSL_sendfile with the kernel encrypting. The receiving side reads with
+# SSL_read in both runs, as incoming transfers do.
+#
+# The kernel run needs an openssl built with ktls (s_server -help lists
+# -ktls) and the tls kernel module, without them only SSL_write is timed.
+#
+# usage: ktls_bench.sh [size in MB] [port]
+
+SIZE=${1:-512}
+PORT=${2:-59990}
+CIPHER=ECDHE-RSA-AES128-GCM-SHA256
+D=$(mktemp -d)
+
+trap 'rm -rf "$D"' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+  -keyout "$D/key.pem" -out "$D/cert.pem" 2>/dev/null || exit 1
+dd if=/dev/urandom of="$D/bench.bin" bs=1M count="$SIZE" 2>/dev/null
+
+# run <name> [s_server options]
+run()
+{
+  name=$1
+  shift
+
+  (cd "$D" && exec openssl s_server -quiet -naccept 1 -accept "$PORT" \
+    -cert cert.pem -key key.pem -tls1_2 -cipher $CIPHER -WWW "$@") &
+  sleep 1
+
+  start=$(date +%s.%N)
+  printf 'GET /bench.bin HTTP/1.0\r\n\r\n' | openssl s_client -quiet \
+    -connect 127.0.0.1:"$PORT" -tls1_2 -cipher $CIPHER >"$D/out" 2>/dev/null
+  end=$(date +%s.%N)
+  wait
+
+  bytes=$(wc -c <"$D/out")
+  if [ "$bytes" -lt $((SIZE * 1048576)) ]; then
+    echo "$name: only $bytes bytes arrived"
+    return
+  fi
+
+  echo "$start $end" | awk -v n="$name" -v s="$SIZE" \
+    '{ printf "%s: %d MB in %.2f s, %.0f MB/s\n", n, s, $2 - $1, s / ($2 - $1) }'
+}
+
+run "SSL_write"
+
+if ! openssl s_server -help 2>&1 | grep -q -- -ktls; then
+  echo "SSL_sendfile: $(openssl version) is built without ktls"
+  exit 0
+fi
+
+run "SSL_sendfile" -ktls -sendfile
+
+
+# vim:ts=2:expandtab
@@ -19,6 +19,7 @@
 #include "sd_protocol.h"
 #include "sd_error.h"
 #include "sd_dynamic_memory.h"
+#include "sd_idle.h"
 
 void sd_set_state(char *s, int ns)
 {
@@ -27,6 +28,10 @@ void sd_set_state(char *s, int ns)
   os = *s;
   *s = ns;
   ui_state_set(os, ns);
+
+  /* let the state machines act on it */
+  if (os != ns)
+    core_wake();
   
 }
 
@@ -0,0 +1,149 @@
+/*
+   Buffer pool
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_buffer.h"
+#include "sd_globals.h"
+#include "sd_dynamic_memory.h"
+#include "sd_error.h"
+#include "sd_thread.h"
+
+
+/* smallest class that holds len, -1 if it is too large to keep */
+static int buffer_pool_class(int len)
+{
+  int c;
+
+  for (c = 0; c < BUFFER_POOL_CLASSES; c++)
+    if (len <= (1 << (BUFFER_POOL_MIN_SHIFT + c)))
+      return c;
+
+  return -1;
+}
+
+void buffer_pool_init(void)
+{
+  struct sd_buffer_pool *bp = gbls->buffers;
+
+  sd_thread_init(&bp->mutex.cs_mutex);
+  memset(bp->free, 0, sizeof bp->free);
+  memset(bp->nfree, 0, sizeof bp->nfree);
+  memset(&bp->stats, 0, sizeof bp->stats);
+}
+
+void buffer_pool_deinit(void)
+{
+  struct sd_buffer_pool *bp = gbls->buffers;
+  struct sd_buffer_free *f;
+  int c;
+
+  for (c = 0; c < BUFFER_POOL_CLASSES; c++)
+  {
+    while ((f = bp->free[c]) != NULL)
+    {
+      bp->free[c] = f->next;
+      SAFE_FREE(f);
+    }
+    bp->nfree[c] = 0;
+  }
+  bp->stats.idle = 0;
+
+  sd_thread_deinit(&bp->mutex.cs_mutex);
+}
+
+char *buffer_pool_get(int len)
+{
+  struct sd_buffer_pool *bp = gbls->buffers;
+  struct sd_buffer_free *f;
+  char *b;
+  int c;
+
+  c = buffer_pool_class(len);
+
+  sd_cs_lock(&bp->mutex.cs_mutex);
+
+  bp->stats.gets++;
+  bp->stats.in_use++;
+  if (bp->stats.in_use > bp->stats.in_use_max)
+    bp->stats.in_use_max = bp->stats.in_use;
+
+  if (c != -1 && (f = bp->free[c]) != NULL)
+  {
+    bp->free[c] = f->next;
+    bp->nfree[c]--;
+    bp->stats.idle--;
+    sd_cs_unlock(&bp->mutex.cs_mutex);
+    return (char *) f;
+  }
+
+  bp->stats.misses++;
+  sd_cs_unlock(&bp->mutex.cs_mutex);
+
+  /* allocated outside the lock */
+  SAFE_CALLOC(b, 1, c != -1 ? (1 << (BUFFER_POOL_MIN_SHIFT + c)) : len);
+  return b;
+}
+
+void buffer_pool_put(char *b, int len)
+{
+  struct sd_buffer_pool *bp = gbls->buffers;
+  struct sd_buffer_free *f;
+  int c;
+
+  if (!b)
+    return;
+
+  c = buffer_pool_class(len);
+
+  sd_cs_lock(&bp->mutex.cs_mutex);
+
+  bp->stats.in_use--;
+
+  if (c != -1 && bp->nfree[c] < BUFFER_POOL_KEEP)
+  {
+    f = (struct sd_buffer_free *) b;
+    f->next = bp->free[c];
+    bp->free[c] = f;
+    bp->nfree[c]++;
+    bp->stats.idle++;
+    sd_cs_unlock(&bp->mutex.cs_mutex);
+    return;
+  }
+
+  sd_cs_unlock(&bp->mutex.cs_mutex);
+
+  SAFE_FREE(b);
+}
+
+void buffer_pool_get_stats(struct sd_buffer_pool_stats *st)
+{
+  struct sd_buffer_pool *bp = gbls->buffers;
+
+  sd_cs_lock(&bp->mutex.cs_mutex);
+  memcpy(st, &bp->stats, sizeof(struct sd_buffer_pool_stats));
+  sd_cs_unlock(&bp->mutex.cs_mutex);
+}
+
+
+// vim:ts=2:expandtab
@@ -0,0 +1,64 @@
+#ifndef SD_BUFFER_H
+#define SD_BUFFER_H
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdint.h>
+
+#include "sd_thread.h"
+
+/* power of two classes, larger requests are not kept */
+#define BUFFER_POOL_MIN_SHIFT               12 /* 4 kB */
+#define BUFFER_POOL_MAX_SHIFT               20 /* 1 MB */
+#define BUFFER_POOL_CLASSES                  (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+#define BUFFER_POOL_KEEP                    32 /* idle buffers kept per class */
+
+/*! \brief Buffer pool statistics */
+struct sd_buffer_pool_stats
+{
+  int in_use;         /* handed out */
+  int in_use_max;     /* high-water mark */
+  int idle;           /* kept for reuse */
+  uint64_t gets;
+  uint64_t misses;    /* had to be allocated */
+};
+
+/*! \brief Idle buffers, linked through their first bytes */
+struct sd_buffer_free
+{
+  struct sd_buffer_free *next;
+};
+
+/*! \brief Buffers shared by everything moving data, any thread may take
+ *         or return one */
+struct sd_buffer_pool
+{
+  struct sd_mutex_state_info mutex;
+  struct sd_buffer_free *free[BUFFER_POOL_CLASSES];
+  int nfree[BUFFER_POOL_CLASSES];
+  struct sd_buffer_pool_stats stats;
+};
+
+/*! \brief Initialise the buffer pool */
+extern void buffer_pool_init(void);
+
+/*! \brief Free the idle buffers, all buffers must have been returned */
+extern void buffer_pool_deinit(void);
+
+/*! \brief Take a buffer of at least len bytes */
+extern char *buffer_pool_get(int len);
+
+/*! \brief Return a buffer taken with the same len, b may be NULL */
+extern void buffer_pool_put(char *b, int len);
+
+/*! \brief Get a copy of the buffer pool statistics */
+extern void buffer_pool_get_stats(struct sd_buffer_pool_stats *st);
+
+#endif
+
+
+// vim:ts=2:expandtab
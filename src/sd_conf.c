@@ -42,6 +42,30 @@ struct sd_conf_item config[] = {
 
   { "logging_enabled",             SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
   { "logging_path",                SD_CONFIG_VALUE_TYPE_STRING,           SD_MAX_PATH_LEN,                 NULL },
+
+  { "core_workers",                SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "job_pool_threads",            SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "io_pool_threads",             SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "data_io_uring",               SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_sendfile",               SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_splice",                 SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_ktls",                   SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_mmap",                   SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_read_ahead",             SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_write_behind",           SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "data_streams",                SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "data_checksum",               SD_CONFIG_VALUE_TYPE_STRING_BOOLEAN,   sizeof(int),                     NULL },
+  { "data_window_min",             SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "data_window_max",             SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+
+  { "server_backlog",              SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "server_accept_budget",        SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+
+  { "resolve_cache_ttl",           SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+
+  { "con_timeout",                 SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "data_verdict_timeout",        SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
+  { "data_idle_timeout",           SD_CONFIG_VALUE_TYPE_INT,              sizeof(int),                     NULL },
 };
 
 int conf_get_num_items(void)
@@ -119,6 +143,34 @@ void conf_set_all_pointers(void)
   /* logging */
   conf_set_pointer("logging_enabled", &gbls->conf->logging_enabled);
   conf_set_pointer("logging_path", &gbls->conf->logging_path);
+
+  /* core */
+  conf_set_pointer("core_workers", &gbls->conf->core_workers);
+  conf_set_pointer("job_pool_threads", &gbls->conf->job_pool_threads);
+  conf_set_pointer("io_pool_threads", &gbls->conf->io_pool_threads);
+  conf_set_pointer("data_io_uring", &gbls->conf->data_io_uring);
+  conf_set_pointer("data_sendfile", &gbls->conf->data_sendfile);
+  conf_set_pointer("data_splice", &gbls->conf->data_splice);
+  conf_set_pointer("data_ktls", &gbls->conf->data_ktls);
+  conf_set_pointer("data_mmap", &gbls->conf->data_mmap);
+  conf_set_pointer("data_read_ahead", &gbls->conf->data_read_ahead);
+  conf_set_pointer("data_write_behind", &gbls->conf->data_write_behind);
+  conf_set_pointer("data_streams", &gbls->conf->data_streams);
+  conf_set_pointer("data_checksum", &gbls->conf->data_checksum);
+  conf_set_pointer("data_window_min", &gbls->conf->data_window_min);
+  conf_set_pointer("data_window_max", &gbls->conf->data_window_max);
+
+  /* servers */
+  conf_set_pointer("server_backlog", &gbls->conf->server_backlog);
+  conf_set_pointer("server_accept_budget", &gbls->conf->server_accept_budget);
+
+  /* resolver */
+  conf_set_pointer("resolve_cache_ttl", &gbls->conf->resolve_cache_ttl);
+
+  /* timeouts */
+  conf_set_pointer("con_timeout", &gbls->conf->con_timeout);
+  conf_set_pointer("data_verdict_timeout", &gbls->conf->data_verdict_timeout);
+  conf_set_pointer("data_idle_timeout", &gbls->conf->data_idle_timeout);
 }
 
 void conf_init(void)
@@ -0,0 +1,131 @@
+/*
+   CRC32C of transfer data
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "sd_crc.h"
+
+#define CRC32C_POLY                 0x82f63b78 /* Castagnoli, reflected */
+
+/* slicing by 8, table k holds the crc of a byte followed by k zeros */
+static uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p,
+    size_t len) = &crc32c_sw;
+
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint32_t (*t)[256] = crc32c_table;
+  uint32_t lo, hi;
+
+  /* loaded a byte at a time, any alignment and byte order */
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+        (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+    hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 |
+      (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+      t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+      t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+      t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+
+  while (len--)
+    crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/* SSE 4.2 has the Castagnoli polynomial built in */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc, v;
+
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy(&v, p, sizeof v);
+    c = __builtin_ia32_crc32di(c, v);
+  }
+
+  while (len--)
+    c = __builtin_ia32_crc32qi((uint32_t) c, *p++);
+
+  return (uint32_t) c;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_arm(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t v;
+
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy(&v, p, sizeof v);
+    crc = __crc32cd(crc, v);
+  }
+
+  while (len--)
+    crc = __crc32cb(crc, *p++);
+
+  return crc;
+}
+#endif
+
+void crc32c_init(void)
+{
+  uint32_t c;
+  int i, j, k;
+
+  for (i = 0; i < 256; i++)
+  {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[0][i] = c;
+  }
+
+  for (k = 1; k < 8; k++)
+    for (i = 0; i < 256; i++)
+      crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^
+        crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+
+#if defined(__GNUC__) && defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_fn = &crc32c_sse42;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  crc32c_fn = &crc32c_arm;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const char *b, size_t len)
+{
+  return ~crc32c_fn(~crc, (const unsigned char *) b, len);
+}
+
+
+// vim:ts=2:expandtab
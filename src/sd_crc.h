@@ -0,0 +1,18 @@
+#ifndef SD_CRC_H
+#define SD_CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*! \brief Pick the CRC32C instruction if the CPU has one, otherwise build
+ *         the tables, before any thread uses crc32c() */
+extern void crc32c_init(void);
+
+/*! \brief Continue the CRC32C (Castagnoli) crc over len bytes of b, start
+ *         with 0 */
+extern uint32_t crc32c(uint32_t crc, const char *b, size_t len);
+
+#endif
+
+
+// vim:ts=2:expandtab
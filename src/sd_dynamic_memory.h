@@ -10,6 +10,14 @@
   ON_ERROR_EXIT("Could not allocate memory.\n"); \
   } } while(0)
 
+/*! \brief Memory reallocation macro */
+#define SAFE_REALLOC(x, b) do { \
+  void *_p = realloc(x, b); \
+  if (_p == NULL) { \
+  ON_ERROR_EXIT("Could not allocate memory.\n"); \
+  } \
+  x = _p; } while(0)
+
 /*! \brief Memory free macro */
 #define SAFE_FREE(x) do { free(x); } while(0)
 
@@ -0,0 +1,870 @@
+/*
+   Socket readiness notification
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#ifdef WIN32
+
+#include <windows.h>
+#include <winsock2.h>
+
+#else
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#endif
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "sd.h"
+#include "sd_event.h"
+#include "sd_timing.h"
+#include "sd_ui.h"
+#include "sd_error.h"
+#include "sd_dynamic_memory.h"
+
+static int event_loop_wake_init(struct sd_event_loop *el);
+static void event_loop_wake_deinit(struct sd_event_loop *el);
+static int event_loop_wait_timeout(struct sd_event_loop *el, int timeout);
+static void event_loop_run_timers(struct sd_event_loop *el);
+
+
+#ifdef SD_EVENT_EPOLL
+
+/* -[ epoll ]---------------------------------------------------------- */
+
+static uint32_t event_to_epoll(int events)
+{
+  uint32_t e = 0;
+
+  if (events & SD_EVENT_READ)
+    e |= EPOLLIN;
+  if (events & SD_EVENT_WRITE)
+    e |= EPOLLOUT;
+
+  return e;
+}
+
+int event_loop_init(struct sd_event_loop *el)
+{
+  el->nready = 0;
+  el->ndel = el->wait_ndel = 0;
+  sd_thread_init(&el->mutex.cs_mutex);
+  timer_wheel_init(&el->timers);
+  el->timer_next = 0;
+  el->waiting = 0;
+
+  if ((el->ep_fd = epoll_create(SD_EVENT_MAX_READY)) == -1)
+    return -1;
+
+  return event_loop_wake_init(el);
+}
+
+void event_loop_deinit(struct sd_event_loop *el)
+{
+  event_loop_wake_deinit(el);
+  close(el->ep_fd);
+  timer_wheel_deinit(&el->timers);
+  sd_thread_deinit(&el->mutex.cs_mutex);
+}
+
+int event_loop_wait(struct sd_event_loop *el, int timeout)
+{
+  int n;
+
+  sd_cs_lock(&el->mutex.cs_mutex);
+  el->wait_ndel = el->ndel;
+  timeout = event_loop_wait_timeout(el, timeout);
+  sd_cs_unlock(&el->mutex.cs_mutex);
+
+  if ((n = epoll_wait(el->ep_fd, el->ready, SD_EVENT_MAX_READY, timeout)) == -1)
+  {
+    if (errno != EINTR)
+      ui_sys_err(errno, "epoll_wait");
+    n = 0;
+  }
+
+  el->nready = n;
+  return n;
+}
+
+int event_loop_dispatch(struct sd_event_loop *el)
+{
+  int i, ev, ndisp;
+  struct sd_event_handler *eh;
+
+  ndisp = 0;
+
+  if (el->ndel != el->wait_ndel)
+  {
+    /* still level triggered, the next wait finds them again */
+    el->nready = 0;
+    event_loop_run_timers(el);
+    return 0;
+  }
+
+  for (i = 0; i < el->nready; i++)
+  {
+    eh = (struct sd_event_handler *) el->ready[i].data.ptr;
+
+    /* removed by an earlier callback */
+    if (eh->loop != el)
+      continue;
+
+    ev = 0;
+    if (el->ready[i].events & EPOLLIN)
+      ev |= SD_EVENT_READ;
+    if (el->ready[i].events & EPOLLOUT)
+      ev |= SD_EVENT_WRITE;
+    /* let the handler find the error when it does its io */
+    if (el->ready[i].events & (EPOLLERR | EPOLLHUP))
+      ev |= SD_EVENT_ERROR | eh->events;
+
+    ev &= eh->events | SD_EVENT_ERROR;
+    if (!ev)
+      continue;
+
+    (*eh->cb)(eh->v, ev);
+    ndisp++;
+  }
+
+  el->nready = 0;
+  event_loop_run_timers(el);
+  return ndisp;
+}
+
+int event_handler_add(struct sd_event_loop *el, struct sd_event_handler *eh,
+    int fd, int events)
+{
+  struct epoll_event ee;
+
+  memset(&ee, 0, sizeof ee);
+  ee.events = event_to_epoll(events);
+  ee.data.ptr = eh;
+
+  if (epoll_ctl(el->ep_fd, EPOLL_CTL_ADD, fd, &ee) == -1)
+  {
+    /* allready there, just update */
+    if (errno != EEXIST || epoll_ctl(el->ep_fd, EPOLL_CTL_MOD, fd, &ee) == -1)
+    {
+      ui_sys_err(errno, "epoll_ctl");
+      return -1;
+    }
+  }
+
+  eh->loop = el;
+  eh->fd = fd;
+  eh->events = events;
+
+  return 0;
+}
+
+int event_handler_mod(struct sd_event_handler *eh, int events)
+{
+  struct epoll_event ee;
+
+  if (!eh->loop)
+    return -1;
+
+  if (eh->events == events)
+    return 0;
+
+  memset(&ee, 0, sizeof ee);
+  ee.events = event_to_epoll(events);
+  ee.data.ptr = eh;
+
+  if (epoll_ctl(eh->loop->ep_fd, EPOLL_CTL_MOD, eh->fd, &ee) == -1)
+  {
+    ui_sys_err(errno, "epoll_ctl");
+    return -1;
+  }
+
+  eh->events = events;
+
+  return 0;
+}
+
+int event_handler_del(struct sd_event_handler *eh)
+{
+  struct epoll_event ee;
+
+  if (!eh->loop)
+    return 0;
+
+  /* older kernels want a non-NULL event */
+  memset(&ee, 0, sizeof ee);
+  epoll_ctl(eh->loop->ep_fd, EPOLL_CTL_DEL, eh->fd, &ee);
+
+  sd_cs_lock(&eh->loop->mutex.cs_mutex);
+  eh->loop->ndel++;
+  sd_cs_unlock(&eh->loop->mutex.cs_mutex);
+
+  eh->loop = NULL;
+  eh->fd = -1;
+
+  return 0;
+}
+
+#elif defined(SD_EVENT_KQUEUE)
+
+/* -[ kqueue ]--------------------------------------------------------- */
+
+/* both filters stay added while the handler is, the interest only
+ * enables or disables them */
+static int event_kevent_set(struct sd_event_loop *el, struct sd_event_handler *eh,
+    int fd, int events, int flags)
+{
+  struct kevent ke[2];
+
+  EV_SET(&ke[0], fd, EVFILT_READ,
+      flags | ((events & SD_EVENT_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, eh);
+  EV_SET(&ke[1], fd, EVFILT_WRITE,
+      flags | ((events & SD_EVENT_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, eh);
+
+  return kevent(el->kq_fd, ke, 2, NULL, 0, NULL);
+}
+
+int event_loop_init(struct sd_event_loop *el)
+{
+  el->nready = 0;
+  el->ndel = el->wait_ndel = 0;
+  sd_thread_init(&el->mutex.cs_mutex);
+  timer_wheel_init(&el->timers);
+  el->timer_next = 0;
+  el->waiting = 0;
+
+  if ((el->kq_fd = kqueue()) == -1)
+    return -1;
+
+  return event_loop_wake_init(el);
+}
+
+void event_loop_deinit(struct sd_event_loop *el)
+{
+  event_loop_wake_deinit(el);
+  close(el->kq_fd);
+  timer_wheel_deinit(&el->timers);
+  sd_thread_deinit(&el->mutex.cs_mutex);
+}
+
+int event_loop_wait(struct sd_event_loop *el, int timeout)
+{
+  struct timespec ts, *tsp;
+  int n;
+
+  sd_cs_lock(&el->mutex.cs_mutex);
+  el->wait_ndel = el->ndel;
+  timeout = event_loop_wait_timeout(el, timeout);
+  sd_cs_unlock(&el->mutex.cs_mutex);
+
+  tsp = NULL;
+  if (timeout >= 0)
+  {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+    tsp = &ts;
+  }
+
+  if ((n = kevent(el->kq_fd, NULL, 0, el->ready, SD_EVENT_MAX_READY, tsp)) == -1)
+  {
+    if (errno != EINTR)
+      ui_sys_err(errno, "kevent");
+    n = 0;
+  }
+
+  el->nready = n;
+  return n;
+}
+
+int event_loop_dispatch(struct sd_event_loop *el)
+{
+  int i, ev, ndisp;
+  struct sd_event_handler *eh;
+
+  ndisp = 0;
+
+  if (el->ndel != el->wait_ndel)
+  {
+    /* still level triggered, the next wait finds them again */
+    el->nready = 0;
+    event_loop_run_timers(el);
+    return 0;
+  }
+
+  for (i = 0; i < el->nready; i++)
+  {
+    eh = (struct sd_event_handler *) el->ready[i].udata;
+
+    /* removed by an earlier callback */
+    if (eh->loop != el)
+      continue;
+
+    ev = 0;
+    if (el->ready[i].filter == EVFILT_READ)
+      ev |= SD_EVENT_READ;
+    if (el->ready[i].filter == EVFILT_WRITE)
+      ev |= SD_EVENT_WRITE;
+    /* let the handler find the error when it does its io */
+    if (el->ready[i].flags & (EV_EOF | EV_ERROR))
+      ev |= SD_EVENT_ERROR | eh->events;
+
+    ev &= eh->events | SD_EVENT_ERROR;
+    if (!ev)
+      continue;
+
+    (*eh->cb)(eh->v, ev);
+    ndisp++;
+  }
+
+  el->nready = 0;
+  event_loop_run_timers(el);
+  return ndisp;
+}
+
+int event_handler_add(struct sd_event_loop *el, struct sd_event_handler *eh,
+    int fd, int events)
+{
+  if (event_kevent_set(el, eh, fd, events, EV_ADD) == -1)
+  {
+    ui_sys_err(errno, "kevent");
+    return -1;
+  }
+
+  eh->loop = el;
+  eh->fd = fd;
+  eh->events = events;
+
+  return 0;
+}
+
+int event_handler_mod(struct sd_event_handler *eh, int events)
+{
+  if (!eh->loop)
+    return -1;
+
+  if (eh->events == events)
+    return 0;
+
+  if (event_kevent_set(eh->loop, eh, eh->fd, events, EV_ADD) == -1)
+  {
+    ui_sys_err(errno, "kevent");
+    return -1;
+  }
+
+  eh->events = events;
+
+  return 0;
+}
+
+int event_handler_del(struct sd_event_handler *eh)
+{
+  struct kevent ke[2];
+
+  if (!eh->loop)
+    return 0;
+
+  EV_SET(&ke[0], eh->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  EV_SET(&ke[1], eh->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  kevent(eh->loop->kq_fd, ke, 2, NULL, 0, NULL);
+
+  sd_cs_lock(&eh->loop->mutex.cs_mutex);
+  eh->loop->ndel++;
+  sd_cs_unlock(&eh->loop->mutex.cs_mutex);
+
+  eh->loop = NULL;
+  eh->fd = -1;
+
+  return 0;
+}
+
+#else
+
+/* -[ poll / select ]-------------------------------------------------- */
+
+#ifndef SD_EVENT_POLL
+/* winsock reads fd_count entries, FD_SETSIZE only bounds the macros */
+#define EVENT_FD_SET_LEN(n) (offsetof(fd_set, fd_array) + (n) * sizeof(SOCKET))
+#endif
+
+/* make room to copy every handler for a wait, loop mutex held */
+static void event_loop_wait_grow(struct sd_event_loop *el)
+{
+  if (el->wait_len >= el->nhandlers)
+    return;
+
+  el->wait_len = el->handlers_len;
+  SAFE_REALLOC(el->ready, el->wait_len * sizeof(struct sd_event_handler *));
+#ifdef SD_EVENT_POLL
+  SAFE_REALLOC(el->pfds, el->wait_len * sizeof(struct pollfd));
+#else
+  SAFE_REALLOC(el->rfds, EVENT_FD_SET_LEN(el->wait_len));
+  SAFE_REALLOC(el->wfds, EVENT_FD_SET_LEN(el->wait_len));
+  SAFE_REALLOC(el->efds, EVENT_FD_SET_LEN(el->wait_len));
+#endif
+}
+
+int event_loop_init(struct sd_event_loop *el)
+{
+  el->handlers = NULL;
+  el->nhandlers = el->handlers_len = 0;
+  el->ready = NULL;
+#ifdef SD_EVENT_POLL
+  el->pfds = NULL;
+#else
+  el->rfds = el->wfds = el->efds = NULL;
+#endif
+  el->wait_len = 0;
+  el->nready = 0;
+  el->ndel = el->wait_ndel = 0;
+  sd_thread_init(&el->mutex.cs_mutex);
+  timer_wheel_init(&el->timers);
+  el->timer_next = 0;
+  el->waiting = 0;
+
+  return event_loop_wake_init(el);
+}
+
+void event_loop_deinit(struct sd_event_loop *el)
+{
+  event_loop_wake_deinit(el);
+  SAFE_FREE(el->handlers);
+  SAFE_FREE(el->ready);
+#ifdef SD_EVENT_POLL
+  SAFE_FREE(el->pfds);
+#else
+  SAFE_FREE(el->rfds);
+  SAFE_FREE(el->wfds);
+  SAFE_FREE(el->efds);
+#endif
+  timer_wheel_deinit(&el->timers);
+  sd_thread_deinit(&el->mutex.cs_mutex);
+}
+
+int event_loop_wait(struct sd_event_loop *el, int timeout)
+{
+  struct sd_event_handler *eh;
+  int i, n, size;
+#ifndef SD_EVENT_POLL
+  struct timeval tv;
+#endif
+
+  el->nready = 0;
+
+  /* handlers are only read here, the copies are waited on unlocked */
+  sd_cs_lock(&el->mutex.cs_mutex);
+
+  el->wait_ndel = el->ndel;
+  timeout = event_loop_wait_timeout(el, timeout);
+  event_loop_wait_grow(el);
+  size = el->nhandlers;
+
+#ifndef SD_EVENT_POLL
+  if (size)
+    el->rfds->fd_count = el->wfds->fd_count = el->efds->fd_count = 0;
+#endif
+
+  for (i = 0; i < size; i++)
+  {
+    eh = el->handlers[i];
+    eh->revents = 0;
+    el->ready[i] = eh;
+
+#ifdef SD_EVENT_POLL
+    el->pfds[i].fd = eh->fd;
+    el->pfds[i].events = 0;
+    el->pfds[i].revents = 0;
+    if (eh->events & SD_EVENT_READ)
+      el->pfds[i].events |= POLLIN;
+    if (eh->events & SD_EVENT_WRITE)
+      el->pfds[i].events |= POLLOUT;
+#else
+    if (eh->events & SD_EVENT_READ)
+      el->rfds->fd_array[el->rfds->fd_count++] = eh->fd;
+    if (eh->events & SD_EVENT_WRITE)
+      el->wfds->fd_array[el->wfds->fd_count++] = eh->fd;
+    el->efds->fd_array[el->efds->fd_count++] = eh->fd;
+#endif
+  }
+
+  sd_cs_unlock(&el->mutex.cs_mutex);
+
+  if (!size)
+  {
+    /* nothing to wait on */
+    if (timeout > 0)
+    {
+#ifdef WIN32
+      Sleep(timeout);
+#else
+      usleep(timeout * 1000);
+#endif
+    }
+    return 0;
+  }
+
+#ifdef SD_EVENT_POLL
+  if ((n = poll(el->pfds, size, timeout)) == -1)
+  {
+    if (errno != EINTR)
+      ui_sys_err(errno, "poll");
+    return 0;
+  }
+#else
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+
+  if ((n = select(0, el->rfds, el->wfds, el->efds,
+          (timeout < 0 ? NULL : &tv))) == -1)
+  {
+    ui_sock_err("select");
+    return 0;
+  }
+#endif
+
+  sd_cs_lock(&el->mutex.cs_mutex);
+
+  /* if any was removed while waiting dispatch skips them all, otherwise
+   * keep the ready ones at the front */
+  for (i = 0; i < size && n > 0 && el->ndel == el->wait_ndel; i++)
+  {
+    eh = el->ready[i];
+
+#ifdef SD_EVENT_POLL
+    if (el->pfds[i].revents & POLLIN)
+      eh->revents |= SD_EVENT_READ;
+    if (el->pfds[i].revents & POLLOUT)
+      eh->revents |= SD_EVENT_WRITE;
+    if (el->pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+      eh->revents |= SD_EVENT_ERROR | eh->events;
+#else
+    if (FD_ISSET(eh->fd, el->rfds))
+      eh->revents |= SD_EVENT_READ;
+    if (FD_ISSET(eh->fd, el->wfds))
+      eh->revents |= SD_EVENT_WRITE;
+    if (FD_ISSET(eh->fd, el->efds))
+      eh->revents |= SD_EVENT_ERROR | eh->events;
+#endif
+
+    if (eh->revents)
+      el->ready[el->nready++] = eh;
+  }
+
+  sd_cs_unlock(&el->mutex.cs_mutex);
+
+  return el->nready;
+}
+
+int event_loop_dispatch(struct sd_event_loop *el)
+{
+  int i, ev, ndisp;
+  struct sd_event_handler *eh;
+
+  ndisp = 0;
+
+  if (el->ndel != el->wait_ndel)
+  {
+    el->nready = 0;
+    event_loop_run_timers(el);
+    return 0;
+  }
+
+  for (i = 0; i < el->nready; i++)
+  {
+    eh = el->ready[i];
+
+    /* removed by an earlier callback */
+    if (eh->loop != el)
+      continue;
+
+    ev = eh->revents & (eh->events | SD_EVENT_ERROR);
+    if (!ev)
+      continue;
+
+    (*eh->cb)(eh->v, ev);
+    ndisp++;
+  }
+
+  el->nready = 0;
+  event_loop_run_timers(el);
+  return ndisp;
+}
+
+int event_handler_add(struct sd_event_loop *el, struct sd_event_handler *eh,
+    int fd, int events)
+{
+  sd_cs_lock(&el->mutex.cs_mutex);
+
+  if (eh->loop != el)
+  {
+    if (el->nhandlers == el->handlers_len)
+    {
+      el->handlers_len = el->handlers_len ? el->handlers_len * 2 : 64;
+      SAFE_REALLOC(el->handlers,
+          el->handlers_len * sizeof(struct sd_event_handler *));
+    }
+    eh->index = el->nhandlers;
+    el->handlers[el->nhandlers++] = eh;
+  }
+
+  eh->loop = el;
+  eh->fd = fd;
+  eh->events = events;
+  eh->revents = 0;
+
+  sd_cs_unlock(&el->mutex.cs_mutex);
+
+  /* not in the copies of a wait that is allready running */
+  event_loop_wake(el);
+
+  return 0;
+}
+
+int event_handler_mod(struct sd_event_handler *eh, int events)
+{
+  if (!eh->loop)
+    return -1;
+
+  if (eh->events == events)
+    return 0;
+
+  sd_cs_lock(&eh->loop->mutex.cs_mutex);
+  eh->events = events;
+  sd_cs_unlock(&eh->loop->mutex.cs_mutex);
+
+  event_loop_wake(eh->loop);
+
+  return 0;
+}
+
+int event_handler_del(struct sd_event_handler *eh)
+{
+  struct sd_event_loop *el;
+  struct sd_event_handler *last;
+
+  if (!eh->loop)
+    return 0;
+
+  el = eh->loop;
+
+  sd_cs_lock(&el->mutex.cs_mutex);
+
+  /* the last one fills the gap */
+  last = el->handlers[--el->nhandlers];
+  el->handlers[eh->index] = last;
+  last->index = eh->index;
+  el->ndel++;
+
+  sd_cs_unlock(&el->mutex.cs_mutex);
+
+  eh->loop = NULL;
+  eh->fd = -1;
+
+  return 0;
+}
+
+#endif
+
+
+/* -[ common ]--------------------------------------------------------- */
+
+/* empty the wake fd so the next wait blocks again */
+static void event_loop_wake_cb(void *v, int events)
+{
+  struct sd_event_loop *el = (struct sd_event_loop *)v;
+  char b[64];
+
+#ifdef WIN32
+  while (recv(el->wake_fd[0], b, sizeof b, 0) > 0) ;
+#else
+  while (read(el->wake_fd[0], b, sizeof b) > 0) ;
+#endif
+}
+
+#ifdef WIN32
+/* select only takes sockets, so the wake pipe is a loopback connection */
+static int event_loop_wake_socketpair(int *fd)
+{
+  struct sockaddr_in sa;
+  int len = sizeof sa;
+  int nodelay = 1;
+  u_long mode = 1;
+  SOCKET l, c = INVALID_SOCKET, a = INVALID_SOCKET;
+
+  if ((l = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET)
+  {
+    ui_wsa_err("socket");
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(l, (struct sockaddr *)&sa, sizeof sa) == SOCKET_ERROR ||
+      getsockname(l, (struct sockaddr *)&sa, &len) == SOCKET_ERROR ||
+      listen(l, 1) == SOCKET_ERROR ||
+      (c = socket(AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET ||
+      connect(c, (struct sockaddr *)&sa, sizeof sa) == SOCKET_ERROR ||
+      (a = accept(l, NULL, NULL)) == INVALID_SOCKET ||
+      ioctlsocket(a, FIONBIO, &mode) == SOCKET_ERROR ||
+      ioctlsocket(c, FIONBIO, &mode) == SOCKET_ERROR ||
+      setsockopt(c, IPPROTO_TCP, TCP_NODELAY, (char *)&nodelay,
+        sizeof nodelay) == SOCKET_ERROR)
+  {
+    ui_wsa_err("event_loop_wake_socketpair");
+    if (a != INVALID_SOCKET)
+      closesocket(a);
+    if (c != INVALID_SOCKET)
+      closesocket(c);
+    closesocket(l);
+    return -1;
+  }
+
+  closesocket(l);
+
+  fd[0] = (int) a;
+  fd[1] = (int) c;
+
+  return 0;
+}
+#endif
+
+static int event_loop_wake_init(struct sd_event_loop *el)
+{
+  event_handler_init(&el->wake_ev, &event_loop_wake_cb, el);
+
+#if defined(SD_EVENT_EPOLL)
+  if ((el->wake_fd[0] = eventfd(0, EFD_NONBLOCK)) == -1)
+    return -1;
+  el->wake_fd[1] = el->wake_fd[0];
+#elif defined(WIN32)
+  if (event_loop_wake_socketpair(el->wake_fd) == -1)
+  {
+    el->wake_fd[0] = el->wake_fd[1] = -1;
+    return -1;
+  }
+#else
+  if (pipe(el->wake_fd) == -1)
+    return -1;
+  fcntl(el->wake_fd[0], F_SETFL, fcntl(el->wake_fd[0], F_GETFL) | O_NONBLOCK);
+  fcntl(el->wake_fd[1], F_SETFL, fcntl(el->wake_fd[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+  return event_handler_add(el, &el->wake_ev, el->wake_fd[0], SD_EVENT_READ);
+}
+
+static void event_loop_wake_deinit(struct sd_event_loop *el)
+{
+  if (el->wake_fd[0] == -1)
+    return;
+
+  event_handler_del(&el->wake_ev);
+#ifdef WIN32
+  closesocket(el->wake_fd[0]);
+  closesocket(el->wake_fd[1]);
+#else
+  close(el->wake_fd[0]);
+  if (el->wake_fd[1] != el->wake_fd[0])
+    close(el->wake_fd[1]);
+#endif
+  el->wake_fd[0] = el->wake_fd[1] = -1;
+}
+
+void event_loop_wake(struct sd_event_loop *el)
+{
+#ifdef SD_EVENT_EPOLL
+  uint64_t one = 1;
+#else
+  char one = 1;
+#endif
+
+  if (el->wake_fd[1] == -1)
+    return;
+
+  /* full means a wake is allready pending */
+#ifdef WIN32
+  if (send(el->wake_fd[1], &one, sizeof one, 0) == SOCKET_ERROR &&
+      WSAGetLastError() != WSAEWOULDBLOCK)
+    ui_wsa_err("send");
+#else
+  if (write(el->wake_fd[1], &one, sizeof one) == -1 &&
+      errno != EAGAIN && errno != EWOULDBLOCK)
+    ui_sys_err(errno, "write");
+#endif
+}
+
+/* shorten the wait to the next timer, loop mutex held */
+static int event_loop_wait_timeout(struct sd_event_loop *el, int timeout)
+{
+  uint64_t now;
+  int ms;
+
+  el->waiting = 1;
+
+  if (!el->timer_next)
+    return timeout;
+
+  now = time_get_ms();
+  ms = el->timer_next > now ? (int) (el->timer_next - now) : 0;
+
+  return (timeout < 0 || ms < timeout) ? ms : timeout;
+}
+
+static void event_loop_run_timers(struct sd_event_loop *el)
+{
+  uint64_t next;
+
+  timer_wheel_run(&el->timers);
+  next = timer_wheel_next(&el->timers);
+
+  sd_cs_lock(&el->mutex.cs_mutex);
+  el->waiting = 0;
+  el->timer_next = next;
+  sd_cs_unlock(&el->mutex.cs_mutex);
+}
+
+void event_timer_add(struct sd_event_loop *el, struct sd_timer *t, int ms)
+{
+  uint64_t expires;
+
+  expires = timer_add(&el->timers, t, ms);
+
+  /* a wait that began before may sleep past it */
+  sd_cs_lock(&el->mutex.cs_mutex);
+  if (!el->timer_next || expires < el->timer_next)
+  {
+    el->timer_next = expires;
+    if (el->waiting)
+      event_loop_wake(el);
+  }
+  sd_cs_unlock(&el->mutex.cs_mutex);
+}
+
+void event_handler_init(struct sd_event_handler *eh, event_cb cb, void *v)
+{
+  eh->loop = NULL;
+  eh->fd = -1;
+  eh->events = 0;
+  eh->revents = 0;
+  eh->cb = cb;
+  eh->v = v;
+}
+
+
+// vim:ts=2:expandtab
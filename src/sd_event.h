@@ -0,0 +1,137 @@
+#ifndef SD_EVENT_H
+#define SD_EVENT_H
+
+/* select is only left for windows, where a set is a list of sockets and
+ * can be sized to fit */
+#if defined(__linux__)
+#define SD_EVENT_EPOLL
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || \
+  defined(__APPLE__)
+#define SD_EVENT_KQUEUE
+#elif !defined(WIN32)
+#define SD_EVENT_POLL
+#endif
+
+#if defined(SD_EVENT_EPOLL)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif defined(SD_EVENT_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(SD_EVENT_POLL)
+#include <poll.h>
+#endif
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "sd_linked_list.h"
+#include "sd_thread.h"
+#include "sd_timer.h"
+
+#define SD_EVENT_READ                     0x01
+#define SD_EVENT_WRITE                    0x02
+#define SD_EVENT_ERROR                    0x04
+
+#define SD_EVENT_MAX_READY                 256 /* per wait */
+
+typedef void (*event_cb)(void *v, int events);
+
+struct sd_event_loop;
+
+/*! \brief Readiness registration for a single socket */
+struct sd_event_handler
+{
+  struct sd_event_loop *loop; /* NULL when not registered */
+  int fd;
+  int events; /* interest */
+  int revents; /* ready (poll and select backends) */
+  int index; /* in the handlers of the loop (poll and select backends) */
+
+  event_cb cb;
+  void *v;
+};
+
+/*! \brief Holds the sockets being waited on */
+struct sd_event_loop
+{
+#if defined(SD_EVENT_EPOLL)
+  int ep_fd;
+  struct epoll_event ready[SD_EVENT_MAX_READY];
+#elif defined(SD_EVENT_KQUEUE)
+  int kq_fd;
+  struct kevent ready[SD_EVENT_MAX_READY];
+#else
+  struct sd_event_handler **handlers;
+  int nhandlers;
+  int handlers_len;
+
+  /* taken from the handlers for each wait so it can run unlocked */
+  struct sd_event_handler **ready;
+#ifdef SD_EVENT_POLL
+  struct pollfd *pfds;
+#else
+  fd_set *rfds, *wfds, *efds;
+#endif
+  int wait_len;
+#endif
+  int nready;
+
+  /* lets another thread end a wait, both ends are the same eventfd with
+   * epoll, -1 on windows where the wait timeout has to do */
+  int wake_fd[2];
+  struct sd_event_handler wake_ev;
+
+  /* the wait can run without the lock the handlers are used under, a
+   * handler removed since the wait began may have been freed */
+  struct sd_mutex_state_info mutex;
+  unsigned int ndel;
+  unsigned int wait_ndel;
+
+  /* run after each dispatch, under the same lock as the handlers */
+  struct sd_timer_wheel timers;
+  uint64_t timer_next; /* ms, 0 for none, loop mutex */
+  char waiting; /* loop mutex */
+};
+
+/*! \brief Initialise an event loop */
+extern int event_loop_init(struct sd_event_loop *el);
+
+/*! \brief Cleanup an event loop */
+extern void event_loop_deinit(struct sd_event_loop *el);
+
+/*! \brief Wait up to timeout ms (-1 forever) for registered sockets */
+extern int event_loop_wait(struct sd_event_loop *el, int timeout);
+
+/*! \brief Call the callbacks of the sockets found ready by the last wait,
+ *         skipped if a handler was removed since the wait began, then
+ *         the callbacks of expired timers */
+extern int event_loop_dispatch(struct sd_event_loop *el);
+
+/*! \brief End the current or next wait early, safe from any thread */
+extern void event_loop_wake(struct sd_event_loop *el);
+
+/*! \brief Arm a timer on the loop, with the lock the handlers are used under */
+extern void event_timer_add(struct sd_event_loop *el, struct sd_timer *t, int ms);
+
+/*! \brief Set the callback for a handler (does not register it) */
+extern void event_handler_init(struct sd_event_handler *eh, event_cb cb, void *v);
+
+/*! \brief Start waiting for events on a socket */
+extern int event_handler_add(struct sd_event_loop *el, struct sd_event_handler *eh,
+    int fd, int events);
+
+/*! \brief Change the events being waited for */
+extern int event_handler_mod(struct sd_event_handler *eh, int events);
+
+/*! \brief Stop waiting for events, must be called before closing the socket */
+extern int event_handler_del(struct sd_event_handler *eh);
+
+#endif
+
+
+// vim:ts=2:expandtab
@@ -23,11 +23,17 @@
 #include <string.h>
 #include <inttypes.h>
 
+#include <fcntl.h>
+
 #ifdef WIN32
 #include <windows.h>
 #include <shlwapi.h>
+#include <io.h>
 #else
+#include <unistd.h>
 #include <libgen.h>
+#include <sys/mman.h>
+#include <signal.h>
 #endif
 
 #include "sd_file.h"
@@ -35,6 +41,7 @@
 #include "sd_dynamic_memory.h"
 #include "sd_error.h"
 #include "sd_logging.h"
+#include "sd_globals.h"
 
 void file_set_state(struct file_info *fi, char state)
 {
@@ -173,68 +180,164 @@ char file_exists(const char *filepath)
   return SD_OPTION_ON;
 }
 
+#ifndef WIN32
+/* the mapping each thread is sending from */
+static __thread struct file_info *file_map_current;
+static uintptr_t file_map_page_len;
+
+/* pages past the end of a file that was cut short fault when touched,
+ * zeros are put in their place so the send returns and the transfer is
+ * aborted after it */
+static void file_map_sigbus(int sig, siginfo_t *si, void *ctx)
+{
+  struct file_info *fi = file_map_current;
+  uintptr_t a = (uintptr_t) si->si_addr;
+
+  if (fi && a >= (uintptr_t) fi->map && a < (uintptr_t) fi->map + fi->map_len &&
+      mmap((void *) (a & ~(file_map_page_len - 1)), file_map_page_len,
+        PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+  {
+    fi->map_cut = 1;
+    return;
+  }
+
+  /* not ours, fault again without the handler */
+  signal(SIGBUS, SIG_DFL);
+}
+#endif
+
+void file_map_init(void)
+{
+#ifndef WIN32
+  struct sigaction sa;
+
+  file_map_page_len = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_sigaction = &file_map_sigbus;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGBUS, &sa, NULL);
+#endif
+}
+
+void file_map_enter(struct file_info *fi)
+{
+#ifndef WIN32
+  file_map_current = fi;
+#endif
+}
+
+int file_map_leave(struct file_info *fi)
+{
+#ifndef WIN32
+  file_map_current = NULL;
+#endif
+  return fi->map_cut ? -1 : 0;
+}
+
+/* outgoing data is sent from the page cache, which every transfer of
+ * the file shares */
+static void file_map(struct file_info *fi, uint64_t size)
+{
+#ifndef WIN32
+  void *m;
+
+  if (size == 0 || size > (uint64_t) SIZE_MAX)
+    return;
+
+  m = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fi->fd, 0);
+  if (m == MAP_FAILED) {
+    ui_notify_printf("The file could not be mapped (%s), reading it instead.",
+        strerror(errno));
+    return;
+  }
+  madvise(m, (size_t) size, MADV_SEQUENTIAL);
+
+  fi->map = (char *) m;
+  fi->map_len = size;
+#endif
+}
+
+void file_unmap(struct file_info *fi)
+{
+#ifndef WIN32
+  if (!fi->map)
+    return;
+
+  munmap(fi->map, (size_t) fi->map_len);
+#endif
+  fi->map = NULL;
+  fi->map_len = 0;
+}
+
 int file_open(struct file_info *fi, char direction)
 {
-  char *fullpath, *mode;
+  char *fullpath;
+  int flags;
 
   fullpath = file_make_full_path(fi->name, fi->directory);
 
+  fi->map = NULL;
+  fi->map_len = 0;
+  fi->map_cut = 0;
+
   /* set the mode */
   switch (direction)
   {
     case DATA_TRANSFER_DIRECTION_OUTGOING:
-      mode = "rb";
+      flags = O_RDONLY;
       break;
     case DATA_TRANSFER_DIRECTION_INCOMING:
-      if (file_exists(fullpath) == SD_OPTION_ON) {
-        mode = "r+b";
-      }
-      else {
-        mode = "w+b";
-      }
+      /* kept if it exists, a transfer may resume into it */
+      flags = O_RDWR | O_CREAT;
       break;
     case SD_TO_LOG_FILE:
-      mode = "a";
+    default:
+      flags = O_WRONLY | O_CREAT | O_APPEND;
       break;
   }
 
-  fi->file = fopen(fullpath, mode);
+#ifdef WIN32
+  fi->fd = _open(fullpath, flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  fi->fd = open(fullpath, flags | O_CLOEXEC, 0666);
+#endif
 
-  if (!fi->file) {
-    ui_sys_err(errno, "fopen");
+  if (fi->fd == -1) {
+    ui_sys_err(errno, "open");
     goto file_open_error;
   }
 
-  /* no need to set position for logging */
+  /* no need to check position for logging */
   if (direction == SD_TO_LOG_FILE)
     goto file_open_success;
 
-
-  /* set position */
+  /* the size of what was opened, not of what is at the path now */
   uint64_t size;
-  if (file_get_size(fullpath, &size) == -1)
+#ifdef WIN32
+  struct _stati64 fd_stat;
+
+  if (_fstati64(fi->fd, &fd_stat) == -1) {
+#else
+  struct stat fd_stat;
+
+  if (fstat(fi->fd, &fd_stat) == -1) {
+#endif
+    ui_sys_err(errno, "fstat");
     goto file_open_error;
+  }
+  size = (uint64_t) fd_stat.st_size;
 
+  /* reads and writes go to position, there is no file pointer to set */
   if (fi->position > size) {
     ui_sd_err("Required an invalid file position.");
     goto file_open_error;
   }
-  /* useable */
-  else if(fi->position == size) {
-    /* at the end */
-    if (file_seek(fi->file, 0, SEEK_END) == -1) {
-      ui_sys_err(errno, "fseeko");
-      goto file_open_error;
-    }
-  }
-  else
-  {
-    /* normal seek */
-    if (file_seek(fi->file, (off_t) fi->position, SEEK_SET) == -1) {
-      ui_sys_err(errno, "fseeko");
-      goto file_open_error;
-    }
-  }
+
+  if (direction == DATA_TRANSFER_DIRECTION_OUTGOING &&
+      gbls->conf->data_mmap == SD_OPTION_ON)
+    file_map(fi, size);
 
 file_open_success:
   file_set_state(fi, FILE_STATE_OPENED);
@@ -242,51 +345,126 @@ file_open_success:
   return 0;
 
 file_open_error:
+  if (fi->fd != -1) {
+#ifdef WIN32
+    _close(fi->fd);
+#else
+    close(fi->fd);
+#endif
+    fi->fd = -1;
+  }
   SAFE_FREE(fullpath);
   return -1;
 }
 
-int file_seek(FILE *fptr, uint64_t pos, int whence)
+int file_dup(struct file_info *dst, const struct file_info *src)
 {
+  memcpy(dst, src, sizeof(struct file_info));
+  dst->map = NULL;
+  dst->map_len = 0;
+
 #ifdef WIN32
-  if (fseeko64(fptr, (off_t) pos, whence) == -1)
-    return -1;
+  dst->fd = _dup(src->fd);
 #else
-  if (fseeko(fptr, (off_t) pos, whence) == -1)
-    return -1;
+  dst->fd = fcntl(src->fd, F_DUPFD_CLOEXEC, 0);
 #endif
 
-  /* success */
+  if (dst->fd == -1) {
+    ui_sys_err(errno, "dup");
+    file_set_state(dst, FILE_STATE_CLOSED);
+    return -1;
+  }
+
+  file_set_state(dst, FILE_STATE_OPENED);
   return 0;
 }
 
-int file_tell(FILE *fptr, uint64_t *pos)
+int file_pread(struct file_info *fi, char *b, int len, uint64_t pos)
 {
-  off_t p;
+  int bread;
 
 #ifdef WIN32
-  p = ftello64(fptr);
+  if (_lseeki64(fi->fd, (__int64) pos, SEEK_SET) == -1)
+    return -1;
+  bread = _read(fi->fd, b, len);
 #else
-  p = ftello(fptr);
+  do
+    bread = (int) pread(fi->fd, b, len, (off_t) pos);
+  while (bread == -1 && errno == EINTR);
 #endif
 
-  if (p == -1)
+  return bread;
+}
+
+int file_pwrite(struct file_info *fi, const char *b, int len, uint64_t pos)
+{
+  int bwrite, done;
+
+#ifdef WIN32
+  if (_lseeki64(fi->fd, (__int64) pos, SEEK_SET) == -1)
     return -1;
+#endif
 
-  /* success */
-  *pos = (uint64_t) p;
-  return 0;
+  for (done = 0; done < len; done += bwrite)
+  {
+#ifdef WIN32
+    bwrite = _write(fi->fd, b + done, len - done);
+#else
+    bwrite = (int) pwrite(fi->fd, b + done, len - done,
+        (off_t) (pos + done));
+    if (bwrite == -1 && errno == EINTR) {
+      bwrite = 0;
+      continue;
+    }
+#endif
+    if (bwrite <= 0)
+      return -1;
+  }
+
+  return done;
+}
+
+int file_write(struct file_info *fi, const char *b, int len)
+{
+  int bwrite, done;
+
+  for (done = 0; done < len; done += bwrite)
+  {
+#ifdef WIN32
+    bwrite = _write(fi->fd, b + done, len - done);
+#else
+    bwrite = (int) write(fi->fd, b + done, len - done);
+    if (bwrite == -1 && errno == EINTR) {
+      bwrite = 0;
+      continue;
+    }
+#endif
+    if (bwrite <= 0)
+      return -1;
+  }
+
+  return done;
 }
 
 int file_close(struct file_info *fi)
 {
+  int ret;
+
   if (fi->state != FILE_STATE_CLOSED)
   {
     file_set_state(fi, FILE_STATE_CLOSED);
+    file_unmap(fi);
+
+#ifdef WIN32
+    ret = _close(fi->fd);
+#else
+    ret = close(fi->fd);
+#endif
+    fi->fd = -1;
 
-    if (fclose(fi->file))
+    if (ret == -1)
     {
-      ui_sys_err(errno, "fopen");
+      ui_sys_err(errno, "close");
       return -1;
     }
   }
@@ -17,7 +17,10 @@ struct file_info
   //time_t modtime;
   char modtime[SD_MAX_MODIFICATION_TIME_LEN];
 
-  FILE *file;
+  int fd; /* reads and writes are at an explicit position */
+  char *map; /* outgoing file mapped read-only, NULL if read with file */
+  uint64_t map_len;
+  char map_cut; /* the file shrank under the mapping */
   char state;
 #define FILE_STATE_CLOSED         0
 #define FILE_STATE_OPENED         1
@@ -46,11 +49,32 @@ extern char file_exists(const char *filepath);
 /*! \brief Open file with state specific mode */
 extern int file_open(struct file_info *fi, char direction);
 
-/*! \brief Set the file pointer */
-extern int file_seek(FILE *fi, uint64_t pos, int whence);
+/*! \brief Open the same file again on a descriptor of its own, src
+ *         may then be closed while dst is still read */
+extern int file_dup(struct file_info *dst, const struct file_info *src);
 
-/*! \brief Get the currect file pointer */
-extern int file_tell(FILE *fi, uint64_t *pos);
+/*! \brief Read up to len bytes at pos, returns 0 at the end of the file */
+extern int file_pread(struct file_info *fi, char *b, int len, uint64_t pos);
+
+/*! \brief Write all len bytes at pos */
+extern int file_pwrite(struct file_info *fi, const char *b, int len, uint64_t pos);
+
+/*! \brief Write all len bytes at the end of a file opened for logging */
+extern int file_write(struct file_info *fi, const char *b, int len);
+
+/*! \brief Catch the faults of sending from a mapped file that was cut
+ *         short, once before any file is mapped */
+extern void file_map_init(void);
+
+/*! \brief Mark fi as the mapping this thread is about to send from */
+extern void file_map_enter(struct file_info *fi);
+
+/*! \brief Done sending from the mapping of fi, -1 if the file was cut
+ *         short while it was */
+extern int file_map_leave(struct file_info *fi);
+
+/*! \brief Unmap the file if it was mapped */
+extern void file_unmap(struct file_info *fi);
 
 /*! \brief Close the file */
 extern int file_close(struct file_info *fi);
@@ -30,9 +30,12 @@ void sd_globals_alloc()
   SAFE_CALLOC(gbls->cl_opts, 1, sizeof(struct sd_cl_options));
   SAFE_CALLOC(gbls->prog, 1, sizeof(struct sd_prog_info));
   SAFE_CALLOC(gbls->net, 1, sizeof(struct sd_net_info));
+  SAFE_CALLOC(gbls->core, 1, sizeof(struct sd_core_info));
+  SAFE_CALLOC(gbls->pool, 1, sizeof(struct sd_job_pool));
+  SAFE_CALLOC(gbls->io_pool, 1, sizeof(struct sd_job_pool));
+  SAFE_CALLOC(gbls->resolver, 1, sizeof(struct sd_resolver));
+  SAFE_CALLOC(gbls->buffers, 1, sizeof(struct sd_buffer_pool));
   SAFE_CALLOC(gbls->logging, 1, sizeof(struct sd_logging_info));
-
-  reset_frame_info(&gbls->frame);
 }
 
 void sd_globals_free()
@@ -42,6 +45,11 @@ void sd_globals_free()
   SAFE_FREE(gbls->ui);
   SAFE_FREE(gbls->prog);
   SAFE_FREE(gbls->net);
+  SAFE_FREE(gbls->core);
+  SAFE_FREE(gbls->pool);
+  SAFE_FREE(gbls->io_pool);
+  SAFE_FREE(gbls->resolver);
+  SAFE_FREE(gbls->buffers);
   SAFE_FREE(gbls->logging);
   SAFE_FREE(gbls);
 }
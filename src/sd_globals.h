@@ -8,6 +8,8 @@
 #include "sd_peers.h"
 #include "sd_timing.h"
 #include "sd_thread.h"
+#include "sd_resolve.h"
+#include "sd_buffer.h"
 
 /*! \brief Default values that are set with configuration file */
 struct sd_conf
@@ -33,6 +35,44 @@ struct sd_conf
   /* logging */
   char logging_enabled;
   char logging_path[SD_MAX_PATH_LEN];
+
+  /* core */
+  int core_workers;
+  int job_pool_threads;
+  int io_pool_threads;
+  char data_io_uring;
+  char data_sendfile;
+  char data_splice;
+  char data_ktls;
+  char data_mmap;
+  char data_read_ahead;
+
+  /* kB of received data a transfer may have waiting for the disk, 0 to
+   * write each buffer before the next is received */
+  int data_write_behind;
+
+  /* data connections an outgoing file is split over, changed per transfer */
+  int data_streams;
+
+  /* outgoing data goes in frames with a CRC32C, damaged ones are sent
+   * again */
+  char data_checksum;
+
+  /* kB, the data buffer of a transfer follows the connection within */
+  int data_window_min;
+  int data_window_max;
+
+  /* servers, 0 for the defaults */
+  int server_backlog;
+  int server_accept_budget;
+
+  /* seconds, 0 to not cache */
+  int resolve_cache_ttl;
+
+  /* timeouts in seconds, 0 for none */
+  int con_timeout;
+  int data_verdict_timeout;
+  int data_idle_timeout;
 };
 
 /*! \brief Command line options */
@@ -65,7 +105,7 @@ struct sd_ui_info
   void (*notify)(const char *m);
   void (*state_set)(int os, int ns);
   void (*data_transfer_change)(
-      struct sd_data_transfer_info *dti, char changetype);
+      struct sd_data_transfer_info *dti, char changetype, char verdict);
   void (*data_transfer_progress_change)(
       struct sd_data_transfer_info *dti);
   void (*data_transfer_accepted)(struct sd_data_transfer_info *dti);
@@ -73,6 +113,7 @@ struct sd_ui_info
   char initialized;
   char iface;
   linked_list status_backlog;
+  linked_list event_backlog; /* struct sd_ui_event, from the core thread */
   struct sd_mutex_state_info mutex;
 
 #define UI_GTK 0
@@ -81,8 +122,9 @@ struct sd_ui_info
 /*! \brief Network information */
 struct sd_net_info
 {
-  fd_set master_fd_set;
-  int highest_fd;
+  /* sockets waiting for io, one per core worker */
+  struct sd_event_loop *event_loops;
+  int n_event_loops;
   SSL_CTX *ssl_ctx; /* holds default values for SSL structs */
 
   /* servers */
@@ -95,6 +137,34 @@ struct sd_net_info
   
 };
 
+/*! \brief A networking core thread and its event loop */
+struct sd_core_worker
+{
+  int id; /* also the index of its event loop */
+
+  /* held while the worker uses core data, proc_state is
+   * PROC_STATE_INCOMPLETE while the thread runs */
+  struct sd_mutex_state_info mutex;
+};
+
+/*! \brief Networking core thread information */
+struct sd_core_info
+{
+  /* worker 0 runs the state machines, servers and control connections,
+   * the others move the transfer data of the peers pinned to them */
+  struct sd_core_worker *workers;
+  int n_workers;
+  int next_worker; /* for pinning new peers */
+  volatile char running;
+
+  /* lookups and other steps that finish later report here, worker 0
+   * runs the state machine of each as it comes in */
+  struct sd_completion_queue done;
+
+  /* a server, accept address or peer is waiting to be removed */
+  char collect;
+};
+
 /*! \brief Logging info */
 struct sd_logging_info
 {
@@ -109,8 +179,12 @@ struct sd_globals
   struct sd_prog_info *prog;
   struct sd_ui_info *ui;
   struct sd_net_info *net;
+  struct sd_core_info *core;
+  struct sd_job_pool *pool;
+  struct sd_job_pool *io_pool;
+  struct sd_resolver *resolver;
+  struct sd_buffer_pool *buffers;
   struct sd_logging_info *logging;
-  frame frame;
 };
 
 extern struct sd_globals *gbls;
@@ -34,63 +34,269 @@
 #include "sd_protocol.h"
 #include "sd_version.h"
 #include "sd_thread.h"
+#include "sd_event.h"
+#include "sd_error.h"
+#include "sd_dynamic_memory.h"
 
 void ui_idle(void)
 {
-  relieve_cpu();
+  /* update the ui with what the core has done */
+  ui_process_event_backlog();
 
+  /* print and remove status */
+  ui_process_status_backlog();
+}
+
+void core_idle(void)
+{
   /* main loop */
   
-  /* garbage collection */
+  /* garbage collection, only once something was marked */
+  if (gbls->core->collect)
+  {
+    gbls->core->collect = 0;
 
-  /* cleanup server accept addresses */
-  linked_list_iterate(&gbls->net->con_servers, &server_accept_rem_all_state_delete_iter);
-  /* remove servers required */
-  server_rem_all_state_delete();
-  /* remove peers required */
-  peer_rem_all_state_delete();
+    /* cleanup server accept addresses */
+    linked_list_iterate(&gbls->net->con_servers, &server_accept_rem_all_state_delete_iter);
+    /* remove servers required */
+    server_rem_all_state_delete();
+    /* remove peers required */
+    peer_rem_all_state_delete();
+  }
 
+  /* server, accept address, connection and transfer states move on when
+   * a step they started has finished or something they wait on changed */
+  completion_queue_run();
+}
 
+/* the other workers in order, worker 0's lock is already held */
+static void core_lock_others(void)
+{
+  int i;
 
-  /* handle servers */
-  linked_list_iterate(&gbls->net->con_servers, &sd_mutex_serv_idle);
-  linked_list_iterate(&gbls->net->con_servers, &sd_mutex_serv_accept_idle);
+  for (i = 1; i < gbls->core->n_workers; i++)
+    sd_cs_lock(&gbls->core->workers[i].mutex.cs_mutex);
+}
 
+static void core_unlock_others(void)
+{
+  int i;
 
+  for (i = gbls->core->n_workers - 1; i >= 1; i--)
+    sd_cs_unlock(&gbls->core->workers[i].mutex.cs_mutex);
+}
 
-  /* handle control connection states */
-  linked_list_iterate(&gbls->net->peers, &sd_mutex_con_idle);
-  
-  /* handle transfer connection states */
-  linked_list_iterate(&gbls->net->peers, &sd_mutex_data_con_idle_iter);
+/* all the workers in order, so the holder has every peer to itself */
+static void core_lock_all(void)
+{
+  sd_cs_lock(&gbls->core->workers[0].mutex.cs_mutex);
+  core_lock_others();
+}
 
-  /* handle transfer states */
-  linked_list_iterate(&gbls->net->peers, &data_transfer_idle_iter);
+static void core_unlock_all(void)
+{
+  core_unlock_others();
+  sd_cs_unlock(&gbls->core->workers[0].mutex.cs_mutex);
+}
 
-  /* get control messages */
-  linked_list_iterate(&gbls->net->peers, &ctl_recv_iter_cb);
+int core_loop(void)
+{
+  struct sd_core_worker *w = &gbls->core->workers[0];
+  struct sd_event_loop *el = &gbls->net->event_loops[0];
 
-  /* handle recieved commands */
-  linked_list_iterate(&gbls->net->peers, &ctl_process_cmd_iter_cb);
+  sd_cs_lock(&w->mutex.cs_mutex);
 
-  /* print and remove status */
-  ui_process_status_backlog();
+  while (gbls->core->running)
+  {
+    /* the state machines can reach into any peer, so the other workers
+     * are only stopped when there is something for them to run */
+    if (gbls->core->collect || completion_queue_pending())
+    {
+      core_lock_others();
+      core_idle();
+      core_unlock_others();
+    }
+
+    /* block without the lock so the ui can get in, state changes,
+     * finished threads and the ui wake us for another pass */
+    sd_cs_unlock(&w->mutex.cs_mutex);
+    event_loop_wait(el, CORE_WAIT_MS);
+    sd_cs_lock(&w->mutex.cs_mutex);
+
+    /* accept, recieve and send on the sockets that are ready, handlers
+     * that change a peer take the lock of its worker too */
+    event_loop_dispatch(el);
+  }
+
+  sd_cs_unlock(&w->mutex.cs_mutex);
+
+  return PROC_STATE_COMPLETE;
 }
 
-void relieve_cpu(void)
+int core_worker_loop(struct sd_core_worker *w)
 {
-#ifndef WIN32
-  /* save cpu */
-  set_next_frame(&gbls->frame);
-  if (gbls->frame.prev_d < FRAME_TIME_MIN_S)
+  struct sd_event_loop *el = &gbls->net->event_loops[w->id];
+
+  while (gbls->core->running)
   {
+    event_loop_wait(el, CORE_WAIT_MS);
+
+    /* only transfer data of our own peers is moved here */
+    sd_cs_lock(&w->mutex.cs_mutex);
+    event_loop_dispatch(el);
+    sd_cs_unlock(&w->mutex.cs_mutex);
+  }
+
+  return PROC_STATE_COMPLETE;
+}
+
+void core_init(void)
+{
+  int i;
+
+  /* a worker for each event loop */
+  gbls->core->n_workers = gbls->net->n_event_loops;
+  SAFE_CALLOC(gbls->core->workers, gbls->core->n_workers,
+      sizeof(struct sd_core_worker));
+
+  for (i = 0; i < gbls->core->n_workers; i++)
+  {
+    gbls->core->workers[i].id = i;
+    sd_thread_init(&gbls->core->workers[i].mutex.cs_mutex);
+    sd_set_mutex_state(&gbls->core->workers[i].mutex.proc_state,
+        PROC_STATE_COMPLETE);
+  }
+
+  gbls->core->next_worker = 0;
+  gbls->core->running = 0;
+  gbls->core->collect = 0;
+
+  /* for the blocking parts of the state machines */
+  job_pool_init(gbls->conf->job_pool_threads);
+  io_pool_init(gbls->conf->io_pool_threads);
+  data_write_behind_account_init();
+}
+
+void core_deinit(void)
+{
+  int i;
+
+  job_pool_deinit();
+  io_pool_deinit();
+  data_write_behind_account_deinit();
+
+  for (i = 0; i < gbls->core->n_workers; i++)
+    sd_thread_deinit(&gbls->core->workers[i].mutex.cs_mutex);
+  SAFE_FREE(gbls->core->workers);
+}
+
+void core_start(void)
+{
+  int i;
+
+  gbls->core->running = 1;
+
+  for (i = 0; i < gbls->core->n_workers; i++)
+  {
+    sd_set_mutex_state(&gbls->core->workers[i].mutex.proc_state,
+        PROC_STATE_INCOMPLETE);
+    sd_create_thread(&sd_mutex_core_func, &gbls->core->workers[i]);
+  }
+}
+
+void core_stop(void)
+{
+  int i;
+
+  gbls->core->running = 0;
+
+  for (i = 0; i < gbls->core->n_workers; i++)
+  {
+    event_loop_wake(&gbls->net->event_loops[i]);
+
+    while (gbls->core->workers[i].mutex.proc_state == PROC_STATE_INCOMPLETE)
+    {
 #ifdef WIN32
-    Sleep(FRAME_SLEEP_MS);
+      Sleep(CORE_STOP_POLL_MS);
 #else
-    usleep(FRAME_SLEEP_US);
+      usleep(CORE_STOP_POLL_MS * 1000);
 #endif
+    }
   }
-#endif
+}
+
+void core_wake(void)
+{
+  if (gbls->core->running)
+    event_loop_wake(&gbls->net->event_loops[0]);
+}
+
+void core_collect(void)
+{
+  gbls->core->collect = 1;
+}
+
+void core_lock_peer(struct sd_peer_info *pi)
+{
+  if (pi->worker)
+    sd_cs_lock(&gbls->core->workers[pi->worker].mutex.cs_mutex);
+}
+
+void core_unlock_peer(struct sd_peer_info *pi)
+{
+  if (pi->worker)
+    sd_cs_unlock(&gbls->core->workers[pi->worker].mutex.cs_mutex);
+}
+
+/* only the peer's data connections move to its worker, the control
+ * connection stays on worker 0 with the servers, timers and completions.
+ * Its commands add and free transfers, accept data connections on the
+ * shared servers and start lookups whose completions run on the core, all
+ * of which worker 0 owns. Worker 0 then takes just the peer's worker lock
+ * (core_lock_peer) to reach the transfers it moves. Control traffic is a
+ * few lines per file, so it costs the data workers nothing to leave it. */
+int core_next_worker(void)
+{
+  int w;
+
+  /* worker 0 is busy with everything else when there are others */
+  if (gbls->core->n_workers < 2)
+    return 0;
+
+  w = 1 + gbls->core->next_worker % (gbls->core->n_workers - 1);
+  gbls->core->next_worker++;
+
+  return w;
+}
+
+/* handlers can run inside each other, a gtk update emitting a signal, so
+ * only the outermost takes the locks, ui thread only */
+static int core_ui_depth;
+
+void core_lock(void)
+{
+  if (!core_ui_depth++)
+    core_lock_all();
+}
+
+void core_unlock(void)
+{
+  if (!--core_ui_depth)
+    core_unlock_all();
+
+  /* whatever the ui did may need a pass */
+  core_wake();
+}
+
+void core_lock_read(void)
+{
+  core_lock();
+}
+
+void core_unlock_read(void)
+{
+  if (!--core_ui_depth)
+    core_unlock_all();
 }
 
 
@@ -1,16 +1,69 @@
 #ifndef SD_IDLE_H
 #define SD_IDLE_H
 
-#define FRAME_TIME_MIN_S  0.03 /* s */
+struct sd_core_worker;
+struct sd_peer_info;
 
-#define FRAME_SLEEP_MS                        1 /* ms */
-#define FRAME_SLEEP_US    FRAME_SLEEP_MS * 1000 /* us */
+/* longest the core sleeps with nothing to do, for progress updates */
+#define CORE_WAIT_MS                        250 /* ms */
 
-/*! \brief Contains the main sd processing loop */
+#define CORE_STOP_POLL_MS                     1 /* ms */
+
+#define CORE_WORKERS_MAX                     64
+
+/*! \brief Processes what the core thread queued for the UI, UI thread only */
 extern void ui_idle(void);
 
-/*! \brief For efficiency */
-extern void relieve_cpu(void);
+/*! \brief Contains the main sd processing loop, core lock must be held */
+extern void core_idle(void);
+
+/*! \brief Runs core_idle until core_stop is called, core worker 0 only */
+extern int core_loop(void);
+
+/*! \brief Moves transfer data until core_stop is called, other workers */
+extern int core_worker_loop(struct sd_core_worker *w);
+
+/*! \brief Initialise the networking core */
+extern void core_init(void);
+
+/*! \brief Cleanup the networking core */
+extern void core_deinit(void);
+
+/*! \brief Start the networking core threads */
+extern void core_start(void);
+
+/*! \brief Stop the networking core threads and wait for them to exit */
+extern void core_stop(void);
+
+/*! \brief Get the worker a new peer is pinned to */
+extern int core_next_worker(void);
+
+/*! \brief Lock the worker pi is pinned to, for event loop 0 handlers
+ *         that change the peer, worker 0's lock is held already */
+extern void core_lock_peer(struct sd_peer_info *pi);
+
+/*! \brief Unlock the worker pi is pinned to */
+extern void core_unlock_peer(struct sd_peer_info *pi);
+
+/*! \brief Have the core thread make another pass, safe from any thread */
+extern void core_wake(void);
+
+/*! \brief Have the next pass remove what was put in a delete state, core
+ *         lock must be held */
+extern void core_collect(void);
+
+/*! \brief Lock the core data of every worker, for UI handlers that change
+ *         it, never held while the UI waits */
+extern void core_lock(void);
+
+/*! \brief Unlock the core data and wake the core to act on any changes */
+extern void core_unlock(void);
+
+/*! \brief Lock the core data of every worker, for UI code that only looks */
+extern void core_lock_read(void);
+
+/*! \brief Unlock the core data, the core has nothing new to do */
+extern void core_unlock_read(void);
 
 #endif
 
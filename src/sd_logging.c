@@ -60,15 +60,11 @@ int logging_print_line(const char *m)
 
   snprintf(nline, l, "%s %s\n", t, m);
 
-  if (fputs(nline, gbls->logging->file.file) == EOF) {
+  /* not buffered, the line is in the file once written */
+  if (file_write(&gbls->logging->file, nline, strlen(nline)) == -1)
     ret = -1;
-  }
-  else {
+  else
     ret = 0;
-    
-    if (fflush(gbls->logging->file.file) == EOF)
-      ret = -1;
-  }
 
 
   SAFE_FREE(nline);
@@ -28,6 +28,7 @@
 #include "sd_cl_parser.h"
 #include "sd_ui.h"
 #include "sd_logging.h"
+#include "sd_idle.h"
 
 int main(int argc, char **argv)
 {
@@ -46,6 +47,10 @@ int main(int argc, char **argv)
 
   ssl_init();
 
+  core_init();
+
+  core_start();
+
   ui_begin();
   
   
@@ -53,6 +58,10 @@ int main(int argc, char **argv)
    * wait for ui to end 
    ****************************************/
 
+  core_stop();
+
+  core_deinit();
+
   ssl_deinit();
 
   ui_deinit();
@@ -14,7 +14,12 @@
    GNU General Public License for more details.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4() */
+#endif
+
 #include <stdio.h>
+#include <limits.h>
 #include <openssl/ssl.h>
 #include <inttypes.h>
 #include <errno.h>
@@ -30,10 +35,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <sys/time.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #endif
 
@@ -50,11 +57,20 @@
 #include "sd_thread.h"
 #include "sd_peers.h"
 #include "sd_error.h"
+#include "sd_idle.h"
+#include "sd_crc.h"
+
+/* hands back the socket non-blocking and close-on-exec in one call */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define SD_ACCEPT4
+#endif
 
 static struct sockaddr_storage current_peer_to_validate;
 
 void net_init()
 {
+  int i;
+
 #ifdef WIN32
   WSADATA wsaData;
 
@@ -62,17 +78,50 @@ void net_init()
   {
     ON_ERROR_EXIT("WSAStartup failed.\n");
   }
+#else
+  /* SSL_write() has no MSG_NOSIGNAL, a closed peer is seen as EPIPE instead */
+  signal(SIGPIPE, SIG_IGN);
 #endif
 
-  FD_ZERO(&gbls->net->master_fd_set);
-  gbls->net->highest_fd = 0;
+  /* one event loop per core worker */
+  gbls->net->n_event_loops = gbls->conf->core_workers;
+  if (gbls->net->n_event_loops < 1)
+    gbls->net->n_event_loops = 1;
+  if (gbls->net->n_event_loops > CORE_WORKERS_MAX)
+    gbls->net->n_event_loops = CORE_WORKERS_MAX;
+
+  SAFE_CALLOC(gbls->net->event_loops, gbls->net->n_event_loops,
+      sizeof(struct sd_event_loop));
+
+  for (i = 0; i < gbls->net->n_event_loops; i++)
+  {
+    if (event_loop_init(&gbls->net->event_loops[i]) == -1)
+      ON_SYS_ERROR_EXIT(errno, "event_loop_init");
+  }
   
   linked_list_init(&gbls->net->peers);
   linked_list_init(&gbls->net->con_servers);
+
+  resolver_init(gbls->conf->resolve_cache_ttl);
+  buffer_pool_init();
+  crc32c_init();
+  file_map_init();
+
+  /* transfer window limits, 0 for the defaults */
+  if (gbls->conf->data_window_min <= 0)
+    gbls->conf->data_window_min = DATA_WINDOW_MIN_DEFAULT;
+  if (gbls->conf->data_window_max <= 0)
+    gbls->conf->data_window_max = DATA_WINDOW_MAX_DEFAULT;
+  if (gbls->conf->data_window_max > DATA_WINDOW_MAX_LIMIT)
+    gbls->conf->data_window_max = DATA_WINDOW_MAX_LIMIT;
+  if (gbls->conf->data_window_min > gbls->conf->data_window_max)
+    gbls->conf->data_window_min = gbls->conf->data_window_max;
 }
 
 void net_deinit()
 {
+  int i;
+
 #ifdef WIN32
   WSACleanup();
 #endif
@@ -87,7 +136,16 @@ void net_deinit()
       &gbls->net->peers,
       SD_OPTION_ON,
       (void (*)(void *)) &peer_deinit);
-  
+
+  for (i = 0; i < gbls->net->n_event_loops; i++)
+    event_loop_deinit(&gbls->net->event_loops[i]);
+  SAFE_FREE(gbls->net->event_loops);
+
+  /* after the job pool, nothing is looking up now */
+  resolver_deinit();
+
+  /* the transfers have given theirs back */
+  buffer_pool_deinit();
 }
 
 
@@ -102,7 +160,7 @@ struct sd_serv_info *server_init(const char *a, const char *s, char essl,
   si = (struct sd_serv_info *) server_add()->value;
 
   sd_set_state(&si->state, SERVER_STATE_CLOSED);
-  sd_thread_init(&si->mutex_state.cs_mutex);
+  completion_init(&si->step, (completion_cb) &handle_server_state, (void *) si);
 
   resolve_addr_set_info(&si->resolve_addr, a, s, SD_OPTION_OFF);
 
@@ -111,10 +169,10 @@ struct sd_serv_info *server_init(const char *a, const char *s, char essl,
   memcpy(&si->ssl_verify, vi, sizeof si->ssl_verify);
   
   linked_list_init(&si->accept_addresses);
-  
-  si->read_timeout.tv_sec = 0;
-  si->read_timeout.tv_usec = 0;
 
+  event_handler_init(&si->ev, &server_event_cb, (void *) si);
+  timer_init(&si->accept_timer, &server_accept_timer_cb, (void *) si);
+  
   si->type = t;
 
   return si;
@@ -135,6 +193,11 @@ struct list_item *server_add()
 
 void server_deinit(struct sd_serv_info *si)
 {
+  event_handler_del(&si->ev);
+  timer_del(&si->accept_timer);
+  resolve_addr_free(&si->resolve_addr);
+  completion_cancel(&si->step);
+
   linked_list_deinit_rem_all_entries(&si->accept_addresses,
       SD_OPTION_ON, (void (*)(void *)) &server_accept_deinit);
 }
@@ -169,9 +232,17 @@ void server_start_state_machine(struct sd_serv_info *si, char istate, char t)
     ON_ERROR_EXIT("Server state machine error");
 
   sd_set_state(&si->state, istate);
-  /* run thread */
+  /* start the lookup, handle_server_state() picks up the result */
   if (t == SD_OPTION_ON)
-    sd_create_thread((thread_pos_cb)(&sd_mutex_server_func), (void *)si);
+  {
+    switch (si->state)
+    {
+      case SERVER_STATE_RESOLVE_IP:
+        ui_notify("Attempting to resolve local addresses...");
+        resolve_addr_lookup(&si->resolve_addr, &si->step);
+        break;
+    }
+  }
 }
 
 void handle_server_state(struct sd_serv_info *si)
@@ -181,9 +252,9 @@ void handle_server_state(struct sd_serv_info *si)
     case SERVER_STATE_CLOSED:
       break;
     case SERVER_STATE_RESOLVE_IP:
-      if (si->mutex_state.proc_state != PROC_STATE_INCOMPLETE)
+      if (si->step.proc_state != PROC_STATE_INCOMPLETE)
       {
-        if (si->mutex_state.proc_state == PROC_STATE_COMPLETE)
+        if (si->step.proc_state == PROC_STATE_COMPLETE)
         {
           /* bind and listen */
           if (server_bind(si) == -1) {
@@ -193,9 +264,11 @@ void handle_server_state(struct sd_serv_info *si)
             {
               case SERVER_TYPE_CONTROL:
                 sd_set_state(&si->state, SERVER_STATE_DELETE);
+                core_collect();
                 break;
               case SERVER_TYPE_DATA:
                 sd_set_state(&si->state, SERVER_STATE_DELETE);
+                core_collect();
                 break;
             }
           }
@@ -216,9 +289,11 @@ void handle_server_state(struct sd_serv_info *si)
           {
             case SERVER_TYPE_CONTROL:
               sd_set_state(&si->state, SERVER_STATE_DELETE);
+              core_collect();
               break;
             case SERVER_TYPE_DATA:
               sd_set_state(&si->state, SERVER_STATE_DELETE);
+              core_collect();
               break;
           }
         }
@@ -226,31 +301,12 @@ void handle_server_state(struct sd_serv_info *si)
       }
       break;
     case SERVER_STATE_LISTENING:
-      server_handle_con(si);
+      /* clients are accepted from server_event_cb() */
       break;
   }
   
 }
 
-int handle_server_thread(struct sd_serv_info *si)
-{
-  switch (si->state)
-  {
-    case SERVER_STATE_CLOSED:
-      break;
-    case SERVER_STATE_RESOLVE_IP:
-      ui_notify("Attempting to resolve local addresses...");
-      if (address_lookup(&si->resolve_addr) == -1)
-        return PROC_STATE_COMPLETE_WITH_ERROR;
-      break;
-    case SERVER_STATE_LISTENING:
-      break;
-  }
-
-  /* success */
-  return PROC_STATE_COMPLETE;
-}
-
 int server_bind(struct sd_serv_info *serv)
 {
   struct addrinfo *res_p;
@@ -277,7 +333,7 @@ int server_bind(struct sd_serv_info *serv)
     {
       ui_sock_err("bind");
       /* close & no need to shutodwn ssl */
-      socket_close(&serv->list_sock_fd, SD_OPTION_OFF, SD_OPTION_OFF, NULL);
+      socket_close(&serv->list_sock_fd, SD_OPTION_OFF, NULL);
       continue;
     }
 
@@ -295,20 +351,25 @@ int server_bind(struct sd_serv_info *serv)
   SAFE_CALLOC(serv->servinfo.ai_addr, 1, serv->servinfo.ai_addrlen);
   memcpy(serv->servinfo.ai_addr, res_p->ai_addr, serv->servinfo.ai_addrlen);
 
-  freeaddrinfo(serv->resolve_addr.res_ai); /* finished with list */
+  resolve_addr_free(&serv->resolve_addr); /* finished with list */
 
-  if (listen(serv->list_sock_fd, BACKLOG) == -1)
+  serv->backlog = gbls->conf->server_backlog > 0 ?
+    gbls->conf->server_backlog : SERVER_BACKLOG_DEFAULT;
+  memset(&serv->stats, 0, sizeof serv->stats);
+
+  if (listen(serv->list_sock_fd, serv->backlog) == -1)
   {
     ui_sock_err("listen");
     return -1;
   }
 
-  /* set up for reading */
-  FD_SET(serv->list_sock_fd, &gbls->net->master_fd_set);
-  if (serv->list_sock_fd > gbls->net->highest_fd)
-    gbls->net->highest_fd = serv->list_sock_fd;
-  serv->read_timeout.tv_sec = 0;
-  serv->read_timeout.tv_usec = 0;
+  /* a client that gives up before accept() must not block us */
+  if (socket_set_nonblocking(serv->list_sock_fd) == -1)
+    return -1;
+
+  if (event_handler_add(&gbls->net->event_loops[0], &serv->ev, serv->list_sock_fd,
+        SD_EVENT_READ) == -1)
+    return -1;
 
   /* ready to accept() */
   return 0;
@@ -316,12 +377,44 @@ int server_bind(struct sd_serv_info *serv)
 
 int server_close(struct sd_serv_info *serv)
 {
+  if (serv->state == SERVER_STATE_LISTENING)
+    ui_notify_printf("Server closed after accepting %" PRIu64 ", rejecting %"
+        PRIu64 ", backlog full %" PRIu64 " times.", serv->stats.accepted,
+        serv->stats.rejected, serv->stats.backlog_full);
+
   sd_set_state(&serv->state, SERVER_STATE_CLOSED);
-  return socket_close(&serv->list_sock_fd, SD_OPTION_ON,
-      SD_OPTION_OFF, NULL);
+  event_handler_del(&serv->ev);
+  timer_del(&serv->accept_timer);
+  return socket_close(&serv->list_sock_fd, SD_OPTION_OFF, NULL);
 }
 
-int server_handle_con(struct sd_serv_info *serv)
+/* the listening socket is waited on again once descriptors may be free */
+void server_accept_timer_cb(void *v)
+{
+  struct sd_serv_info *si = (struct sd_serv_info *) v;
+
+  if (si->state == SERVER_STATE_LISTENING)
+    event_handler_mod(&si->ev, SD_EVENT_READ);
+}
+
+/* count a wakeup that finds the accept queue at the backlog, new clients
+ * are being dropped by the kernel */
+static void server_check_backlog(struct sd_serv_info *serv)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info ti;
+  socklen_t len = sizeof ti;
+
+  /* for a listener unacked is the queue length and sacked the backlog */
+  if (getsockopt(serv->list_sock_fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+      ti.tcpi_sacked && ti.tcpi_unacked >= ti.tcpi_sacked)
+    serv->stats.backlog_full++;
+#endif
+}
+
+/* accept a single client, 1 if one was taken (even if refused), 0 if the
+ * queue is empty, -1 to stop */
+static int server_accept_con(struct sd_serv_info *serv)
 {
   struct sd_con_info new_con; /* don't use up resources yet */
 #ifdef WIN32
@@ -329,126 +422,181 @@ int server_handle_con(struct sd_serv_info *serv)
 #else
   socklen_t addrlen;
 #endif
-  fd_set read_fd_set;
-  
-  /* setup fd set */
-  read_fd_set = gbls->net->master_fd_set;
 
-  if (select(gbls->net->highest_fd + 1, &read_fd_set, NULL,
-          NULL, &serv->read_timeout) == -1)
+  addrlen = sizeof(new_con.dst_sa);
+
+#ifdef SD_ACCEPT4
+  new_con.sock_fd = accept4(serv->list_sock_fd,
+      (struct sockaddr *) &new_con.dst_sa, &addrlen,
+      SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  new_con.sock_fd = accept(serv->list_sock_fd,
+      (struct sockaddr *) &new_con.dst_sa, &addrlen);
+#endif
+
+  if (new_con.sock_fd == -1)
   {
-    if (errno == EINTR) {
-      perror("select()");
-    }
-    else {
-      ON_SYS_ERROR_EXIT(errno, "select");
+#ifdef WIN32
+    if (WSAGetLastError() == WSAEWOULDBLOCK)
+      return 0;
+#else
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    if (errno == ECONNABORTED || errno == EINTR)
+      return 1; /* went away, try the next */
+
+    /* still readable, stop waiting on it for a while instead of spinning */
+    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+        errno == ENOMEM)
+    {
+      /* once per shortage, not for every retry */
+      if (!serv->stats.paused || serv->paused_accepted != serv->stats.accepted)
+        ui_sock_err("accept");
+      serv->stats.paused++;
+      serv->paused_accepted = serv->stats.accepted;
+      event_handler_mod(&serv->ev, 0);
+      event_timer_add(serv->ev.loop, &serv->accept_timer,
+          SERVER_ACCEPT_RETRY_MS);
+      return -1;
     }
-  }
+#endif
 
-  if (FD_ISSET(serv->list_sock_fd, &read_fd_set))
+    ui_sock_err("accept");
+    return -1;
+  }
+  else
   {
-    addrlen = sizeof(new_con.dst_sa);
-
-    if ((new_con.sock_fd = accept(serv->list_sock_fd,
-            (struct sockaddr *) &new_con.dst_sa, &addrlen)) == -1)
+#ifndef SD_ACCEPT4
+    if (socket_set_nonblocking(new_con.sock_fd) == -1)
     {
-      ui_sock_err("accept");
-      return -1;
+      socket_close(&new_con.sock_fd, SD_OPTION_OFF, NULL);
+      serv->stats.rejected++;
+      return 1;
     }
-    else
+#endif
+
+    /* print notification */
+    char *peeraddr, *servaddr;
+    peeraddr = get_sockaddr_storage_string(&new_con.dst_sa);
+    servaddr =
+      get_sockaddr_storage_string((struct sockaddr_storage *)serv->servinfo.ai_addr);
+    ui_notify_printf("New connection: %s <-- %s.", servaddr, peeraddr);
+
+    /* check if peer is allowed to use this connection */
+    list_item *li = NULL;
+
+    switch (serv->type)
     {
-      /* print notification */
-      char *peeraddr, *servaddr;
-      peeraddr = get_sockaddr_storage_string(&new_con.dst_sa);
-      servaddr =
-        get_sockaddr_storage_string((struct sockaddr_storage *)serv->servinfo.ai_addr);
-      ui_notify_printf("New connection: %s <-- %s.", servaddr, peeraddr);
+      case SERVER_TYPE_DATA:
+        memcpy(&current_peer_to_validate, &new_con.dst_sa,
+            sizeof current_peer_to_validate);
+        li = linked_list_iterate(&serv->accept_addresses, &validate_accept_peers);
 
-      /* check if peer is allowed to use this connection */
-      list_item *li;
+        /* we cannot accept this peer */
+        if (li == NULL)
+        {
+          ui_notify_printf("%s does not have permission to use this server, "
+              "killing...", peeraddr);
+          socket_close(&new_con.sock_fd, SD_OPTION_OFF, NULL);
+          SAFE_FREE(servaddr);
+          SAFE_FREE(peeraddr);
+          serv->stats.rejected++;
+          return 1;
+        }
+        ui_notify_printf("%s was successfully validated.", peeraddr);
+        server_accept_set_state((struct sd_serv_accept_info *)li->value,
+            SERVER_ACCEPT_STATE_DELETE);
 
-      switch (serv->type)
-      {
-        case SERVER_TYPE_DATA:
-          memcpy(&current_peer_to_validate, &new_con.dst_sa,
-              sizeof current_peer_to_validate);
-          li = linked_list_iterate(&serv->accept_addresses, &validate_accept_peers);
+        break;
+      case SERVER_TYPE_CONTROL:
+        break;
+    }
 
-          /* we cannot accept this peer */
-          if (li == NULL)
-          {
-            ui_notify_printf("%s does not have permission to use this server, "
-                "killing...", peeraddr);
-            socket_close(&new_con.sock_fd, SD_OPTION_OFF, SD_OPTION_OFF, NULL);
-            return 0;
-          }
-          ui_notify_printf("%s was successfully validated.", peeraddr);
-          sd_set_state(&((struct sd_serv_accept_info *)li->value)->state,
-              SERVER_ACCEPT_STATE_DELETE);
+    SAFE_FREE(servaddr);
+    SAFE_FREE(peeraddr);
 
-          break;
-        case SERVER_TYPE_CONTROL:
-          break;
-      }
+    struct sd_con_info *ci = NULL;
 
-      SAFE_FREE(servaddr);
-      SAFE_FREE(peeraddr);
+    switch (serv->type)
+    {
+      case SERVER_TYPE_CONTROL:
+        {
+        /* add pear to list */
+        struct sd_peer_info *npi;
 
-      struct sd_con_info *ci;
+        npi = peer_init(NULL, NULL, serv->enable_ssl, &serv->ssl_verify);
 
-      switch (serv->type)
-      {
-        case SERVER_TYPE_CONTROL:
-          {
-          /* add pear to list */
-          struct sd_peer_info *npi;
+        ci = &npi->ctl_con;
+        }
+        break;
+      case SERVER_TYPE_DATA:
+        ci = ((struct sd_serv_accept_info *)li->value)->con;
 
-          npi = peer_init(NULL, NULL, serv->enable_ssl, &serv->ssl_verify);
+        /* ssl */
+        if (serv->enable_ssl) {
+          ci->enable_ssl = SD_OPTION_ON;
+          memcpy(&ci->ssl_verify, &serv->ssl_verify, sizeof ci->ssl_verify);
+        }
+        else {
+          ci->enable_ssl = SD_OPTION_OFF;
+        }
+        break;
+    }
 
-          ci = &npi->ctl_con;
-          }
-          break;
-        case SERVER_TYPE_DATA:
-          ci = ((struct sd_serv_accept_info *)li->value)->con;
+    /* copy some info */
+    memcpy(&ci->sock_fd, &new_con.sock_fd, sizeof(new_con.sock_fd));
+    memcpy(&ci->dst_sa, &new_con.dst_sa, addrlen);
 
-          /* ssl */
-          if (serv->enable_ssl) {
-            ci->enable_ssl = SD_OPTION_ON;
-            memcpy(&ci->ssl_verify, &serv->ssl_verify, sizeof ci->ssl_verify);
-          }
-          else {
-            ci->enable_ssl = SD_OPTION_OFF;
-          }
-          break;
-      }
+    if (ci->enable_ssl) {
+      con_set_state(ci, CON_STATE_SSL_VERIFY);
+      sd_set_mutex_state(&ci->step.proc_state, PROC_STATE_INCOMPLETE);
+      con_ssl_init(ci);
+    }
+    else {
+      if (serv->type == SERVER_TYPE_CONTROL)
+        con_send_protocol_version(ci);
+
+      con_set_established(ci);
+    }
 
-      /* copy some info */
-      memcpy(&ci->sock_fd, &new_con.sock_fd, sizeof(new_con.sock_fd));
-      memcpy(&ci->dst_sa, &new_con.dst_sa, addrlen);
+    serv->stats.accepted++;
+    return 1; /* we have connection */
+  }
+}
 
-      /* set up for reading */
-      FD_SET(ci->sock_fd, &gbls->net->master_fd_set);
-      if (ci->sock_fd > gbls->net->highest_fd)
-        gbls->net->highest_fd = ci->sock_fd;
+int server_handle_con(struct sd_serv_info *serv)
+{
+  int budget, n, ret;
 
+  budget = gbls->conf->server_accept_budget > 0 ?
+    gbls->conf->server_accept_budget : SERVER_ACCEPT_BUDGET_DEFAULT;
 
-      if (ci->enable_ssl) {
-        sd_set_state(&ci->state, CON_STATE_SSL_VERIFY);
-        sd_create_thread((thread_pos_cb)(&sd_mutex_con_func), (void *)ci);
-      }
-      else {
-        if (serv->type == SERVER_TYPE_CONTROL)
-          con_send_protocol_version(ci);
+  server_check_backlog(serv);
 
-        sd_set_state(&ci->state, CON_STATE_ESTABLISHED);
-      }
+  /* only called when the listening socket is readable, take everything
+   * queued so a burst is not spread over many wakeups */
+  for (n = 0; n < budget; n++)
+  {
+    ret = server_accept_con(serv);
 
-      return 1; /* we have connection */
-    }
+    if (ret == 0)
+      return n;
+    if (ret == -1)
+      return n ? n : -1;
   }
 
-  /* no connection */
-  return 0;
+  /* level triggered, the rest are picked up by the next wait */
+  serv->stats.budget_spent++;
+
+  return n;
+}
+
+void server_event_cb(void *v, int events)
+{
+  struct sd_serv_info *si = (struct sd_serv_info *) v;
+
+  if (si->state == SERVER_STATE_LISTENING)
+    server_handle_con(si);
 }
 
 
@@ -462,7 +610,8 @@ struct sd_serv_accept_info *server_accept_init(
 
   sai = (struct sd_serv_accept_info *) server_accept_add(si)->value;
 
-  sd_thread_init(&sai->mutex_state.cs_mutex);
+  completion_init(&sai->step, (completion_cb) &handle_server_accept_state,
+      (void *) sai);
 
   resolve_addr_set_info(&sai->resolve_addr, a, s, SD_OPTION_OFF);
 
@@ -488,10 +637,18 @@ struct list_item *server_accept_add(struct sd_serv_info *si)
 void server_accept_start_state_machine(struct sd_serv_accept_info *sai,
     char istate, char t)
 {
-  sd_set_state(&sai->state, istate);
-  /* run thread */
+  server_accept_set_state(sai, istate);
+  /* start the lookup, handle_server_accept_state() picks up the result */
   if (t == SD_OPTION_ON)
-    sd_create_thread((thread_pos_cb)(&sd_mutex_server_accept_func), (void *)sai);
+  {
+    switch (sai->state)
+    {
+      case SERVER_ACCEPT_STATE_RESOLVE_IP:
+        ui_notify("Attempting to resolve remote accept address...");
+        resolve_addr_lookup(&sai->resolve_addr, &sai->step);
+        break;
+    }
+  }
 }
 
 void handle_server_accept_state(struct sd_serv_accept_info *sai)
@@ -499,17 +656,17 @@ void handle_server_accept_state(struct sd_serv_accept_info *sai)
   switch (sai->state)
   {
     case SERVER_ACCEPT_STATE_RESOLVE_IP:
-      if (sai->mutex_state.proc_state != PROC_STATE_INCOMPLETE)
+      if (sai->step.proc_state != PROC_STATE_INCOMPLETE)
       {
-        if (sai->mutex_state.proc_state == PROC_STATE_COMPLETE)
+        if (sai->step.proc_state == PROC_STATE_COMPLETE)
         {
           ui_notify("Successfully resolved remote accept address.");
           /* let data transfer know where done */
-          sd_set_state(&sai->state, SERVER_ACCEPT_STATE_RESOLVED);
+          server_accept_set_state(sai, SERVER_ACCEPT_STATE_RESOLVED);
         }
         else {
           ui_notify("Could not resolve remote accept address.");
-          sd_set_state(&sai->state, SERVER_ACCEPT_STATE_ERROR);
+          server_accept_set_state(sai, SERVER_ACCEPT_STATE_ERROR);
         }
       }
       break;
@@ -519,23 +676,16 @@ void handle_server_accept_state(struct sd_serv_accept_info *sai)
   
 }
 
-int handle_server_accept_thread(struct sd_serv_accept_info *sai)
+void server_accept_set_state(struct sd_serv_accept_info *sai, char ns)
 {
-  switch (sai->state)
-  {
-    case SERVER_ACCEPT_STATE_RESOLVE_IP:
-      ui_notify("Attempting to resolve remote accept address...");
-      if (address_lookup(&sai->resolve_addr) == -1)
-      {
-        return PROC_STATE_COMPLETE_WITH_ERROR;
-      }
-      break;
-    case SERVER_ACCEPT_STATE_RESOLVED:
-      break;
-  }
+  /* the transfer waiting on the address acts on it */
+  if (sai->con && sai->con->owner)
+    completion_post(sai->con->owner, PROC_STATE_COMPLETE);
 
-  /* success */
-  return PROC_STATE_COMPLETE;
+  if (ns == SERVER_ACCEPT_STATE_DELETE)
+    core_collect();
+
+  sd_set_state(&sai->state, ns);
 }
 
 int validate_accept_peers(void *value, int index)
@@ -598,8 +748,8 @@ int validate_accept_peers(void *value, int index)
 void server_accept_deinit(struct sd_serv_accept_info *sai)
 {
   /* used for the address comparisons */
-  SAFE_FREE(sai->resolve_addr.res_ai);
-  sd_thread_deinit(&sai->mutex_state.cs_mutex);
+  resolve_addr_free(&sai->resolve_addr);
+  completion_cancel(&sai->step);
 }
 
 int server_accept_get_state_delete_iterate(void *value, int index) {
@@ -647,21 +797,33 @@ void con_init(struct sd_con_info *co, const char *a, const char *p, char enable_
   }
 
   
-  /* get rid of this */
-  co->read_timeout.tv_sec = 0;
-  co->read_timeout.tv_usec = 0;
-
   co->type = t;
+
+  co->connect_ai = NULL;
+  co->ssl_handshake_ms = -1;
+  timer_init(&co->setup_timer, &con_setup_timer_cb, (void *) co);
   
-  sd_thread_init(&co->mutex_state.cs_mutex);
+  completion_init(&co->step, (completion_cb) &handle_con_state, (void *) co);
 }
 
 void con_start_state_machine(struct sd_con_info *ci, char istate, char t)
 {
-  sd_set_state(&ci->state, istate);
-  /* run thread */
+  con_set_state(ci, istate);
+  /* start the lookup, handle_con_state() picks up the result */
   if (t == SD_OPTION_ON)
-    sd_create_thread((thread_pos_cb)(&sd_mutex_con_func), (void *)ci);
+  {
+    switch (ci->state)
+    {
+      case CON_STATE_RESOLVE_SRC_IP:
+        ui_notify("Attempting to resolve and bind local address...");
+        resolve_addr_lookup(&ci->resolve_src_addr, &ci->step);
+        break;
+      case CON_STATE_RESOLVE_DST_IP:
+        ui_notify("Attempting to resolve remote addresses...");
+        resolve_addr_lookup(&ci->resolve_dst_addr, &ci->step);
+        break;
+    }
+  }
 }
 
 void handle_con_state(struct sd_con_info *ci)
@@ -671,9 +833,9 @@ void handle_con_state(struct sd_con_info *ci)
     case CON_STATE_CLOSED:
       break;
     case CON_STATE_RESOLVE_SRC_IP:
-      if (ci->mutex_state.proc_state != PROC_STATE_INCOMPLETE)
+      if (ci->step.proc_state != PROC_STATE_INCOMPLETE)
       {
-        if (ci->mutex_state.proc_state == PROC_STATE_COMPLETE) {
+        if (ci->step.proc_state == PROC_STATE_COMPLETE) {
           /* an error */
           if (con_bind_src_address(ci) == -1) {
             goto resolve_src_ip_err;
@@ -689,10 +851,10 @@ void handle_con_state(struct sd_con_info *ci)
             switch (ci->type)
             {
               case CON_TYPE_CONTROL:
-                sd_set_state(&ci->state, CON_STATE_RESOLVED_SRC_IP);
+                con_set_state(ci, CON_STATE_RESOLVED_SRC_IP);
                 break;
               case CON_TYPE_DATA:
-                sd_set_state(&ci->state, CON_STATE_RESOLVED_SRC_IP);
+                con_set_state(ci, CON_STATE_RESOLVED_SRC_IP);
                 break;
             }
           }
@@ -705,7 +867,7 @@ resolve_src_ip_err:
             case CON_TYPE_CONTROL:
               break;
             case CON_TYPE_DATA:
-              sd_set_state(&ci->state, CON_STATE_CLOSED);
+              con_set_state(ci, CON_STATE_CLOSED);
               break;
           }
         }
@@ -715,21 +877,23 @@ resolve_src_ip_err:
     case CON_STATE_RESOLVED_SRC_IP:
       break;
     case CON_STATE_RESOLVE_DST_IP:
-      if (ci->mutex_state.proc_state != PROC_STATE_INCOMPLETE)
+      if (ci->step.proc_state != PROC_STATE_INCOMPLETE)
       {
-        if (ci->mutex_state.proc_state == PROC_STATE_COMPLETE) {
+        if (ci->step.proc_state == PROC_STATE_COMPLETE) {
           /* print notification */
           ui_notify_printf("Successfully resolved remote addresses.");
 
-          sd_set_state(&ci->state, CON_STATE_CONNECTING);
-          sd_create_thread((thread_pos_cb)(&sd_mutex_con_func), (void *)ci);
+          /* no thread, the event loop tells when the connect is done */
+          con_set_state(ci, CON_STATE_CONNECTING);
+          sd_set_mutex_state(&ci->step.proc_state, PROC_STATE_INCOMPLETE);
+          con_connect(ci);
         }
         else {
           /* clean up */
           switch (ci->type)
           {
             case CON_TYPE_CONTROL:
-              sd_set_state(&ci->state, CON_STATE_DELETE);
+              con_set_state(ci, CON_STATE_DELETE);
               break;
             case CON_TYPE_DATA:
               break;
@@ -739,9 +903,9 @@ resolve_src_ip_err:
       }
       break;
     case CON_STATE_CONNECTING:
-      if (ci->mutex_state.proc_state != PROC_STATE_INCOMPLETE)
+      if (ci->step.proc_state != PROC_STATE_INCOMPLETE)
       {
-        if (ci->mutex_state.proc_state == PROC_STATE_COMPLETE) {
+        if (ci->step.proc_state == PROC_STATE_COMPLETE) {
           /* print notification */
           char *saddr;
           saddr = get_sockaddr_storage_string(&ci->dst_sa);
@@ -749,8 +913,10 @@ resolve_src_ip_err:
           SAFE_FREE(saddr);
 
           if (ci->enable_ssl) {
-            sd_set_state(&ci->state, CON_STATE_SSL_VERIFY);
-            sd_create_thread((thread_pos_cb)(&sd_mutex_con_func), (void *)ci);
+            /* also run from the event loop */
+            con_set_state(ci, CON_STATE_SSL_VERIFY);
+            sd_set_mutex_state(&ci->step.proc_state, PROC_STATE_INCOMPLETE);
+            con_ssl_init(ci);
           }
           else {
             switch (ci->type)
@@ -760,7 +926,7 @@ resolve_src_ip_err:
                 break;
             }
 
-            sd_set_state(&ci->state, CON_STATE_ESTABLISHED);
+            con_set_established(ci);
           }
         }
         else {
@@ -768,10 +934,10 @@ resolve_src_ip_err:
           switch (ci->type)
           {
             case CON_TYPE_CONTROL:
-              sd_set_state(&ci->state, CON_STATE_DELETE);
+              con_set_state(ci, CON_STATE_DELETE);
               break;
             case CON_TYPE_DATA:
-              sd_set_state(&ci->state, CON_STATE_CLOSED);
+              con_set_state(ci, CON_STATE_CLOSED);
               break;
           }
         }
@@ -779,13 +945,14 @@ resolve_src_ip_err:
       }
       break;
     case CON_STATE_SSL_VERIFY:
-      if (ci->mutex_state.proc_state != PROC_STATE_INCOMPLETE)
+      if (ci->step.proc_state != PROC_STATE_INCOMPLETE)
       {
-        if (ci->mutex_state.proc_state == PROC_STATE_COMPLETE) {
+        if (ci->step.proc_state == PROC_STATE_COMPLETE) {
           /* print notification */
           char *saddr;
           saddr = get_sockaddr_storage_string(&ci->dst_sa);
-          ui_notify_printf("SSL handshake successfull with %s.", saddr);
+          ui_notify_printf("SSL handshake successfull with %s (%d ms).", saddr,
+              ci->ssl_handshake_ms);
           SAFE_FREE(saddr);
 
           switch (ci->type)
@@ -795,14 +962,14 @@ resolve_src_ip_err:
               break;
           }
 
-          sd_set_state(&ci->state, CON_STATE_ESTABLISHED);
+          con_set_established(ci);
         }
         else {
           /* clean up */
           switch (ci->type)
           {
             case CON_TYPE_CONTROL:
-              sd_set_state(&ci->state, CON_STATE_CLOSED);
+              con_set_state(ci, CON_STATE_CLOSED);
               break;
             case CON_TYPE_DATA:
               break;
@@ -824,37 +991,18 @@ resolve_src_ip_err:
   }
 }
 
-int handle_con_thread(struct sd_con_info *ci)
+
+void con_set_state(struct sd_con_info *ci, char ns)
 {
-  switch (ci->state)
-  {
-    case CON_STATE_CLOSED:
-      break;
-    case CON_STATE_RESOLVE_SRC_IP:
-      ui_notify("Attempting to resolve and bind local address...");
-      if (address_lookup(&ci->resolve_src_addr) == -1)
-        return PROC_STATE_COMPLETE_WITH_ERROR;
-      break;
-    case CON_STATE_RESOLVE_DST_IP:
-      ui_notify("Attempting to resolve remote addresses...");
-      if (address_lookup(&ci->resolve_dst_addr) == -1)
-        return PROC_STATE_COMPLETE_WITH_ERROR;
-      break;
-    case CON_STATE_CONNECTING:
-      if (con_connect(ci) == -1)
-        return PROC_STATE_COMPLETE_WITH_ERROR;
-      break;
-    case CON_STATE_SSL_VERIFY:
-      ui_notify("Performing SSL handshake...");
-      if (con_ssl_init(ci) == -1)
-        return PROC_STATE_COMPLETE_WITH_ERROR;
-      break;
-    case CON_STATE_ESTABLISHED:
-      break;
-  }
+  /* a data transfer acts on the change of its connection */
+  if (ci->owner)
+    completion_post(ci->owner, PROC_STATE_COMPLETE);
 
-  /* success */
-  return PROC_STATE_COMPLETE;
+  /* a control connection takes its peer with it */
+  if (ns == CON_STATE_DELETE)
+    core_collect();
+
+  sd_set_state(&ci->state, ns);
 }
 
 
@@ -901,7 +1049,7 @@ int con_bind_src_address(struct sd_con_info *ci)
 
         ui_sock_err("bind");
         
-        socket_close(&ci->sock_fd, SD_OPTION_OFF, SD_OPTION_OFF, NULL);
+        socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
         res_p = NULL;
         break;
       }
@@ -929,20 +1077,25 @@ bind_done:
 
   memcpy(&ci->src_sa, res_p->ai_addr, addrlen);
 
-  freeaddrinfo(ci->resolve_src_addr.res_ai); /* finished with list */
+  resolve_addr_free(&ci->resolve_src_addr); /* finished with list */
   
   /* we are bound */
   return 0;
 }
 
-/* this function blocks to run in thread */
-int con_connect(struct sd_con_info *ci)
+/* the last attempt failed, try the ones after it */
+static void con_connect_next(struct sd_con_info *ci)
 {
   struct addrinfo *res_p;
+  char *saddr;
+#ifdef WIN32
+  int err;
+#endif
 
-  /* loop through all sockets and bind to first sucessfull */
-  for (res_p = ci->resolve_dst_addr.res_ai; res_p != NULL; res_p = res_p->ai_next)
+  for (res_p = ci->connect_ai; res_p != NULL; res_p = res_p->ai_next)
   {
+    ci->connect_ai = res_p;
+
     switch (ci->type)
     {
       case CON_TYPE_CONTROL:
@@ -957,26 +1110,97 @@ int con_connect(struct sd_con_info *ci)
         break;
     }
 
-    char *saddr;
+    if (socket_set_nonblocking(ci->sock_fd) == -1)
+      goto connect_err;
+
     saddr = get_sockaddr_storage_string((struct sockaddr_storage *)res_p->ai_addr);
     ui_notify_printf("Trying to connect to %s...", saddr);
     SAFE_FREE(saddr);
 
-    if (connect(ci->sock_fd, res_p->ai_addr, res_p->ai_addrlen) == -1)
+    if (connect(ci->sock_fd, res_p->ai_addr, res_p->ai_addrlen) == 0)
     {
-      ui_sock_err("connect");
+      con_connect_event(ci, SD_EVENT_WRITE);
+      return;
+    }
 
-      socket_close(&ci->sock_fd, SD_OPTION_OFF, SD_OPTION_OFF, NULL);
-      continue;
+#ifdef WIN32
+    err = WSAGetLastError();
+    if (err == WSAEWOULDBLOCK || err == WSAEINPROGRESS)
+#else
+    if (errno == EINPROGRESS || errno == EINTR)
+#endif
+    {
+      /* writable once it is done either way */
+      if (event_handler_add(&gbls->net->event_loops[0], &ci->ev, ci->sock_fd,
+            SD_EVENT_WRITE) == -1)
+        goto connect_err;
+
+      if (gbls->conf->con_timeout > 0)
+        event_timer_add(&gbls->net->event_loops[0], &ci->setup_timer,
+            gbls->conf->con_timeout * 1000);
+      return;
     }
 
-    break;
+    ui_sock_err("connect");
+
+connect_err:
+    socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
+
+    /* a data connection only has the socket bound to its reserved port */
+    if (ci->type == CON_TYPE_DATA)
+      break;
   }
 
-  if (res_p == NULL)
+  ui_sd_err("Failed to connect to remote host");
+  completion_post(&ci->step, PROC_STATE_COMPLETE_WITH_ERROR);
+}
+
+int con_connect(struct sd_con_info *ci)
+{
+  ci->connect_ai = ci->resolve_dst_addr.res_ai;
+  con_connect_next(ci);
+
+  return ci->step.proc_state == PROC_STATE_COMPLETE_WITH_ERROR ? -1 : 0;
+}
+
+void con_connect_event(struct sd_con_info *ci, int events)
+{
+  struct addrinfo *res_p = ci->connect_ai;
+  int err = 0;
+#ifdef WIN32
+  int errlen;
+#else
+  socklen_t errlen;
+#endif
+
+  event_handler_del(&ci->ev);
+  timer_del(&ci->setup_timer);
+
+  errlen = sizeof err;
+  if (getsockopt(ci->sock_fd, SOL_SOCKET, SO_ERROR, (char *) &err, &errlen) == -1)
+#ifdef WIN32
+    err = WSAGetLastError();
+#else
+    err = errno;
+#endif
+
+  if (err)
   {
-    ui_sd_err("Failed to connect to remote host");
-    return -1;
+#ifdef WIN32
+    WSASetLastError(err);
+#else
+    errno = err;
+#endif
+    ui_sock_err("connect");
+    socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
+
+    if (ci->type == CON_TYPE_DATA)
+      ci->connect_ai = NULL;
+    else
+      ci->connect_ai = res_p->ai_next;
+
+    con_connect_next(ci);
+    return;
   }
 
   /* copy to address struct */
@@ -990,15 +1214,102 @@ int con_connect(struct sd_con_info *ci)
 
   memcpy(&ci->dst_sa, res_p->ai_addr, addrlen);
 
-  freeaddrinfo(ci->resolve_dst_addr.res_ai); /* finished with list */
-  
-  /* set up for reading */
-  FD_SET(ci->sock_fd, &gbls->net->master_fd_set);
-  if (ci->sock_fd > gbls->net->highest_fd)
-    gbls->net->highest_fd = ci->sock_fd;
+  resolve_addr_free(&ci->resolve_dst_addr); /* finished with list */
+  ci->connect_ai = NULL;
 
-  /* we are connected */
-  return 0;
+  /* we are connected, handle_con_state() takes it from here */
+  completion_post(&ci->step, PROC_STATE_COMPLETE);
+}
+
+void con_setup_timer_cb(void *v)
+{
+  struct sd_con_info *ci = (struct sd_con_info *) v;
+  char *saddr;
+
+  /* finished or closed since */
+  if (!ci->ev.loop || ci->step.proc_state != PROC_STATE_INCOMPLETE)
+    return;
+
+  if (ci->state == CON_STATE_SSL_VERIFY)
+  {
+    ui_sd_err("SSL handshake timed out.");
+    con_ssl_fail(ci);
+    return;
+  }
+
+  if (ci->state != CON_STATE_CONNECTING)
+    return;
+
+  saddr = get_sockaddr_storage_string(
+      (struct sockaddr_storage *)ci->connect_ai->ai_addr);
+  ui_notify_printf("Connecting to %s timed out.", saddr);
+  SAFE_FREE(saddr);
+
+  event_handler_del(&ci->ev);
+  socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
+
+  if (ci->type == CON_TYPE_DATA)
+    ci->connect_ai = NULL;
+  else
+    ci->connect_ai = ci->connect_ai->ai_next;
+
+  con_connect_next(ci);
+}
+
+int con_setup_cancel(struct sd_con_info *ci)
+{
+  char ps = ci->step.proc_state;
+
+  /* still running, or finished and not handled yet */
+  if (ps != PROC_STATE_INCOMPLETE && !completion_is_queued(&ci->step))
+    return 0;
+
+  switch (ci->state)
+  {
+    case CON_STATE_RESOLVE_SRC_IP:
+      resolve_addr_free(&ci->resolve_src_addr);
+      break;
+    case CON_STATE_RESOLVE_DST_IP:
+      resolve_addr_free(&ci->resolve_dst_addr);
+      break;
+    case CON_STATE_CONNECTING:
+      /* a failed connect has closed the socket */
+      if (ps == PROC_STATE_COMPLETE_WITH_ERROR)
+        break;
+      event_handler_del(&ci->ev);
+      timer_del(&ci->setup_timer);
+      socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
+      break;
+    case CON_STATE_SSL_VERIFY:
+      if (ps != PROC_STATE_COMPLETE_WITH_ERROR)
+        con_ssl_fail(ci);
+      break;
+    default:
+      return 0;
+  }
+
+  /* nothing left for handle_con_state() */
+  completion_cancel(&ci->step);
+  con_set_state(ci, CON_STATE_CLOSED);
+  return 1;
+}
+
+void con_set_established(struct sd_con_info *ci)
+{
+  con_set_state(ci, CON_STATE_ESTABLISHED);
+
+  switch (ci->type)
+  {
+    case CON_TYPE_CONTROL:
+      /* write readiness sends anything queued before now */
+      event_handler_add(&gbls->net->event_loops[0], &ci->ev, ci->sock_fd,
+          SD_EVENT_READ | SD_EVENT_WRITE);
+      peer_start_verify_timer(con_get_peer(ci));
+      break;
+    case CON_TYPE_DATA:
+      /* registered once the file is open */
+      break;
+  }
 }
 
 
@@ -1027,29 +1338,119 @@ char *get_con_state_string(struct sd_con_info *ci)
   return nstr;
 }
 
-int socket_close(int *fd, char fd_clr, char enable_ssl, SSL *ssl)
+int socket_set_nonblocking(int fd)
 {
-  int ret;
+#ifdef WIN32
+  u_long mode = 1;
+
+  if (ioctlsocket(fd, FIONBIO, &mode) == SOCKET_ERROR)
+  {
+    ui_wsa_err("ioctlsocket");
+    return -1;
+  }
+#else
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFL, 0)) == -1 ||
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+  {
+    ui_sys_err(errno, "fcntl");
+    return -1;
+  }
+
+#ifdef SO_NOSIGPIPE
+  /* no MSG_NOSIGNAL on the BSDs */
+  int y = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &y, sizeof y) == -1)
+  {
+    ui_sys_err(errno, "setsockopt");
+    return -1;
+  }
+#endif
+#endif
+
+  return 0;
+}
+
+int socket_get_rtt(int fd, int *rtt_us)
+{
+#if defined(__linux__) || defined(__FreeBSD__)
+  struct tcp_info ti;
+  socklen_t len = sizeof ti;
+
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+    return -1;
+
+  /* smoothed, in microseconds on both */
+  *rtt_us = (int) ti.tcpi_rtt;
+  return 0;
+#else
+  return -1;
+#endif
+}
 
-  if (fd_clr)
-    FD_CLR(*fd, &gbls->net->master_fd_set);
+#ifdef __linux__
+/* net.core.wmem_max and rmem_max, asking for more is cut down to them */
+static int socket_buffer_max(int opt)
+{
+  static int max[2];
+  FILE *f;
+  int i;
+
+  i = opt == SO_SNDBUF ? 0 : 1;
+  if (!max[i])
+  {
+    max[i] = INT_MAX;
+    if ((f = fopen(i ? "/proc/sys/net/core/rmem_max" :
+            "/proc/sys/net/core/wmem_max", "r")) != NULL)
+    {
+      if (fscanf(f, "%d", &max[i]) != 1 || max[i] <= 0)
+        max[i] = INT_MAX;
+      fclose(f);
+    }
+  }
+
+  return max[i];
+}
+#endif
+
+int socket_buffer_raise(int fd, int opt, int len)
+{
+  int cur;
+  socklen_t l = sizeof cur;
+
+  if (getsockopt(fd, SOL_SOCKET, opt, (char *) &cur, &l) == -1)
+    return -1;
+
+#ifdef __linux__
+  /* setting it stops the kernel growing it, so only when the result is
+   * larger than what it already has, linux doubles what is set */
+  if (len > socket_buffer_max(opt))
+    len = socket_buffer_max(opt);
+  if (cur / 2 >= len)
+    return 0;
+#else
+  if (cur >= len)
+    return 0;
+#endif
+
+  return setsockopt(fd, SOL_SOCKET, opt, (const char *) &len, sizeof len);
+}
+
+int socket_close(int *fd, char enable_ssl, SSL *ssl)
+{
+  int ret;
 
   if (enable_ssl)
   {
+      /* send our close notify, the socket is non-blocking so don't wait
+       * around for the peers */
       ret = SSL_shutdown(ssl);
       if (ret == -1)
       {
-        ui_ssl_err("SSL_shutdown");
-        return -1;
-      }
-      if (ret == 0) /* 0 means shutdown not finished */
-      {
-        ret = SSL_shutdown(ssl);
-        if (ret == -1)
-        {
+        ret = SSL_get_error(ssl, ret);
+        if (ret != SSL_ERROR_WANT_READ && ret != SSL_ERROR_WANT_WRITE)
           ui_ssl_err("SSL_shutdown");
-          return -1;
-        }
       }
   }
 
@@ -1113,37 +1514,6 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 
-/* this function needs to run in thread as it blocks */
-int address_lookup(struct sd_resolve_addr_info *rai)
-{
-  int rt;
-  struct addrinfo hints;
-
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-
-  if ((rt = getaddrinfo(rai->lookup_address,
-          (rai->any_service ? NULL : rai->lookup_service),
-          &hints, &rai->res_ai)) != 0)
-  {
-    ui_gai_err(rt, "getaddrinfo");
-    return -1;
-  }
-
-  return 0;
-}
-
-void resolve_addr_set_info(struct sd_resolve_addr_info *ri, const char *a,
-    const char *s, char as)
-{
-  if (a)
-    snprintf(ri->lookup_address, sizeof ri->lookup_address, "%s", a);
-  if (s)
-    snprintf(ri->lookup_service, sizeof ri->lookup_service, "%s", s);
-  ri->any_service = as;
-}
-
 char *get_sockaddr_storage_string(struct sockaddr_storage *sas)
 {
   char addrs[128], known;
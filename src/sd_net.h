@@ -26,23 +26,20 @@
 #include "sd_ssl.h"
 #include "sd_thread.h"
 #include "sd_linked_list.h"
+#include "sd_event.h"
+#include "sd_resolve.h"
 
-#define BACKLOG  10
+#define SERVER_BACKLOG_DEFAULT           128
+#define SERVER_ACCEPT_BUDGET_DEFAULT      64 /* accepts per readiness event */
+#define SERVER_ACCEPT_RETRY_MS           250 /* out of descriptors, try again */
 
+/* keep send() from raising SIGPIPE where supported */
+#ifdef MSG_NOSIGNAL
+#define SD_MSG_NOSIGNAL MSG_NOSIGNAL
+#else
+#define SD_MSG_NOSIGNAL 0
+#endif
 
-/*! \brief Information for resolving network addresses */
-struct sd_resolve_addr_info
-{
-  /* address lookup info */
-#define LOOKUP_ADDRESS_LEN                   512
-  char lookup_address[LOOKUP_ADDRESS_LEN];
-#define LOOKUP_SERVICE_LEN                    64
-  char lookup_service[LOOKUP_SERVICE_LEN];
-
-  char any_service;
-  
-  struct addrinfo *res_ai; /* for lookup */
-};
 
 /*! \brief Holds information about the connection */
 struct sd_con_info
@@ -51,8 +48,12 @@ struct sd_con_info
 #define CON_TYPE_CONTROL            0
 #define CON_TYPE_DATA               1
 
-  /* Mutex */
-  struct sd_mutex_state_info mutex_state;
+  /* result of the current state, runs handle_con_state() */
+  struct sd_completion step;
+
+  /* posted on each change of state, for whatever the connection belongs
+   * to, NULL for nothing */
+  struct sd_completion *owner;
 
   /* for getaddrinfo */
   struct sd_resolve_addr_info resolve_dst_addr;
@@ -64,6 +65,7 @@ struct sd_con_info
   char enable_ssl; /* use ssl */
   SSL *ssl; /* session info inherit from ctx */
   struct sd_ssl_verify_info ssl_verify; /* verify info */
+  char ssl_ktls; /* SSL_KTLS_* directions the kernel encrypts */
 
 
   /* TCP/IP (IPv4 & IPv6 support) */
@@ -72,8 +74,14 @@ struct sd_con_info
   struct sockaddr_storage src_sa; /* address from bind */
 
   int sock_fd; /* connection socket */
-  fd_set read_fd_set;
-  struct timeval read_timeout;
+  struct sd_event_handler ev; /* readiness of sock_fd */
+
+  /* non-blocking connect and handshake, ev waits on them on the first
+   * core worker */
+  struct addrinfo *connect_ai; /* address being tried */
+  struct sd_timer setup_timer; /* gives up on either after con_timeout */
+  uint64_t ssl_handshake_start; /* ms */
+  int ssl_handshake_ms; /* how long it took, -1 until done */
 
   char state;
 #define CON_STATE_CLOSED          0
@@ -90,8 +98,8 @@ struct sd_con_info
 /*! \brief Information about which hosts the server should allow */
 struct sd_serv_accept_info
 {
-  /* for thread */
-  struct sd_mutex_state_info mutex_state;
+  /* result of the lookup, runs handle_server_accept_state() */
+  struct sd_completion step;
   struct sd_con_info *con;
   char allow_any_port;
 
@@ -105,10 +113,25 @@ struct sd_serv_accept_info
   struct addrinfo addr;
 };
 
+/*! \brief Connection counts for a server, kept on the first core worker */
+struct sd_serv_stats
+{
+  uint64_t accepted;
+  uint64_t rejected; /* refused or failed after accept() */
+  uint64_t backlog_full; /* wakeups that found the queue full (linux) */
+  uint64_t budget_spent; /* wakeups that left connections queued */
+  uint64_t paused; /* times accepting stopped for lack of descriptors */
+};
+
 /*! \brief Server information */
 struct sd_serv_info
 {
   int list_sock_fd;
+  struct sd_event_handler ev; /* readiness of list_sock_fd */
+  struct sd_timer accept_timer; /* resumes accepting after EMFILE */
+  uint64_t paused_accepted; /* stats.accepted when last paused */
+  int backlog;
+  struct sd_serv_stats stats;
 
 
   char type;
@@ -118,7 +141,8 @@ struct sd_serv_info
   /* list of addresses to approve */
   linked_list accept_addresses;
 
-  struct sd_mutex_state_info mutex_state;
+  /* result of the lookup, runs handle_server_state() */
+  struct sd_completion step;
 
   char state;
 #define SERVER_STATE_CLOSED              0
@@ -132,8 +156,6 @@ struct sd_serv_info
   struct addrinfo servinfo; /* user selected sock addr to bind */
 
 
-  //fd_set read_fd_set;
-  struct timeval read_timeout;
   
   /* SSL */
 
@@ -174,18 +196,23 @@ extern void server_start_state_machine(struct sd_serv_info *si, char istate, cha
 /*! \brief Idle function for server */
 extern void handle_server_state(struct sd_serv_info *si);
 
-/*! \brief Determins which thread code to run based on the state */
-extern int handle_server_thread(struct sd_serv_info *si);
-
 /*! \brief Create socket, bind and listen for server */
 extern int server_bind(struct sd_serv_info *serv);
 
 /*! \brief Close a server */
 extern int server_close(struct sd_serv_info *serv);
 
-/*! \brief Run in idle waiting for clients */
+/*! \brief Accept waiting clients, up to server_accept_budget, returns the
+ *         number accepted or -1 */
 extern int server_handle_con(struct sd_serv_info *serv);
 
+/*! \brief Event callback for a listening socket */
+extern void server_event_cb(void *v, int events);
+
+/*! \brief Timer callback to resume accepting after running out of
+ *         descriptors */
+extern void server_accept_timer_cb(void *v);
+
 
 /* -[ server accepts ]------------------------------------------------- */
 
@@ -203,8 +230,9 @@ extern void server_accept_start_state_machine(struct sd_serv_accept_info *sai,
 /*! \brief Idle function for server accept */
 extern void handle_server_accept_state(struct sd_serv_accept_info *sai);
 
-/*! \brief Determins which thread code to run based on the state */
-extern int handle_server_accept_thread(struct sd_serv_accept_info *sai);
+/*! \brief Set the state of a server accept, its connection's owner is told */
+extern void server_accept_set_state(struct sd_serv_accept_info *sai,
+    char ns);
 
 /*! \brief Determine if the connecting peer is valid */
 extern int validate_accept_peers(void *value, int index);
@@ -229,32 +257,50 @@ extern void con_init(struct sd_con_info *co, const char *a, const char *p,
 extern void con_start_state_machine(struct sd_con_info *ci, char istate, char t);
 
 /*! \brief Idle function for connection */
-extern int handle_con_thread(struct sd_con_info *ci);
-
-/*! \brief Determins which thread code to run based on the state */
 extern void handle_con_state(struct sd_con_info *ci);
 
+/*! \brief Set the state of a connection and post its owner */
+extern void con_set_state(struct sd_con_info *ci, char ns);
+
 /*! \brief Bind the source address to next avaliable port >= 1500 */
 extern int con_bind_src_address(struct sd_con_info *ci);
 
-/*! \brief Connect to destination address */
+/*! \brief Start a non-blocking connect to the destination addresses, the
+ *         result is posted to ci->step */
 extern int con_connect(struct sd_con_info *ci);
 
+/*! \brief Handle readiness of a connecting socket, moves on to the next
+ *         address if it failed */
+extern void con_connect_event(struct sd_con_info *ci, int events);
+
+/*! \brief Timer callback to stop waiting for a peer that does not answer
+ *         the connect or handshake */
+extern void con_setup_timer_cb(void *v);
+
+/*! \brief Stop a lookup, connect or handshake in progress and close the
+ *         socket, returns 1 if there was one */
+extern int con_setup_cancel(struct sd_con_info *ci);
+
+/*! \brief Mark connection as established and start waiting for events */
+extern void con_set_established(struct sd_con_info *ci);
+
 /*! \brief Get an ascii string for the current connection state */
 extern char *get_con_state_string(struct sd_con_info *ci);
 
-/*! \brief Close a socket and cleanup */
-extern int socket_close(int *fd, char fd_clr, char enable_ssl, SSL *ssl);
+/*! \brief Put a socket in non-blocking mode for the rest of its life */
+extern int socket_set_nonblocking(int fd);
 
+/*! \brief Get the smoothed round trip time of a tcp socket */
+extern int socket_get_rtt(int fd, int *rtt_us);
 
-/* -[ common ]--------------------------------------------------------- */
+/*! \brief Raise SO_SNDBUF or SO_RCVBUF to len, never lowers it */
+extern int socket_buffer_raise(int fd, int opt, int len);
+
+/*! \brief Close a socket and cleanup */
+extern int socket_close(int *fd, char enable_ssl, SSL *ssl);
 
-/*! \brief lookup an address with getaddrinfo() */
-extern int address_lookup(struct sd_resolve_addr_info *rai);
 
-/*! \brief set resolve address information */
-extern void resolve_addr_set_info(struct sd_resolve_addr_info *ri, const char *a,
-    const char *s, char as);
+/* -[ common ]--------------------------------------------------------- */
 
 /*! \brief get a pointer to the sockaddr_X */
 extern void *get_in_addr(struct sockaddr *sa);
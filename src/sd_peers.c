@@ -15,6 +15,7 @@
 */
 
 #include <time.h>
+#include <limits.h>
 
 #include "sd.h"
 #include "sd_globals.h"
@@ -25,10 +26,27 @@
 #include "sd_ui.h"
 #include "sd_protocol.h"
 #include "sd_protocol_commands.h"
+#include "sd_idle.h"
+#include "sd_uring.h"
+#include "sd_stream.h"
 
 
 /* -[ peers ]---------------------------------------------------------- */
 
+static void peer_verify_timer_cb(void *v)
+{
+  struct sd_peer_info *pi = (struct sd_peer_info *) v;
+
+  if (pi->ctl_con.state == CON_STATE_ESTABLISHED &&
+      pi->ctl_con_verified == SD_OPTION_OFF)
+  {
+    ui_sd_err("Did not recieve version string in time.. Closing connection.");
+    core_lock_peer(pi);
+    ctl_con_close(pi);
+    core_unlock_peer(pi);
+  }
+}
+
 struct sd_peer_info *peer_init(const char *a, const char *p, char enable_ssl,
     struct sd_ssl_verify_info *vi)
 {
@@ -38,12 +56,17 @@ struct sd_peer_info *peer_init(const char *a, const char *p, char enable_ssl,
   
   /* set up control connection */
   con_init(&new_peer->ctl_con, a, p, enable_ssl, vi, CON_TYPE_CONTROL);
+  event_handler_init(&new_peer->ctl_con.ev, &ctl_con_event_cb, (void *) new_peer);
 
   /* set up rest */
   new_peer->ctl_buffer_offset = 0;
+  new_peer->ctl_send_buffer_len = 0;
   new_peer->ctl_con_verified = SD_OPTION_OFF;
+  new_peer->worker = core_next_worker();
+  timer_init(&new_peer->verify_timer, &peer_verify_timer_cb, (void *) new_peer);
   
   linked_list_init(&new_peer->ctl_cmd_backlog);
+  linked_list_init(&new_peer->ctl_send_backlog);
   linked_list_init(&new_peer->data_transfers);
 
   new_peer->ctl_con_verified = SD_OPTION_OFF;
@@ -95,11 +118,22 @@ void peer_set_closed(struct sd_peer_info *pi)
 {
   linked_list_iterate(&pi->data_transfers, &abort_unest_data_transfers);
 
-  sd_set_state(&pi->ctl_con.state, CON_STATE_CLOSED);
+  timer_del(&pi->verify_timer);
+  pi->ctl_send_buffer_len = 0;
+  linked_list_rem_all_entries(&pi->ctl_send_backlog, SD_OPTION_ON);
+  con_set_state(&pi->ctl_con, CON_STATE_CLOSED);
 }
 
 void peer_deinit(struct sd_peer_info *pi)
 {
+  event_handler_del(&pi->ctl_con.ev);
+  timer_del(&pi->ctl_con.setup_timer);
+  timer_del(&pi->verify_timer);
+  resolve_addr_free(&pi->ctl_con.resolve_dst_addr);
+  resolve_addr_free(&pi->ctl_con.resolve_src_addr);
+  completion_cancel(&pi->ctl_con.step);
+  linked_list_rem_all_entries(&pi->ctl_send_backlog, SD_OPTION_ON);
+
   linked_list_deinit_rem_all_entries(
       &pi->data_transfers,
       SD_OPTION_ON,
@@ -107,6 +141,13 @@ void peer_deinit(struct sd_peer_info *pi)
 }
 
 
+void peer_start_verify_timer(struct sd_peer_info *pi)
+{
+  if (gbls->conf->con_timeout > 0 && pi->ctl_con_verified == SD_OPTION_OFF)
+    event_timer_add(&gbls->net->event_loops[0], &pi->verify_timer,
+        gbls->conf->con_timeout * 1000);
+}
+
 
 /* -[ peers : getters ] ----------------------------------------------- */
 
@@ -151,6 +192,105 @@ struct sd_peer_info *con_get_peer(struct sd_con_info *ci)
 
 /* -[ data transfers ]------------------------------------------------- */
 
+/* the state limit ran out */
+static void data_transfer_deadline_cb(void *v)
+{
+  struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *) v;
+  char *state;
+
+  /* made it, the state machine takes it from here */
+  if (dti->data_con.state == CON_STATE_ESTABLISHED)
+    return;
+
+  state = get_data_transfer_state_string(dti);
+  ui_notify_printf("Data transfer %"PRIu64" timed out while %s.", dti->id, state);
+  SAFE_FREE(state);
+
+  core_lock_peer(dti->parent_peer);
+  data_transfer_abort(dti);
+  core_unlock_peer(dti->parent_peer);
+}
+
+/* report progress and close transfers that have stopped moving */
+static int data_window_clamp(int len)
+{
+  if (len < gbls->conf->data_window_min * 1024)
+    len = gbls->conf->data_window_min * 1024;
+  if (len > gbls->conf->data_window_max * 1024)
+    len = gbls->conf->data_window_max * 1024;
+  return len;
+}
+
+/* twice what the connection holds in flight, from the bytes moved since
+ * the last tick and the kernel's round trip time */
+static void data_window_adapt(struct sd_data_transfer_info *dti)
+{
+  uint64_t rate, bdp;
+  int rtt_us, want;
+
+  if (!dti->data_buffer ||
+      dti->transfer_state != DATA_TRANSFER_TRANSFER_STATE_RESUMED ||
+      socket_get_rtt(dti->data_con.sock_fd, &rtt_us) == -1 || rtt_us <= 0)
+    return;
+
+  /* a resend takes the bytes it asks for again off the leader's count */
+  if (dti->io_total_bytes_current < dti->io_total_bytes_last)
+    return;
+
+  rate = (dti->io_total_bytes_current - dti->io_total_bytes_last) * 1000 /
+    UPDATE_PROGRESS_INTERVAL; /* b / s */
+  bdp = rate * (uint64_t) rtt_us / 1000000;
+
+  /* powers of two so it settles */
+  for (want = 4096; want < INT_MAX / 2 && (uint64_t) want < 2 * bdp; want *= 2)
+    ;
+
+  dti->data_window_want = data_window_clamp(want);
+}
+
+static int data_streams_clamp(int n)
+{
+  if (n < 1)
+    n = 1;
+  if (n > DATA_STREAMS_MAX)
+    n = DATA_STREAMS_MAX;
+  return n;
+}
+
+static void data_transfer_io_timer_cb(void *v)
+{
+  struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *) v;
+
+  if (dti->state != DATA_TRANSFER_STATE_TRANSFERING)
+    return;
+
+  if (dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_RESUMED &&
+      dti->io_total_bytes_current == dti->io_total_bytes_last)
+    dti->io_idle_ms += UPDATE_PROGRESS_INTERVAL;
+  else
+    dti->io_idle_ms = 0;
+
+  data_window_adapt(dti);
+  data_transfer_set_io(dti);
+
+  if (gbls->conf->data_idle_timeout > 0 &&
+      dti->io_idle_ms >= gbls->conf->data_idle_timeout * 1000)
+  {
+    ui_notify_printf("Data transfer %"PRIu64" moved nothing for %i seconds.",
+        dti->id, gbls->conf->data_idle_timeout);
+    data_con_close(dti);
+    return;
+  }
+
+  event_timer_add(&gbls->net->event_loops[dti->parent_peer->worker],
+      &dti->io_timer, UPDATE_PROGRESS_INTERVAL);
+}
+
+static void data_transfer_state_step_cb(void *v)
+{
+  handle_data_transfer_state(v, 0);
+}
+
 struct sd_data_transfer_info *data_transfer_init(
     struct sd_peer_info *pi,
     char enable_ssl, struct sd_ssl_verify_info *vi,
@@ -166,9 +306,15 @@ struct sd_data_transfer_info *data_transfer_init(
   new_dt->transfer_state = DATA_TRANSFER_TRANSFER_STATE_RESUMED;
   new_dt->state = DATA_TRANSFER_STATE_SETUP_PENDING;
 
+  new_dt->data_buffer = NULL;
+  new_dt->data_window_len = 0;
+  new_dt->data_window_want = 0;
   new_dt->data_buffer_lower_offset = 0;
   new_dt->data_buffer_window_size = 0;
 
+  new_dt->streams = data_streams_clamp(gbls->conf->data_streams);
+  new_dt->checksum = gbls->conf->data_checksum;
+
 
   /* file */
 
@@ -190,6 +336,12 @@ struct sd_data_transfer_info *data_transfer_init(
       NULL,
       NULL,
       enable_ssl, vi, CON_TYPE_DATA);
+  event_handler_init(&new_dt->data_con.ev, &data_con_event_cb, (void *) new_dt);
+  timer_init(&new_dt->io_timer, &data_transfer_io_timer_cb, (void *) new_dt);
+  timer_init(&new_dt->deadline, &data_transfer_deadline_cb, (void *) new_dt);
+  completion_init(&new_dt->state_step, &data_transfer_state_step_cb,
+      (void *) new_dt);
+  new_dt->data_con.owner = &new_dt->state_step;
 
   /* set local */
   resolve_addr_set_info(
@@ -226,16 +378,21 @@ struct list_item *data_transfer_add(struct sd_peer_info *pi)
 void data_transfer_init_io(struct sd_data_transfer_info *dti)
 {
   dti->io_total_bytes_current = dti->file.position;
-  dti->io_total_bytes_last = dti->file.position;
+
+  /* the leader shows what all streams have moved, some may be first */
+  if (dti->stream.group && dti->stream.group->leader == dti)
+    dti->io_total_bytes_current = dti->stream.group->base +
+      dti->stream.group->moved;
+
+  dti->io_total_bytes_last = dti->io_total_bytes_current;
 
   data_transfer_reset_io(dti);
 }
 
-int data_transfer_idle_iter(void *value, int index)
+void data_transfer_step(struct sd_data_transfer_info *dti)
 {
-  linked_list_iterate(&((struct sd_peer_info *)value)->data_transfers,
-      &handle_data_transfer_state);
-  return 0;
+  completion_post(&dti->state_step, PROC_STATE_COMPLETE);
+  core_wake();
 }
 
 int data_transfer_abort(struct sd_data_transfer_info *dti)
@@ -253,8 +410,11 @@ int data_transfer_abort(struct sd_data_transfer_info *dti)
   {
     case DATA_TRANSFER_STATE_VERDICT_PENDING:
     case DATA_TRANSFER_STATE_PREPARATION_PENDING:
+      /* may still be connecting or in the handshake */
+      if (con_setup_cancel(&dti->data_con))
+        break;
       if (dti->con_meth == CON_METH_ACTIVE) {
-        socket_close(&dti->data_con.sock_fd, SD_OPTION_OFF, SD_OPTION_OFF, NULL);
+        socket_close(&dti->data_con.sock_fd, SD_OPTION_OFF, NULL);
       }
       break;
   }
@@ -264,13 +424,23 @@ int data_transfer_abort(struct sd_data_transfer_info *dti)
     case DATA_TRANSFER_STATE_TRANSFERING:
       /* were connected */
       if (dti->data_con.state == CON_STATE_ESTABLISHED) {
-	      socket_close(&dti->data_con.sock_fd, SD_OPTION_ON, dti->data_con.enable_ssl,
+        event_handler_del(&dti->data_con.ev);
+        data_uring_deinit(dti);
+        data_splice_deinit(dti);
+	      socket_close(&dti->data_con.sock_fd, dti->data_con.enable_ssl,
             dti->data_con.ssl);
       }
+      /* still resolving, connecting or in the handshake */
+      else {
+        con_setup_cancel(&dti->data_con);
+      }
 
       break;
   }
 
+  /* the file can not be completed by the other streams */
+  data_stream_abort(dti);
+
   data_transfer_set_state(dti, DATA_TRANSFER_STATE_ABORTED);
 
   ui_notify_printf("Transfer was aborted.");
@@ -280,18 +450,33 @@ int data_transfer_abort(struct sd_data_transfer_info *dti)
 
 void data_transfer_deinit(struct sd_data_transfer_info *dti)
 {
-
+  event_handler_del(&dti->data_con.ev);
+  timer_del(&dti->data_con.setup_timer);
+  resolve_addr_free(&dti->data_con.resolve_dst_addr);
+  resolve_addr_free(&dti->data_con.resolve_src_addr);
+  completion_cancel(&dti->data_con.step);
+  data_uring_deinit(dti);
+  data_splice_deinit(dti);
+  data_read_ahead_deinit(dti);
+  data_write_behind_deinit(dti);
+  completion_cancel(&dti->written);
+  buffer_pool_put(dti->data_buffer, dti->data_window_len);
+  dti->data_buffer = NULL;
+  timer_del(&dti->io_timer);
+  timer_del(&dti->deadline);
+  completion_cancel(&dti->state_step);
+  data_stream_leave(dti);
+  ui_purge_data_transfer_events(dti);
 }
 
 
 void data_transfer_reset_io(struct sd_data_transfer_info *dti)
 {
   dti->io_byte_diff_zero = SD_OPTION_OFF;
+  dti->io_idle_ms = 0;
   
   gettimeofday(&dti->io_time_last, NULL);
   gettimeofday(&dti->io_time_current, NULL);
-  
-  data_transfer_set_io(dti);
 }
 
 
@@ -309,6 +494,9 @@ int handle_data_transfer_state(void *v, int index)
 {
   struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *)v;
 
+  /* another stream of its file failed */
+  data_stream_check(dti);
+
   switch (dti->state)
   {
     case DATA_TRANSFER_STATE_SETUP_PENDING:
@@ -340,7 +528,7 @@ int handle_data_transfer_state(void *v, int index)
       switch (dti->accept_info->state)
       {
         case SERVER_ACCEPT_STATE_ERROR:
-          sd_set_state(&dti->accept_info->state, SERVER_ACCEPT_STATE_DELETE);
+          server_accept_set_state(dti->accept_info, SERVER_ACCEPT_STATE_DELETE);
           data_transfer_abort(dti);
           break;
         case SERVER_ACCEPT_STATE_RESOLVED:
@@ -380,24 +568,46 @@ int handle_data_transfer_state(void *v, int index)
         switch (dti->file.state)
         {
           case FILE_STATE_CLOSED:
-            if (file_open(&dti->file, dti->direction) == -1)
+            /* connected in time */
+            timer_del(&dti->deadline);
+
+            /* the other streams moved the file meanwhile */
+            if (data_stream_done(dti)) {
+              data_transfer_set_completed(dti);
+              break;
+            }
+
+            if (file_open(&dti->file, dti->direction) == -1) {
               data_transfer_abort(dti);
-            break;
-          case FILE_STATE_OPENED:
-            switch (dti->direction)
+              break;
+            }
+            /* frames are built in data_buffer */
+            if (dti->stream.group)
+              file_unmap(&dti->file);
+            dti->data_window_len = data_window_clamp(DATA_BUFFER_LEN);
+            dti->data_window_want = dti->data_window_len;
+            dti->data_buffer = buffer_pool_get(dti->data_window_len);
+            data_sendfile_init(dti);
+            data_splice_init(dti);
+
+            if (data_uring_init(dti,
+                  &gbls->net->event_loops[dti->parent_peer->worker]) == -1)
             {
-              case DATA_TRANSFER_DIRECTION_OUTGOING:
-                handle_data_send(dti,
-                    dti->data_buffer,
-                    sizeof dti->data_buffer);
-                break;
-              case DATA_TRANSFER_DIRECTION_INCOMING:
-                handle_data_recv(dti,
-                    &gbls->net->master_fd_set,
-                    gbls->net->highest_fd,
-                    sizeof dti->data_buffer);
-                break;
+              /* io is done from data_con_event_cb() */
+              data_read_ahead_init(dti);
+              data_write_behind_init(dti);
+              event_handler_add(
+                  &gbls->net->event_loops[dti->parent_peer->worker],
+                  &dti->data_con.ev,
+                  dti->data_con.sock_fd, data_transfer_get_events(dti));
             }
+
+            /* progress is reported from data_transfer_io_timer_cb() */
+            if (dti->state == DATA_TRANSFER_STATE_TRANSFERING)
+              event_timer_add(&gbls->net->event_loops[dti->parent_peer->worker],
+                  &dti->io_timer, UPDATE_PROGRESS_INTERVAL);
+            break;
+          case FILE_STATE_OPENED:
             break;
         }
       }
@@ -417,6 +627,22 @@ int handle_data_transfer_state(void *v, int index)
 
 /* -[ data transfers : getters ]--------------------------------------- */
 
+int data_transfer_get_events(struct sd_data_transfer_info *dti)
+{
+  if (dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_PAUSED)
+    return 0;
+
+  switch (dti->direction)
+  {
+    case DATA_TRANSFER_DIRECTION_OUTGOING:
+      return SD_EVENT_WRITE;
+    case DATA_TRANSFER_DIRECTION_INCOMING:
+      return SD_EVENT_READ;
+  }
+
+  return 0;
+}
+
 /* get next transfer id */
 static uint64_t next_transfer_id;
 static char next_transfer_direction;
@@ -767,11 +993,23 @@ void data_transfer_set_verdict(struct sd_data_transfer_info *dti, char v)
 void data_transfer_set_transfer_state(struct sd_data_transfer_info *dti, char v)
 {
   dti->transfer_state = v;
+  event_handler_mod(&dti->data_con.ev, data_transfer_get_events(dti));
+  data_uring_submit(dti);
   ui_data_transfer_change(dti, SD_DATA_TRANSFER_CHANGE_TYPE_UPDATE);
+
+  /* the streams of a file are paused and resumed together */
+  data_stream_set_transfer_state(dti, v);
 }
 
 void data_transfer_set_state(struct sd_data_transfer_info *dti, char nstate)
 {
+  char changed;
+
+  /* let the state machine act on it */
+  changed = dti->state != nstate;
+  if (changed)
+    data_transfer_step(dti);
+
   dti->state = nstate;
 
   switch (dti->state)
@@ -788,6 +1026,43 @@ void data_transfer_set_state(struct sd_data_transfer_info *dti, char nstate)
       break;
   }
 
+  /* limit the states that wait on the peer, the deadline is only armed
+   * before the data connection is up so other workers never touch it */
+  switch (dti->state)
+  {
+    case DATA_TRANSFER_STATE_VERDICT_PENDING:
+      if (changed && gbls->conf->data_verdict_timeout > 0)
+        event_timer_add(&gbls->net->event_loops[0], &dti->deadline,
+            gbls->conf->data_verdict_timeout * 1000);
+      break;
+    case DATA_TRANSFER_STATE_PREPARATION_PENDING:
+    case DATA_TRANSFER_STATE_TRANSFERING:
+      if (changed && gbls->conf->con_timeout > 0)
+        event_timer_add(&gbls->net->event_loops[0], &dti->deadline,
+            gbls->conf->con_timeout * 1000);
+      break;
+    case DATA_TRANSFER_STATE_COMPLETED:
+    case DATA_TRANSFER_STATE_ABORTED:
+      timer_del(&dti->io_timer);
+      timer_del(&dti->deadline);
+      /* nothing moves any more, let another transfer have it */
+      data_read_ahead_deinit(dti);
+      data_write_behind_deinit(dti);
+      buffer_pool_put(dti->data_buffer, dti->data_window_len);
+      dti->data_buffer = NULL;
+      break;
+    default:
+      timer_del(&dti->deadline);
+      break;
+  }
+
+  ui_data_transfer_change(dti, SD_DATA_TRANSFER_CHANGE_TYPE_UPDATE);
+}
+
+void data_transfer_set_streams(struct sd_data_transfer_info *dti, int n)
+{
+  dti->streams = data_streams_clamp(n);
+
   ui_data_transfer_change(dti, SD_DATA_TRANSFER_CHANGE_TYPE_UPDATE);
 }
 
@@ -807,30 +1082,17 @@ void data_transfer_set_wan(struct sd_data_transfer_info *dti,
 
 void data_transfer_set_io(struct sd_data_transfer_info *dti)
 {
-  struct timeval time_now;
-  uint64_t bd;
-  int td;
-  
-  gettimeofday(&time_now, NULL);
-
-  td = (time_diff(&time_now, &dti->io_time_last));
-  bd = dti->io_total_bytes_current - dti->io_total_bytes_last;
-
-  if (td > UPDATE_PROGRESS_INTERVAL)
-  {
-    memcpy(&dti->io_time_last, &dti->io_time_current, sizeof (struct timeval));
-    memcpy(&dti->io_time_current, &time_now, sizeof (struct timeval));
+  memcpy(&dti->io_time_last, &dti->io_time_current, sizeof (struct timeval));
+  gettimeofday(&dti->io_time_current, NULL);
 
-    ui_data_transfer_progress_change(dti);
-    
-    if (!bd)
-      dti->io_byte_diff_zero = SD_OPTION_ON;
-    else
-      dti->io_byte_diff_zero = SD_OPTION_OFF;
+  ui_data_transfer_progress_change(dti);
 
-    dti->io_total_bytes_last = dti->io_total_bytes_current;
-  }
+  if (dti->io_total_bytes_current == dti->io_total_bytes_last)
+    dti->io_byte_diff_zero = SD_OPTION_ON;
+  else
+    dti->io_byte_diff_zero = SD_OPTION_OFF;
 
+  dti->io_total_bytes_last = dti->io_total_bytes_current;
 }
 
 
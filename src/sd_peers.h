@@ -15,6 +15,12 @@
 #include "sd_file.h"
 #include "sd_ssl.h"
 #include "sd_thread.h"
+#include "sd_stream.h"
+
+/* partial declerations */
+struct sd_uring_info;
+struct sd_read_ahead;
+struct sd_write_behind;
 
 /*! \brief Holds data transfer information */
 struct sd_data_transfer_info
@@ -75,10 +81,15 @@ struct sd_data_transfer_info
 
   struct file_info file;
 
-  /* this value needs to be large for good speeds
-   * on very fast networks */
+  /* only held while transfering, the first size, it then follows twice
+   * the bandwidth-delay product within data_window_min and _max */
 #define DATA_BUFFER_LEN                      102400   /* 100 kB */
-  char data_buffer[DATA_BUFFER_LEN];
+#define DATA_WINDOW_MIN_DEFAULT                  64   /* kB */
+#define DATA_WINDOW_MAX_DEFAULT                8192   /* kB */
+#define DATA_WINDOW_MAX_LIMIT               1048576   /* kB */
+  char *data_buffer; /* from the buffer pool */
+  int data_window_len; /* size of data_buffer */
+  int data_window_want; /* taken when data_buffer is next empty */
   int data_buffer_lower_offset;
   int data_buffer_window_size;
 
@@ -92,6 +103,44 @@ struct sd_data_transfer_info
 
   struct timeval io_time_last;
   struct timeval io_time_current;
+
+  /* progress reports and idle reaping, on the peer's worker loop */
+  struct sd_timer io_timer;
+  int io_idle_ms;
+
+  /* limit on the current state, on loop 0 */
+  struct sd_timer deadline;
+
+  /* runs handle_data_transfer_state(), posted when anything it looks at
+   * changes */
+  struct sd_completion state_step;
+
+  /* set when the data is moved by io_uring instead of data_con_event_cb() */
+  struct sd_uring_info *uring;
+
+  /* plain outgoing data is sent with sendfile() instead of the buffer */
+  char data_sendfile;
+
+  /* plain incoming data is received with splice() instead of the buffer */
+  char data_splice;
+  int data_splice_pipe[2];
+  int data_splice_len; /* bytes in the pipe */
+
+  /* set when the next buffer is read while data_buffer is sent */
+  struct sd_read_ahead *read_ahead;
+
+  /* set when received buffers are written while the socket is read, the
+   * writer posts written once the last is on disk or a write failed */
+  struct sd_write_behind *write_behind;
+  struct sd_completion written;
+
+  /* data connections the file is split over, more than one moves it in
+   * frames on sibling transfers */
+  int streams;
+  struct sd_stream_info stream;
+
+  /* frames carry a CRC32C, the receiver asks for damaged ones again */
+  char checksum;
 };
 
 
@@ -104,15 +153,25 @@ struct sd_peer_info
 #define CTL_BUFFER_LEN                       10240  /* 10 kB */
   char ctl_buffer[CTL_BUFFER_LEN]; /* for incomming cmds */
   int ctl_buffer_offset;
+  char ctl_send_buffer[CTL_BUFFER_LEN]; /* cmds the socket has not taken */
+  int ctl_send_buffer_len;
+  linked_list ctl_send_backlog; /* char *, cmds waiting for room in it */
   linked_list ctl_cmd_backlog; /* struct protocol_command_entry */
   char ctl_con_verified;
 #define CTL_CON_VERIFY_PENDING                   2
 #define SD_MAX_PROTOCOL_VERSION_LEN             64
   char peer_protocol_version[SD_MAX_PROTOCOL_VERSION_LEN];
+  int peer_caps; /* what it said it can do after the version */
+#define PEER_CAP_STREAMS                      0x01
+#define PEER_CAP_CHECKSUM                     0x02
 
   /* data connections */
 
   linked_list data_transfers; /* struct sd_data_transfer_info */
+  int worker; /* core worker that moves the transfer data */
+
+  /* the protocol version has to arrive in time, on loop 0 */
+  struct sd_timer verify_timer;
 };
 
 
@@ -138,6 +197,9 @@ extern void peer_set_closed(struct sd_peer_info *pi);
 /*! \brief Deinitialise a peer and its data transfers */
 extern void peer_deinit(struct sd_peer_info *pi);
 
+/*! \brief Give the peer con_timeout to send its protocol version */
+extern void peer_start_verify_timer(struct sd_peer_info *pi);
+
 
 /* -[ peers : getters ] ----------------------------------------------- */
 
@@ -173,8 +235,9 @@ extern void data_transfer_deinit(struct sd_data_transfer_info *dti);
 /*! \brief Abort the unestablished transfers for given */
 extern int abort_unest_data_transfers(void *v, int i);
 
-/*! \brief Runs in idle to handle peers data transfers */
-extern int data_transfer_idle_iter(void *value, int index);
+/*! \brief Have the core run the state machine of the transfer again,
+ *         safe from any thread */
+extern void data_transfer_step(struct sd_data_transfer_info *dti);
 
 /*! \brief Abort the transfer appropriatly according to its current state */
 extern int data_transfer_abort(struct sd_data_transfer_info *dti);
@@ -182,11 +245,14 @@ extern int data_transfer_abort(struct sd_data_transfer_info *dti);
 /*! \brief Reset the data transfer IO components */
 extern void data_transfer_reset_io(struct sd_data_transfer_info *dti);
 
-/*! \brief Handles the data transfer based on it state in idle */
+/*! \brief Handles the data transfer based on it state, from state_step */
 extern int handle_data_transfer_state(void *v, int index);
 
 /* -[ data transfers : getters ]--------------------------------------- */
 
+/*! \brief Get the socket events the data connection should wait for */
+extern int data_transfer_get_events(struct sd_data_transfer_info *dti);
+
 /*! \brief Get the next id for peer, based on direction */
 extern uint64_t *get_next_transfer_id(struct sd_peer_info *pi, char dir);
 
@@ -254,6 +320,9 @@ extern void data_transfer_set_id(struct sd_data_transfer_info *dti, char directi
 
 
 
+/*! \brief Set the number of data connections to split the file over */
+extern void data_transfer_set_streams(struct sd_data_transfer_info *dti, int n);
+
 /*! \brief Set the data transfer wan information */
 extern void data_transfer_set_wan(struct sd_data_transfer_info *dti,
     const char *send_a, const char *send_s);
@@ -267,7 +336,7 @@ extern void data_transfer_set_verdict(struct sd_data_transfer_info *dti, char v)
 /*! \brief Set the data transfer transfer state */
 extern void data_transfer_set_transfer_state(struct sd_data_transfer_info *dti, char v);
 
-/*! \brief Set the data transfer transfer based on last and current */
+/*! \brief Report progress since the last report */
 extern void data_transfer_set_io(struct sd_data_transfer_info *dti);
 
 
@@ -14,6 +14,10 @@
    GNU General Public License for more details.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* splice() */
+#endif
+
 #ifdef WIN32
 
 #include <windows.h>
@@ -21,11 +25,18 @@
 #else
 
 #include <unistd.h>
-#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #endif
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -40,6 +51,9 @@
 #include "sd_dynamic_memory.h"
 #include "sd_protocol_commands.h"
 #include "sd_version.h"
+#include "sd_uring.h"
+#include "sd_stream.h"
+#include "sd_idle.h"
 
 
 int string_url_encode(char *dst, const char *str, int nbytes)
@@ -217,7 +231,8 @@ int ctl_process_cmd_iter_cb(void *v, int index)
   return 0;
 }
 
-int command_pack(const char *name, char *b, int nbytes, va_list args)
+int command_pack(const char *name, int nargs, char *b, int nbytes,
+    va_list args)
 {
   int i, ncmds;
   char fmt[512];
@@ -239,20 +254,30 @@ int command_pack(const char *name, char *b, int nbytes, va_list args)
   snprintf(fmt, sizeof fmt, "%s %s\r\n",
       control_command[i].name, control_command[i].pack_arg_fmt);
 
+  /* end the line after nargs args (the name and the formats are separated
+   * by a space) */
+  if (nargs > 0 && nargs < control_command[i].nargs)
+  {
+    char *p;
+    p = fmt;
+    while (nargs-- >= 0 && (p = strchr(p + 1, ' ')) != NULL)
+      ;
+    if (p != NULL)
+      strcpy(p, "\r\n");
+  }
+
   vsnprintf(b, nbytes, fmt, args);
 
   return 0;
 }
 
-int send_protocol_command(struct sd_peer_info *pi, const char *name, ...)
+static int send_protocol_command_va(struct sd_peer_info *pi, const char *name,
+    int nargs, va_list args)
 {
-  va_list args;
   char sbuffer[SEND_BUFFER_LEN];
   int ret;
 
-  va_start(args, name);
-  ret = command_pack(name, sbuffer, sizeof sbuffer, args);
-  va_end(args);
+  ret = command_pack(name, nargs, sbuffer, sizeof sbuffer, args);
 
   /* don't send if invalid */
   if (ret == -1)
@@ -277,6 +302,31 @@ int send_protocol_command(struct sd_peer_info *pi, const char *name, ...)
   return 0;
 }
 
+int send_protocol_command(struct sd_peer_info *pi, const char *name, ...)
+{
+  va_list args;
+  int ret;
+
+  va_start(args, name);
+  ret = send_protocol_command_va(pi, name, 0, args);
+  va_end(args);
+
+  return ret;
+}
+
+int send_protocol_command_nargs(struct sd_peer_info *pi, const char *name,
+    int nargs, ...)
+{
+  va_list args;
+  int ret;
+
+  va_start(args, nargs);
+  ret = send_protocol_command_va(pi, name, nargs, args);
+  va_end(args);
+
+  return ret;
+}
+
 void init_protocol_command_entry(struct sd_peer_info *pi,
     struct sd_protocol_command_info *pci, ...)
 {
@@ -363,7 +413,8 @@ void ctl_con_close(struct sd_peer_info *pi)
   char msg[256];
 
   addrs = get_sockaddr_storage_string(&pi->ctl_con.dst_sa);
-	socket_close(&pi->ctl_con.sock_fd, SD_OPTION_ON, pi->ctl_con.enable_ssl, 
+  event_handler_del(&pi->ctl_con.ev);
+	socket_close(&pi->ctl_con.sock_fd, pi->ctl_con.enable_ssl, 
       pi->ctl_con.ssl);
   snprintf(msg, sizeof(msg), "Closed control connection with %s.", addrs);
   ui_notify(msg);
@@ -372,40 +423,11 @@ void ctl_con_close(struct sd_peer_info *pi)
   peer_set_closed(pi);
 }
 
-int handle_ctl_recv(struct sd_peer_info *pi, fd_set *m, int mfd, int len)
+int handle_ctl_recv(struct sd_peer_info *pi, int len)
 {
   int recvb, startn;
 
-  /* select method not working well on windows */
-
-#if 0
-  fd_set read_fd_set;
-
-  read_fd_set = *m;
-  if (select(mfd + 1, &read_fd_set, NULL, NULL, &pi->ctl_con.read_timeout) == -1)
-  {
-    ui_sock_err("select");
-    if (errno == EINTR) {
-      perror("select()");
-    }
-    else {
-      DEBUG_SYS_ERROR_EXIT(errno, "select");
-    }
-    return -1;
-  }
-  if (FD_ISSET(pi->ctl_con.sock_fd, &read_fd_set))
-#endif
-
-
-
-#ifdef WIN32
-      // If iMode != 0, non-blocking mode is enabled.
-  u_long iMode = 1;
-  ioctlsocket(pi->ctl_con.sock_fd, FIONBIO, &iMode);
-#else
-  fcntl(pi->ctl_con.sock_fd, F_SETFL, O_NONBLOCK);
-#endif
-
+  /* only called when readable, the socket is non-blocking */
   if (pi->ctl_con.enable_ssl == SD_OPTION_ON)
   {
     recvb = SSL_read(pi->ctl_con.ssl,
@@ -420,14 +442,9 @@ int handle_ctl_recv(struct sd_peer_info *pi, fd_set *m, int mfd, int len)
           0);
   }
 
-#ifndef WIN32
-  fcntl(pi->ctl_con.sock_fd, F_SETFL, 0);
-#else
+#ifdef WIN32
   int recv_ret;
   recv_ret = WSAGetLastError();
-  // If iMode != 0, non-blocking mode is enabled.
-  iMode = 0;
-  ioctlsocket(pi->ctl_con.sock_fd, FIONBIO, &iMode);
 #endif
 
   if (recvb <= 0)
@@ -436,7 +453,8 @@ int handle_ctl_recv(struct sd_peer_info *pi, fd_set *m, int mfd, int len)
     if (recvb == 0)
     {
       ui_notify("Peer closed the connection.");
-      socket_close(&pi->ctl_con.sock_fd, SD_OPTION_ON, pi->ctl_con.enable_ssl,
+      event_handler_del(&pi->ctl_con.ev);
+      socket_close(&pi->ctl_con.sock_fd, pi->ctl_con.enable_ssl,
           pi->ctl_con.ssl);
       peer_set_closed(pi);
       return 0;
@@ -460,7 +478,7 @@ int handle_ctl_recv(struct sd_peer_info *pi, fd_set *m, int mfd, int len)
 #ifdef WIN32
         if (recv_ret == WSAEWOULDBLOCK)
 #else
-        if (errno == EAGAIN)
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
         /* resource unavaliable */
         {
@@ -470,7 +488,8 @@ int handle_ctl_recv(struct sd_peer_info *pi, fd_set *m, int mfd, int len)
       }
 
       ui_sock_err("recv");
-      socket_close(&pi->ctl_con.sock_fd, SD_OPTION_ON, pi->ctl_con.enable_ssl,
+      event_handler_del(&pi->ctl_con.ev);
+      socket_close(&pi->ctl_con.sock_fd, pi->ctl_con.enable_ssl,
           pi->ctl_con.ssl);
       peer_set_closed(pi);
       return -1;
@@ -544,42 +563,151 @@ found_term:
   return i;
 } 
 
-int ctl_recv_iter_cb(void *v, int index)
+static void ctl_con_event(struct sd_peer_info *pi, int events)
 {
-  if (((struct sd_peer_info *)v)->ctl_con.state == CON_STATE_ESTABLISHED)
-    handle_ctl_recv((struct sd_peer_info *) v, &gbls->net->master_fd_set,
-        gbls->net->highest_fd, sizeof(((struct sd_peer_info *)(v))->ctl_buffer));
+  if (pi->ctl_con.state == CON_STATE_CONNECTING)
+  {
+    con_connect_event(&pi->ctl_con, events);
+    return;
+  }
+  if (pi->ctl_con.state == CON_STATE_SSL_VERIFY)
+  {
+    con_ssl_handshake(&pi->ctl_con);
+    return;
+  }
 
-  return 0;
+  /* room for queued commands */
+  if (events & SD_EVENT_WRITE)
+  {
+    if (handle_ctl_send_flush(pi) == -1)
+    {
+      ctl_con_close(pi);
+      return;
+    }
+  }
+
+  if (!(events & SD_EVENT_READ))
+    return;
+
+  do
+  {
+    if (handle_ctl_recv(pi, sizeof pi->ctl_buffer) == -1)
+      break;
+  }
+  /* ssl may have allready read more records off the socket */
+  while (pi->ctl_con.state == CON_STATE_ESTABLISHED && pi->ctl_con.enable_ssl &&
+      SSL_pending(pi->ctl_con.ssl) > 0);
+
+  /* handle recieved commands */
+  ctl_process_cmd_iter_cb((void *) pi, 0);
+}
+
+void ctl_con_event_cb(void *v, int events)
+{
+  struct sd_peer_info *pi = (struct sd_peer_info *) v;
+
+  /* commands act on transfers the peer's worker is moving */
+  core_lock_peer(pi);
+  ctl_con_event(pi, events);
+  core_unlock_peer(pi);
 }
 
 int handle_ctl_send(struct sd_peer_info *pi, char *b, int len)
 {
-  int t, n, brem;
+  /* queue behind anything the socket has not taken yet, commands that do
+   * not fit wait in the backlog until it has */
+  if (pi->ctl_send_backlog.top ||
+      pi->ctl_send_buffer_len + len > (int) sizeof pi->ctl_send_buffer)
+  {
+    char *c;
+    SAFE_CALLOC(c, 1, len + 1);
+    memcpy(c, b, len);
+    linked_list_add(&pi->ctl_send_backlog, c);
+  }
+  else
+  {
+    memcpy(pi->ctl_send_buffer + pi->ctl_send_buffer_len, b, len);
+    pi->ctl_send_buffer_len += len;
+  }
+
+  return handle_ctl_send_flush(pi);
+}
+
+/* move waiting commands into the room the socket made, in order */
+static void ctl_send_backlog_fill(struct sd_peer_info *pi)
+{
+  char *c;
+  int len;
+
+  while (pi->ctl_send_backlog.top)
+  {
+    c = (char *) pi->ctl_send_backlog.list.value;
+    len = strlen(c);
+    if (pi->ctl_send_buffer_len + len > (int) sizeof pi->ctl_send_buffer)
+      break;
+
+    memcpy(pi->ctl_send_buffer + pi->ctl_send_buffer_len, c, len);
+    pi->ctl_send_buffer_len += len;
+    linked_list_rem(&pi->ctl_send_backlog, &pi->ctl_send_backlog.list,
+        SD_OPTION_ON);
+  }
+}
+
+int handle_ctl_send_flush(struct sd_peer_info *pi)
+{
+  int n;
 
-  brem = len;
-  t = 0;
+  ctl_send_backlog_fill(pi);
 
-  while (t < len)
+  while (pi->ctl_send_buffer_len > 0)
   {
     if (pi->ctl_con.enable_ssl)
     {
-      n = SSL_write(pi->ctl_con.ssl, b + t, brem);
+      /* a retry after WANT_WRITE starts from the same place */
+      n = SSL_write(pi->ctl_con.ssl, pi->ctl_send_buffer,
+          pi->ctl_send_buffer_len);
     }
     else
     {
-      n = send(pi->ctl_con.sock_fd, b + t, brem, 0);
+      n = send(pi->ctl_con.sock_fd, pi->ctl_send_buffer,
+          pi->ctl_send_buffer_len, SD_MSG_NOSIGNAL);
     }
 
-    if (n == -1)
+    if (n <= 0)
     {
+      if (pi->ctl_con.enable_ssl)
+      {
+        int ret;
+        ret = SSL_get_error(pi->ctl_con.ssl, n);
+
+        if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE)
+          break;
+      }
+      else
+      {
+#ifdef WIN32
+        if (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+          break;
+      }
+
       ui_sock_err("send");
       return -1;
     }
-    t += n;
-    brem -= n;
+
+    /* move what is left to front of buffer */
+    pi->ctl_send_buffer_len -= n;
+    memmove(pi->ctl_send_buffer, pi->ctl_send_buffer + n,
+        pi->ctl_send_buffer_len);
+    ctl_send_backlog_fill(pi);
   }
 
+  /* wait for room in the socket if anything is left */
+  event_handler_mod(&pi->ctl_con.ev,
+      SD_EVENT_READ | (pi->ctl_send_buffer_len ? SD_EVENT_WRITE : 0));
+
   return 0;
 }
 
@@ -596,9 +724,14 @@ void data_con_close(struct sd_data_transfer_info *dti)
   ui_notify(msg);
   SAFE_FREE(addrs);
 
-	socket_close(&dti->data_con.sock_fd, SD_OPTION_ON, dti->data_con.enable_ssl, 
+  event_handler_del(&dti->data_con.ev);
+  data_uring_deinit(dti);
+  data_splice_deinit(dti);
+  data_read_ahead_deinit(dti);
+  data_write_behind_deinit(dti);
+	socket_close(&dti->data_con.sock_fd, dti->data_con.enable_ssl, 
       dti->data_con.ssl);
-  sd_set_state(&dti->data_con.state, CON_STATE_CLOSED);
+  con_set_state(&dti->data_con, CON_STATE_CLOSED);
 
   if (dti->file.state == FILE_STATE_OPENED)
     file_close(&dti->file);
@@ -617,9 +750,14 @@ void data_transfer_set_completed(struct sd_data_transfer_info *dti)
   ui_notify(msg);
   SAFE_FREE(addrs);
 
-	socket_close(&dti->data_con.sock_fd, SD_OPTION_ON, dti->data_con.enable_ssl, 
+  event_handler_del(&dti->data_con.ev);
+  data_uring_deinit(dti);
+  data_splice_deinit(dti);
+  data_read_ahead_deinit(dti);
+  data_write_behind_deinit(dti);
+	socket_close(&dti->data_con.sock_fd, dti->data_con.enable_ssl, 
       dti->data_con.ssl);
-  sd_set_state(&dti->data_con.state, CON_STATE_CLOSED);
+  con_set_state(&dti->data_con, CON_STATE_CLOSED);
   
   if (dti->file.state == FILE_STATE_OPENED)
     file_close(&dti->file);
@@ -629,71 +767,488 @@ void data_transfer_set_completed(struct sd_data_transfer_info *dti)
   data_transfer_reset_io(dti);
 }
 
-int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int len)
+void data_splice_init(struct sd_data_transfer_info *dti)
 {
-  int recvb;
-  //fd_set read_fd_set;
+  dti->data_splice = SD_OPTION_OFF;
+#ifdef SD_SPLICE
+  /* ssl records and frames are opened in user space */
+  if (gbls->conf->data_splice != SD_OPTION_ON ||
+      dti->direction != DATA_TRANSFER_DIRECTION_INCOMING ||
+      dti->stream.group ||
+      dti->data_con.enable_ssl == SD_OPTION_ON)
+    return;
+
+  if (pipe2(dti->data_splice_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    ui_sys_err(errno, "pipe2");
+    return;
+  }
+  /* a bigger pipe takes more per call, keep the default if refused */
+  fcntl(dti->data_splice_pipe[1], F_SETPIPE_SZ, DATA_SPLICE_PIPE_LEN);
 
-  /* return if were paused */
-  if (dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_PAUSED)
+  dti->data_splice_len = 0;
+  dti->data_splice = SD_OPTION_ON;
+#endif
+}
+
+void data_splice_deinit(struct sd_data_transfer_info *dti)
+{
+#ifdef SD_SPLICE
+  if (!dti->data_splice)
+    return;
+
+  close(dti->data_splice_pipe[0]);
+  close(dti->data_splice_pipe[1]);
+  dti->data_splice_len = 0;
+  dti->data_splice = SD_OPTION_OFF;
+#endif
+}
+
+#ifdef SD_SPLICE
+/* the file can not be spliced to, empty the pipe through data_buffer and
+ * use the buffer from now on */
+static int data_splice_fallback(struct sd_data_transfer_info *dti)
+{
+  ssize_t bread;
+
+  while (dti->data_splice_len > 0)
   {
-    data_transfer_set_io(dti);
+    bread = read(dti->data_splice_pipe[0], dti->data_buffer,
+        dti->data_splice_len < dti->data_window_len ?
+        dti->data_splice_len : dti->data_window_len);
+    if (bread <= 0) {
+      ui_sys_err(errno, "read");
+      data_con_close(dti);
+      return -1;
+    }
+
+    if (file_pwrite(&dti->file, dti->data_buffer, (int) bread,
+          dti->file.position) == -1) {
+      ui_sys_err(errno, "pwrite");
+      data_con_close(dti);
+      return -1;
+    }
+
+    dti->file.position += bread;
+    dti->io_total_bytes_current += bread;
+    dti->data_splice_len -= bread;
+  }
+
+  data_splice_deinit(dti);
+  data_write_behind_init(dti);
+
+  return 0;
+}
+
+/* move what is in the pipe to the file at the position */
+static int data_splice_flush(struct sd_data_transfer_info *dti)
+{
+  loff_t off;
+  ssize_t bwrite;
+
+  while (dti->data_splice_len > 0)
+  {
+    off = (loff_t) dti->file.position;
+    bwrite = splice(dti->data_splice_pipe[0], NULL, dti->file.fd,
+        &off, dti->data_splice_len, SPLICE_F_MOVE);
+
+    if (bwrite == -1 && errno == EINTR)
+      continue;
+
+    /* the file system does not support it */
+    if (bwrite == -1 && errno == EINVAL)
+      return data_splice_fallback(dti);
+
+    if (bwrite <= 0) {
+      ui_sys_err(bwrite ? errno : EIO, "splice");
+      data_con_close(dti);
+      return -1;
+    }
+
+    dti->file.position += bwrite;
+    dti->io_total_bytes_current += bwrite;
+    dti->data_splice_len -= bwrite;
+  }
+
+  return 0;
+}
+
+/* the data goes from the socket to a pipe and from the pipe to the file
+ * without passing through data_buffer */
+static int handle_data_splice(struct sd_data_transfer_info *dti)
+{
+  uint64_t brem;
+  size_t len;
+  ssize_t recvb;
+
+  /* what was taken before a pause still goes to the file */
+  if (data_splice_flush(dti) == -1)
+    return -1;
+
+  /* finished writing recieved bytes */
+  if (dti->io_total_bytes_current >= dti->file.size) {
+    data_transfer_set_completed(dti);
     return 0;
   }
 
-  /* select multiplexing */
+  /* fell back to the buffer or paused */
+  if (!dti->data_splice ||
+      dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_PAUSED)
+    return 0;
 
-#if 0
-  read_fd_set = *m;
-  if (select(mfd + 1, &read_fd_set, NULL, NULL, &dti->data_con.read_timeout) == -1)
+  brem = dti->file.size - dti->io_total_bytes_current;
+  len = brem < DATA_SPLICE_PIPE_LEN ? (size_t) brem : DATA_SPLICE_PIPE_LEN;
+
+  recvb = splice(dti->data_con.sock_fd, NULL, dti->data_splice_pipe[1], NULL,
+      len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  /* peer closed connection */
+  if (recvb == 0) {
+    data_con_close(dti);
+    return 0;
+  }
+
+  if (recvb == -1)
   {
-    if (errno == EINTR) {
-      perror("select()");
+    /* resource unavaliable */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
+
+    /* the socket does not support it, the pipe is empty */
+    if (errno == EINVAL) {
+      data_splice_deinit(dti);
+      data_write_behind_init(dti);
       return 0;
     }
-    else {
-      DEBUG_SYS_ERROR_EXIT(errno, "select");
-    }
+
+    ui_sys_err(errno, "splice");
+    data_con_close(dti);
     return -1;
   }
-#endif
 
-  /* non-blocking */
-#ifdef WIN32
-      // If iMode != 0, non-blocking mode is enabled.
-      u_long iMode = 1;
-      ioctlsocket(dti->data_con.sock_fd, FIONBIO, &iMode);
-#else
-      fcntl(dti->data_con.sock_fd, F_SETFL, O_NONBLOCK);
+  dti->data_splice_len = (int) recvb;
+  if (data_splice_flush(dti) == -1)
+    return -1;
+
+  if (dti->io_total_bytes_current >= dti->file.size)
+    data_transfer_set_completed(dti);
+
+  return 0;
+}
 #endif
 
-#if 0 
-  /* we have something */
-  if (FD_ISSET(dti->data_con.sock_fd, &read_fd_set))
+static struct sd_write_behind_account write_behind_account;
+
+/* len bytes of queued buffers were written or dropped, the transfers
+ * waiting on the limit are resumed by the core once under it */
+static void data_write_behind_account_put(uint64_t len)
+{
+  struct sd_write_behind_account *wa = &write_behind_account;
+  int resume;
+
+  sd_cs_lock(&wa->mutex.cs_mutex);
+  wa->pending -= len;
+  resume = wa->waiting && wa->pending <= wa->limit;
+  sd_cs_unlock(&wa->mutex.cs_mutex);
+
+  if (resume) {
+    completion_post(&wa->resume, PROC_STATE_COMPLETE);
+    core_wake();
+  }
+}
+
+static void data_write_behind_free(struct sd_write_behind *wb)
+{
+  struct sd_write_chunk *c;
+
+  while ((c = wb->head) != NULL)
+  {
+    wb->head = c->next;
+    data_write_behind_account_put(c->len);
+    buffer_pool_put(c->buffer, c->len);
+    SAFE_FREE(c);
+  }
+
+  file_close(&wb->file);
+  SAFE_FREE(wb);
+}
+
+/* io pool thread, writes the queue in order until it is empty */
+static void *data_write_behind_job_func(void *v)
+{
+  struct sd_write_behind *wb = (struct sd_write_behind *)v;
+  struct sd_data_transfer_info *dti;
+  struct sd_write_chunk *c;
+  int err;
+
+  sd_cs_lock(&wb->worker->mutex.cs_mutex);
+
+  while ((c = wb->head) != NULL && wb->dti && !wb->err)
+  {
+    /* only added to at the tail while this is written */
+    sd_cs_unlock(&wb->worker->mutex.cs_mutex);
+    err = file_pwrite(&wb->file, c->buffer, c->filled, c->pos) == -1 ?
+      errno : 0;
+    sd_cs_lock(&wb->worker->mutex.cs_mutex);
+
+    wb->head = c->next;
+    if (!wb->head)
+      wb->tail = NULL;
+    wb->err = err;
+    data_write_behind_account_put(c->len);
+    buffer_pool_put(c->buffer, c->len);
+    SAFE_FREE(c);
+  }
+
+  wb->writing = 0;
+
+  /* the transfer is gone, nobody waits for the data */
+  if ((dti = wb->dti) == NULL) {
+    sd_cs_unlock(&wb->worker->mutex.cs_mutex);
+    data_write_behind_free(wb);
+    return NULL;
+  }
+
+  /* the core completes or closes the transfer */
+  if (wb->err || (!wb->head &&
+        dti->io_total_bytes_current >= dti->file.size))
+    completion_post(&dti->written, PROC_STATE_COMPLETE);
+
+  sd_cs_unlock(&wb->worker->mutex.cs_mutex);
+
+  return NULL;
+}
+
+static int data_write_behind_resume_iter(void *value, int index)
+{
+  struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *) value;
+  struct sd_write_behind *wb = dti->write_behind;
+
+  if (wb && wb->waiting)
   {
+    wb->waiting = 0;
+    write_behind_account.waiting--;
+    event_handler_mod(&dti->data_con.ev, data_transfer_get_events(dti));
+  }
+
+  return 0;
+}
+
+static int data_write_behind_resume_peer_iter(void *value, int index)
+{
+  linked_list_iterate(&((struct sd_peer_info *) value)->data_transfers,
+      &data_write_behind_resume_iter);
+  return 0;
+}
+
+/* on the core, with all the locks, the writers caught up */
+static void data_write_behind_resume_cb(void *v)
+{
+  struct sd_write_behind_account *wa = &write_behind_account;
+
+  sd_cs_lock(&wa->mutex.cs_mutex);
+
+  /* filled up again since, the next write posts it again */
+  if (wa->pending <= wa->limit)
+    linked_list_iterate(&gbls->net->peers, &data_write_behind_resume_peer_iter);
+
+  sd_cs_unlock(&wa->mutex.cs_mutex);
+}
+
+void data_write_behind_account_init(void)
+{
+  struct sd_write_behind_account *wa = &write_behind_account;
+
+  sd_thread_init(&wa->mutex.cs_mutex);
+  wa->pending = 0;
+  wa->limit = (uint64_t) gbls->conf->data_write_behind * 1024;
+  wa->waiting = 0;
+  completion_init(&wa->resume, &data_write_behind_resume_cb, NULL);
+}
+
+void data_write_behind_account_deinit(void)
+{
+  sd_thread_deinit(&write_behind_account.mutex.cs_mutex);
+}
+
+/* on the core, with all the locks */
+static void data_write_behind_done_cb(void *v)
+{
+  struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *) v;
+  struct sd_write_behind *wb = dti->write_behind;
+
+  if (!wb || dti->state != DATA_TRANSFER_STATE_TRANSFERING)
+    return;
+
+  /* error occured, abort */
+  if (wb->err) {
+    ui_sys_err(wb->err, "pwrite");
+    data_con_close(dti);
+    return;
+  }
+
+  /* finished writing recieved bytes */
+  if (!wb->head && dti->io_total_bytes_current >= dti->file.size)
+    data_transfer_set_completed(dti);
+}
+
+void data_write_behind_init(struct sd_data_transfer_info *dti)
+{
+  struct sd_write_behind *wb;
+
+  dti->write_behind = NULL;
+
+  /* splice() leaves nothing to write, frames are written as they come */
+  if (gbls->conf->data_write_behind <= 0 ||
+      dti->direction != DATA_TRANSFER_DIRECTION_INCOMING ||
+      dti->data_splice || dti->stream.group ||
+      dti->io_total_bytes_current >= dti->file.size)
+    return;
+
+  SAFE_CALLOC(wb, 1, sizeof(struct sd_write_behind));
+
+  /* data_buffer is written in place */
+  if (file_dup(&wb->file, &dti->file) == -1) {
+    SAFE_FREE(wb);
+    return;
+  }
+
+  wb->worker = &gbls->core->workers[dti->parent_peer->worker];
+  wb->dti = dti;
+  dti->data_buffer_window_size = 0;
+  completion_init(&dti->written, &data_write_behind_done_cb, (void *)dti);
+  dti->write_behind = wb;
+}
+
+void data_write_behind_deinit(struct sd_data_transfer_info *dti)
+{
+  struct sd_write_behind *wb = dti->write_behind;
+
+  if (!wb)
+    return;
+  dti->write_behind = NULL;
+  dti->data_buffer_window_size = 0;
+
+  /* no longer waits to be resumed */
+  if (wb->waiting) {
+    sd_cs_lock(&write_behind_account.mutex.cs_mutex);
+    write_behind_account.waiting--;
+    sd_cs_unlock(&write_behind_account.mutex.cs_mutex);
+  }
+
+  /* the job frees it, unless the pool was stopped with the write queued */
+  if (wb->writing && gbls->io_pool->running) {
+    wb->dti = NULL;
+    return;
+  }
+
+  data_write_behind_free(wb);
+}
+
+/* data_buffer is handed over once it is full, the writer is idle or the
+ * last byte is in, until then the socket is drained into its free part */
+static int data_write_behind_queue(struct sd_data_transfer_info *dti,
+    int recvb)
+{
+  struct sd_write_behind *wb = dti->write_behind;
+  struct sd_write_chunk *c;
+
+  dti->data_buffer_window_size += recvb;
+  dti->io_total_bytes_current += recvb;
+
+  /* error occured, abort */
+  if (wb->err) {
+    ui_sys_err(wb->err, "pwrite");
+    data_con_close(dti);
+    return -1;
+  }
+
+  if (wb->writing &&
+      dti->data_buffer_window_size < dti->data_window_len &&
+      dti->io_total_bytes_current < dti->file.size)
+    return 0;
+
+  SAFE_CALLOC(c, 1, sizeof(struct sd_write_chunk));
+  c->buffer = dti->data_buffer;
+  c->len = dti->data_window_len;
+  c->filled = dti->data_buffer_window_size;
+  c->pos = dti->file.position;
+
+  if (wb->tail)
+    wb->tail->next = c;
+  else
+    wb->head = c;
+  wb->tail = c;
+
+  /* the writers are too far behind, counting every transfer */
+  sd_cs_lock(&write_behind_account.mutex.cs_mutex);
+  write_behind_account.pending += c->len;
+  if (write_behind_account.pending > write_behind_account.limit &&
+      !wb->waiting) {
+    write_behind_account.waiting++;
+    wb->waiting = 1;
+  }
+  sd_cs_unlock(&write_behind_account.mutex.cs_mutex);
+
+  dti->file.position += dti->data_buffer_window_size;
+  dti->data_buffer_window_size = 0;
+  dti->data_buffer = buffer_pool_get(dti->data_window_len);
+
+  if (!wb->writing) {
+    wb->writing = 1;
+    io_pool_submit(&data_write_behind_job_func, (void *)wb);
+  }
+
+  /* there is nothing left to read, a close by the peer must not be
+   * taken for an abort */
+  if (dti->io_total_bytes_current >= dti->file.size)
+    wb->received = 1;
+
+  if (wb->waiting || wb->received)
+    event_handler_mod(&dti->data_con.ev, 0);
+
+  return 0;
+}
+
+int handle_data_recv(struct sd_data_transfer_info *dti, int len)
+{
+  int recvb;
+
+#ifdef SD_SPLICE
+  if (dti->data_splice)
+    return handle_data_splice(dti);
 #endif
+
+  /* return if were paused */
+  if (dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_PAUSED)
+    return 0;
+
+  /* the writer is behind or everything is in, a resume does not change
+   * that */
+  if (dti->write_behind && (dti->write_behind->waiting ||
+        dti->write_behind->received)) {
+    event_handler_mod(&dti->data_con.ev, 0);
+    return 0;
+  }
+
+  /* only called when readable, the socket is non-blocking, the buffer
+   * only holds data while it is written behind */
     if (dti->data_con.enable_ssl == SD_OPTION_ON)
     {
       recvb = SSL_read(dti->data_con.ssl,
-            dti->data_buffer,
-            len);
+            dti->data_buffer + dti->data_buffer_window_size,
+            len - dti->data_buffer_window_size);
     }
     else
     {
       recvb = recv(dti->data_con.sock_fd,
-            dti->data_buffer,
-            len,
+            dti->data_buffer + dti->data_buffer_window_size,
+            len - dti->data_buffer_window_size,
             0);
     }
 
-#ifndef WIN32
-      fcntl(dti->data_con.sock_fd, F_SETFL, 0);
-#else
+#ifdef WIN32
       int recv_ret;
       recv_ret = WSAGetLastError();
-      // If iMode != 0, non-blocking mode is enabled.
-      iMode = 0;
-      ioctlsocket(dti->data_con.sock_fd, FIONBIO, &iMode);
 #endif
 
     if (recvb <= 0)
@@ -701,6 +1256,10 @@ int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int
       /* peer closed connection */
       if (recvb == 0)
       {
+        /* a stream is closed once it has nothing left to send */
+        if (dti->stream.group)
+          return data_stream_closed(dti);
+
         data_con_close(dti);
         return 0;
       }
@@ -715,7 +1274,6 @@ int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int
           if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE)
           {
             /* we must retry with same send values */
-            data_transfer_set_io(dti);
             return 0;
           }
         }
@@ -724,12 +1282,11 @@ int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int
 #ifdef WIN32
           if (recv_ret == WSAEWOULDBLOCK)
 #else
-          if (errno == EAGAIN)
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
           /* resource unavaliable */
           {
             /* we must retry with same send values */
-            data_transfer_set_io(dti);
             return 0;
           }
         }
@@ -741,38 +1298,27 @@ int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int
     }
     else
     {
-      /* write to file */
-      int bwrite, brem;
+      /* the socket is drained while the writer catches up */
+      if (dti->write_behind)
+        return data_write_behind_queue(dti, recvb);
 
-      brem = recvb;
+      /* frames go to their own offsets */
+      if (dti->stream.group)
+        return data_stream_received(dti, recvb);
+
+      /* write to file at the position, all of it or fail */
       dti->data_buffer_lower_offset = 0;
-  
-      while (brem > 0)
-      {
-        /* write */
-        bwrite = fwrite(dti->data_buffer + dti->data_buffer_lower_offset,
-                      1,
-                      brem,
-                      dti->file.file);
 
+      if (file_pwrite(&dti->file, dti->data_buffer, recvb,
+            dti->file.position) == -1) {
         /* error occured, abort */
-        if (ferror(dti->file.file)) {
-          ui_sys_err(errno, "fwrite");
-          data_con_close(dti);
-          return -1;
-        }
-
-        /* update file position */
-        file_tell(dti->file.file, &dti->file.position);
-
-        dti->io_total_bytes_current +=bwrite;
-        dti->data_buffer_lower_offset += bwrite;
-        brem -= bwrite;
-    
+        ui_sys_err(errno, "pwrite");
+        data_con_close(dti);
+        return -1;
       }
 
-      /* update progress */
-      data_transfer_set_io(dti);
+      dti->file.position += recvb;
+      dti->io_total_bytes_current += recvb;
 
 
       /* finished writing recieved bytes */
@@ -789,55 +1335,328 @@ int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int
 }
 
 
+void data_sendfile_init(struct sd_data_transfer_info *dti)
+{
+  dti->data_sendfile = SD_OPTION_OFF;
+#ifdef SD_SENDFILE
+  /* ssl records are built in user space unless the kernel has the keys */
+  if (gbls->conf->data_sendfile == SD_OPTION_ON &&
+      dti->direction == DATA_TRANSFER_DIRECTION_OUTGOING &&
+      !dti->stream.group &&
+      (dti->data_con.enable_ssl == SD_OPTION_OFF ||
+       (dti->data_con.ssl_ktls & SSL_KTLS_SEND)))
+    dti->data_sendfile = SD_OPTION_ON;
+#endif
+}
+
+#ifdef SD_SENDFILE
+/* the file goes to the socket without passing through data_buffer, the
+ * file is read from the position */
+static int handle_data_sendfile(struct sd_data_transfer_info *dti)
+{
+  uint64_t fbrem;
+  size_t len;
+  ssize_t bsent;
+  off_t off;
+  int err;
+
+  /* check if sent all the bytes */
+  if (dti->io_total_bytes_current >= dti->file.size) {
+    data_transfer_set_completed(dti);
+    return 0;
+  }
+
+  /* paused */
+  if (dti->transfer_state != DATA_TRANSFER_TRANSFER_STATE_RESUMED)
+    return 0;
+
+  fbrem = dti->file.size - dti->file.position;
+  len = fbrem < DATA_SENDFILE_CHUNK_LEN ? (size_t) fbrem : DATA_SENDFILE_CHUNK_LEN;
+  off = (off_t) dti->file.position;
+
+#ifdef SD_KTLS
+  /* the kernel builds the ssl records */
+  if (dti->data_con.enable_ssl)
+  {
+    bsent = SSL_sendfile(dti->data_con.ssl, dti->file.fd, off, len, 0);
+    if (bsent < 0)
+    {
+      switch (SSL_get_error(dti->data_con.ssl, (int) bsent))
+      {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+          /* resource unavaliable */
+          return 0;
+      }
+
+      ui_ssl_err("SSL_sendfile");
+      data_con_close(dti);
+      return -1;
+    }
+    err = 0;
+  }
+  else
+#endif
+  {
+#ifdef __linux__
+    bsent = sendfile(dti->data_con.sock_fd, dti->file.fd, &off, len);
+    err = bsent == -1 ? errno : 0;
+#else
+    off_t sbytes = 0;
+
+    /* some bytes may have gone even when it fails with EAGAIN */
+    err = sendfile(dti->file.fd, dti->data_con.sock_fd, off, len,
+        NULL, &sbytes, 0) == -1 ? errno : 0;
+    bsent = (ssize_t) sbytes;
+#endif
+  }
+
+  if (bsent > 0)
+  {
+    dti->file.position += bsent;
+    dti->io_total_bytes_current += bsent;
+  }
+
+  if (err)
+  {
+    /* resource unavaliable */
+    if (err == EAGAIN || err == EWOULDBLOCK || err == EBUSY)
+      return 0;
+
+    /* the file or socket does not support it, use the buffer */
+    if ((err == EINVAL || err == ENOSYS || err == EOPNOTSUPP) && bsent <= 0)
+    {
+      dti->data_sendfile = SD_OPTION_OFF;
+      data_read_ahead_init(dti);
+      return 0;
+    }
+
+    ui_sys_err(err, "sendfile");
+    data_con_close(dti);
+    return -1;
+  }
+
+  /* premature EOF, abort */
+  if (bsent == 0)
+  {
+    ui_sd_err("File is shorter than its size.");
+    data_con_close(dti);
+    return -1;
+  }
+
+  return 0;
+}
+#endif
+
+static void data_read_ahead_free(struct sd_read_ahead *ra)
+{
+  buffer_pool_put(ra->buffer, ra->len);
+  file_close(&ra->file);
+  SAFE_FREE(ra);
+}
+
+/* io pool thread, the read may wait on the disk */
+static void *data_read_ahead_job_func(void *v)
+{
+  struct sd_read_ahead *ra = (struct sd_read_ahead *)v;
+  struct sd_data_transfer_info *dti;
+  int bread, filled, err;
+
+  err = 0;
+  for (filled = 0; filled < ra->want; filled += bread)
+  {
+    bread = file_pread(&ra->file, ra->buffer + filled, ra->want - filled,
+        ra->pos + filled);
+    if (bread == -1)
+      err = errno;
+    if (bread <= 0)
+      break;
+  }
+
+  sd_cs_lock(&ra->worker->mutex.cs_mutex);
+
+  /* the transfer is gone, nobody waits for the data */
+  if ((dti = ra->dti) == NULL) {
+    sd_cs_unlock(&ra->worker->mutex.cs_mutex);
+    data_read_ahead_free(ra);
+    return NULL;
+  }
+
+  ra->filled = filled;
+  ra->err = err;
+  ra->state = READ_AHEAD_STATE_READY;
+
+  /* the transfer ran dry before the read was done */
+  if (ra->waiting) {
+    ra->waiting = 0;
+    event_handler_mod(&dti->data_con.ev, data_transfer_get_events(dti));
+  }
+
+  sd_cs_unlock(&ra->worker->mutex.cs_mutex);
+
+  return NULL;
+}
+
+/* with the worker lock */
+static void data_read_ahead_submit(struct sd_read_ahead *ra, uint64_t pos,
+    uint64_t fbrem)
+{
+  ra->pos = pos;
+  ra->want = fbrem < (uint64_t) ra->len ? (int) fbrem : ra->len;
+  ra->filled = 0;
+  ra->err = 0;
+  ra->state = READ_AHEAD_STATE_READING;
+
+  io_pool_submit(&data_read_ahead_job_func, (void *)ra);
+}
+
+void data_read_ahead_init(struct sd_data_transfer_info *dti)
+{
+  struct sd_read_ahead *ra;
+
+  dti->read_ahead = NULL;
+
+  /* a mapping or the kernel leave nothing to read, frames are read from
+   * ranges that move */
+  if (gbls->conf->data_read_ahead != SD_OPTION_ON ||
+      dti->direction != DATA_TRANSFER_DIRECTION_OUTGOING ||
+      dti->data_sendfile || dti->file.map || dti->stream.group ||
+      dti->file.position >= dti->file.size)
+    return;
+
+  SAFE_CALLOC(ra, 1, sizeof(struct sd_read_ahead));
+
+  /* data_buffer is filled in place */
+  if (file_dup(&ra->file, &dti->file) == -1) {
+    SAFE_FREE(ra);
+    return;
+  }
+
+  ra->worker = &gbls->core->workers[dti->parent_peer->worker];
+  ra->dti = dti;
+  ra->len = dti->data_window_len;
+  ra->buffer = buffer_pool_get(ra->len);
+  dti->read_ahead = ra;
+
+  data_read_ahead_submit(ra, dti->file.position,
+      dti->file.size - dti->file.position);
+}
+
+void data_read_ahead_deinit(struct sd_data_transfer_info *dti)
+{
+  struct sd_read_ahead *ra = dti->read_ahead;
+
+  if (!ra)
+    return;
+  dti->read_ahead = NULL;
+
+  /* the job frees it, unless the io pool was stopped with the read queued */
+  if (ra->state == READ_AHEAD_STATE_READING && gbls->io_pool->running) {
+    ra->dti = NULL;
+    return;
+  }
+
+  data_read_ahead_free(ra);
+}
+
+/* the buffer read while data_buffer was sent takes its place, the next
+ * read goes to the one that was just sent */
+static int data_read_ahead_take(struct sd_data_transfer_info *dti)
+{
+  struct sd_read_ahead *ra = dti->read_ahead;
+  char *b;
+  int len;
+
+  /* nothing to send, the job asks for write events again */
+  if (ra->state == READ_AHEAD_STATE_READING) {
+    ra->waiting = 1;
+    event_handler_mod(&dti->data_con.ev, 0);
+    return 0;
+  }
+
+  /* error occured, abort */
+  if (ra->err) {
+    ui_sys_err(ra->err, "pread");
+    data_con_close(dti);
+    return -1;
+  }
+
+  /* premature EOF, abort */
+  if (ra->state != READ_AHEAD_STATE_READY || !ra->filled ||
+      ra->filled < ra->want) {
+    ui_sd_err("File is shorter than its size.");
+    data_con_close(dti);
+    return -1;
+  }
+
+  b = dti->data_buffer;
+  len = dti->data_window_len;
+  dti->data_buffer = ra->buffer;
+  dti->data_window_len = ra->len;
+  ra->buffer = b;
+  ra->len = len;
+
+  dti->data_buffer_lower_offset = 0;
+  dti->data_buffer_window_size = ra->filled;
+  dti->file.position += ra->filled;
+  ra->state = READ_AHEAD_STATE_IDLE;
+
+  if (dti->file.position < dti->file.size)
+    data_read_ahead_submit(ra, dti->file.position,
+        dti->file.size - dti->file.position);
+
+  return 0;
+}
+
 int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
 {
   int bsent;
+  char *w;
+
+#ifdef SD_SENDFILE
+  if (dti->data_sendfile)
+    return handle_data_sendfile(dti);
+#endif
 
   if (dti->data_buffer_window_size)
   {
     if (dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_RESUMED)
     {
+      /* a window in the file mapping ends at the file position */
+      if (dti->file.map) {
+        w = dti->file.map + (dti->file.position - dti->data_buffer_window_size);
+        file_map_enter(&dti->file);
+      }
+      else
+        w = b + dti->data_buffer_lower_offset;
 
-      /* non-blocking */
-
-#ifdef WIN32
-      // If iMode != 0, non-blocking mode is enabled.
-      u_long iMode = 1;
-      ioctlsocket(dti->data_con.sock_fd, FIONBIO, &iMode);
-#else
-      void *prev;
-      prev = signal(SIGPIPE, SIG_IGN);
-
-      fcntl(dti->data_con.sock_fd, F_SETFL, O_NONBLOCK);
-#endif
-      
-      /* send the data */
+      /* send the data, socket is non-blocking */
       if (dti->data_con.enable_ssl)
       {
         bsent = SSL_write(dti->data_con.ssl,
-                          b + dti->data_buffer_lower_offset,
+                          w,
                           dti->data_buffer_window_size);
       }
       else
       {
         bsent = send(dti->data_con.sock_fd,
-                     b + dti->data_buffer_lower_offset,
+                     w,
                      dti->data_buffer_window_size,
-                     0);
+                     SD_MSG_NOSIGNAL);
       }
-#ifndef WIN32
-      signal(SIGPIPE, prev);
-      
-      fcntl(dti->data_con.sock_fd, F_SETFL, 0);
-#else
+#ifdef WIN32
       int send_ret;
 
       send_ret = WSAGetLastError();
-      // If iMode != 0, non-blocking mode is enabled.
-      iMode = 0;
-      ioctlsocket(dti->data_con.sock_fd, FIONBIO, &iMode);
 #endif
 
+      if (dti->file.map && file_map_leave(&dti->file) == -1)
+      {
+        ui_sd_err("File was cut short while it was sent.");
+        data_con_close(dti);
+        return -1;
+      }
+
       /* on error */
 #if WIN32
       if (bsent <= 0)
@@ -853,7 +1672,6 @@ int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
           if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE)
           {
             /* we must retry with same send values */
-            data_transfer_set_io(dti);
             return 0;
           }
         }
@@ -862,12 +1680,11 @@ int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
 #ifdef WIN32
           if (send_ret == WSAEWOULDBLOCK)
 #else
-          if (errno == EAGAIN)
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
           /* resource unavaliable */
           {
             /* we must retry with same send values */
-            data_transfer_set_io(dti);
             return 0;
           }
         }
@@ -880,19 +1697,25 @@ int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
       /* remove sent bytes */
       dti->data_buffer_window_size -= bsent;
       dti->data_buffer_lower_offset += bsent;
-      dti->io_total_bytes_current += bsent;
+      if (dti->stream.group)
+        data_stream_sent(dti, bsent);
+      else
+        dti->io_total_bytes_current += bsent;
       
     }
     else {
       /* paused */
     }
-    data_transfer_set_io(dti);
   }
   else
   {
     /* reset lower offset */
     dti->data_buffer_lower_offset = 0;
 
+    /* the next frame of its range, the file is not sent in order */
+    if (dti->stream.group)
+      return data_stream_refill(dti);
+
     /* check if read all the bytes */
     if (dti->io_total_bytes_current >= dti->file.size) {
       data_transfer_set_completed(dti);
@@ -903,7 +1726,29 @@ int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
     int bsize, bread, brem;
     uint64_t fbrem;
 
-    bsize = sizeof dti->data_buffer;
+    /* nothing to copy, the window is moved over the mapping */
+    if (dti->file.map)
+    {
+      fbrem = dti->file.size - dti->file.position;
+      brem = fbrem < DATA_MMAP_WINDOW_LEN ? (int) fbrem : DATA_MMAP_WINDOW_LEN;
+
+      /* premature EOF, abort */
+      if (dti->file.position + brem > dti->file.map_len) {
+        ui_sd_err("File is shorter than its size.");
+        data_con_close(dti);
+        return -1;
+      }
+
+      dti->data_buffer_window_size = brem;
+      dti->file.position += brem;
+      return 0;
+    }
+
+    /* the next buffer was read while this one was sent */
+    if (dti->read_ahead)
+      return data_read_ahead_take(dti);
+
+    bsize = len;
     brem = bsize;
 
     fbrem = dti->file.size - dti->file.position;
@@ -915,34 +1760,29 @@ int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
 
     while (brem > 0)
     {
-      /* read */
-      bread = fread(dti->data_buffer + dti->data_buffer_window_size,
-                    1,
-                    brem,
-                    dti->file.file);
-
-      /* update file position */
-      file_tell(dti->file.file, &dti->file.position);
-
-
-      dti->data_buffer_window_size += bread;
-      brem -= bread;
-
+      /* read at the position */
+      bread = file_pread(&dti->file,
+                         dti->data_buffer + dti->data_buffer_window_size,
+                         brem,
+                         dti->file.position);
 
       /* error occured, abort */
-      if (ferror(dti->file.file)) {
-        ui_sys_err(errno, "fread");
+      if (bread == -1) {
+        ui_sys_err(errno, "pread");
         data_con_close(dti);
         return -1;
       }
 
       /* premature EOF, abort */
-      if (feof(dti->file.file) && (brem > 0)) {
-        ui_sys_err(errno, "fread");
+      if (bread == 0) {
+        ui_sd_err("File is shorter than its size.");
         data_con_close(dti);
         return -1;
       }
 
+      dti->file.position += bread;
+      dti->data_buffer_window_size += bread;
+      brem -= bread;
     }
 
   }
@@ -954,5 +1794,76 @@ int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len)
 }
 
 
+static void data_window_resize(struct sd_data_transfer_info *dti)
+{
+  buffer_pool_put(dti->data_buffer, dti->data_window_len);
+  dti->data_window_len = dti->data_window_want;
+  dti->data_buffer = buffer_pool_get(dti->data_window_len);
+
+  /* let the kernel keep as much in flight */
+  socket_buffer_raise(dti->data_con.sock_fd,
+      dti->direction == DATA_TRANSFER_DIRECTION_OUTGOING ? SO_SNDBUF : SO_RCVBUF,
+      dti->data_window_len);
+}
+
+void data_con_event_cb(void *v, int events)
+{
+  struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *) v;
+  uint64_t prev;
+  int n;
+
+  /* setting up is done on event loop 0, away from the peer's worker */
+  if (dti->data_con.state == CON_STATE_CONNECTING)
+  {
+    core_lock_peer(dti->parent_peer);
+    con_connect_event(&dti->data_con, events);
+    core_unlock_peer(dti->parent_peer);
+    return;
+  }
+  if (dti->data_con.state == CON_STATE_SSL_VERIFY)
+  {
+    core_lock_peer(dti->parent_peer);
+    con_ssl_handshake(&dti->data_con);
+    core_unlock_peer(dti->parent_peer);
+    return;
+  }
+
+  /* keep going until the socket would block, with a limit so
+   * other sockets get a turn */
+  for (n = 0; ; n++)
+  {
+    if (n >= DATA_EVENT_IO_LIMIT && !(dti->data_con.enable_ssl &&
+          SSL_pending(dti->data_con.ssl) > 0))
+      break;
+
+    prev = dti->io_total_bytes_current;
+
+    /* a new size is taken while nothing is waiting in the buffer */
+    if (dti->data_window_want != dti->data_window_len &&
+        !dti->data_buffer_window_size)
+      data_window_resize(dti);
+
+    switch (dti->direction)
+    {
+      case DATA_TRANSFER_DIRECTION_OUTGOING:
+        /* refill the buffer then send straight away */
+        if (!dti->data_buffer_window_size)
+          handle_data_send(dti, dti->data_buffer, dti->data_window_len);
+        if (dti->state == DATA_TRANSFER_STATE_TRANSFERING &&
+            dti->data_buffer_window_size)
+          handle_data_send(dti, dti->data_buffer, dti->data_window_len);
+        break;
+      case DATA_TRANSFER_DIRECTION_INCOMING:
+        handle_data_recv(dti, dti->data_window_len);
+        break;
+    }
+
+    if (dti->state != DATA_TRANSFER_STATE_TRANSFERING ||
+        dti->transfer_state != DATA_TRANSFER_TRANSFER_STATE_RESUMED ||
+        dti->io_total_bytes_current == prev)
+      break;
+  }
+}
+
 
 // vim:ts=2:expandtab
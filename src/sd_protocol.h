@@ -11,6 +11,86 @@
 
 #define SEND_BUFFER_LEN                  10240
 
+#define DATA_EVENT_IO_LIMIT                 16 /* reads/writes per event */
+
+/* the kernel copies plain outgoing data from the file to the socket */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define SD_SENDFILE
+#endif
+#define DATA_SENDFILE_CHUNK_LEN        1048576 /* 1 MB per call */
+
+/* plain incoming data goes from the socket to the file through a pipe */
+#ifdef __linux__
+#define SD_SPLICE
+#endif
+#define DATA_SPLICE_PIPE_LEN           1048576 /* asked for, may get less */
+
+#define DATA_MMAP_WINDOW_LEN           1048576 /* sent from a mapped file per call */
+
+/* partial declerations */
+struct sd_core_worker;
+
+/*! \brief The next buffer of an outgoing transfer, filled on the io pool
+ *         while the current one is sent */
+struct sd_read_ahead
+{
+  struct sd_core_worker *worker; /* of the peer, held to hand the buffer over */
+  struct sd_data_transfer_info *dti; /* NULL once the transfer let go */
+  struct file_info file; /* own descriptor, the transfer may close its own */
+
+  char *buffer; /* from the buffer pool */
+  int len; /* size of buffer */
+  uint64_t pos; /* file offset the buffer is read from */
+  int want; /* bytes to read, less than len at the end of the file */
+  int filled;
+  int err;
+
+  char state;
+#define READ_AHEAD_STATE_IDLE              0
+#define READ_AHEAD_STATE_READING           1
+#define READ_AHEAD_STATE_READY             2
+  char waiting; /* write interest dropped until the read is done */
+};
+
+/*! \brief A received buffer waiting to be written */
+struct sd_write_chunk
+{
+  struct sd_write_chunk *next;
+  char *buffer; /* from the buffer pool */
+  int len; /* size of buffer */
+  int filled;
+  uint64_t pos; /* file offset of the first byte */
+};
+
+/*! \brief Received data of an incoming transfer, written on the io pool
+ *         while the socket is drained into fresh buffers */
+struct sd_write_behind
+{
+  struct sd_core_worker *worker; /* of the peer, held to change the queue */
+  struct sd_data_transfer_info *dti; /* NULL once the transfer let go */
+  struct file_info file; /* own descriptor, the transfer may close its own */
+
+  struct sd_write_chunk *head; /* oldest first, head is being written */
+  struct sd_write_chunk *tail;
+  int err;
+
+  char writing; /* a job is emptying the queue */
+  char waiting; /* read interest dropped until all the queues are below
+                   the limit, the core reads the socket again */
+  char received; /* everything is in, the socket is not read again */
+};
+
+/*! \brief What the transfers have queued for the io pool to write, the
+ *         pool is shared so the limit is for all of them */
+struct sd_write_behind_account
+{
+  struct sd_mutex_state_info mutex;
+  uint64_t pending; /* size of the queued buffers */
+  uint64_t limit; /* sockets are not read above it */
+  int waiting; /* transfers that stopped reading for the limit */
+  struct sd_completion resume; /* has the core read their sockets again */
+};
+
 #define SD_PROTOCOL_ARGUMENT_DELIM         " "
 
 #define SD_MAX_PROTOCOL_CONST_VALUE_LEN    128
@@ -28,6 +108,15 @@
 
 #define SD_PROTOCOL_VALUE_NULL          "NULL"
 
+/* sent after the version for what goes beyond the 0.9.1 protocol, older
+ * peers read the version alone and get none of it */
+#define SD_MAX_PROTOCOL_CAPS_LEN            64
+#define SD_PROTOCOL_CAPS_DELIM             ","
+#define SD_PROTOCOL_CAP_STREAMS      "STREAMS" /* longer FILE-SUGGEST, frames */
+#define SD_PROTOCOL_CAP_CHECKSUM    "CHECKSUM" /* frame CRC32C, FILE-RESEND/-CHECKED */
+#define SD_PROTOCOL_CAPS        SD_PROTOCOL_CAP_STREAMS SD_PROTOCOL_CAPS_DELIM \
+                                SD_PROTOCOL_CAP_CHECKSUM
+
 /* partial declearations */
 struct sd_protocol_command_info;
 
@@ -41,26 +130,34 @@ extern int string_url_decode(char *dst, const char *str, int nbytes);
 extern void init_protocol_command_entry(struct sd_peer_info *pi,
     struct sd_protocol_command_info *pci, ...);
 
-/*! \brief Build a command string */
-extern int command_pack(const char *name, char *b, int nbytes, va_list args);
+/*! \brief Build a command string with its first nargs args (0 for all) */
+extern int command_pack(const char *name, int nargs, char *b, int nbytes,
+    va_list args);
 
 /*! \brief Send command to remote peer */
 extern int send_protocol_command(struct sd_peer_info *pi, const char *name, ...);
 
+/*! \brief Send command with its first nargs args, for an older peer */
+extern int send_protocol_command_nargs(struct sd_peer_info *pi,
+    const char *name, int nargs, ...);
+
 /*! \brief Unpack the command and pass it to unpack callback for specific command */
 extern int process_protocol_command(struct sd_peer_info *pi, const char *msg);
 
 /*! \brief Recieve data from control connection and process if valid */
-extern int handle_ctl_recv(struct sd_peer_info *pi, fd_set *m, int mfd, int len);
+extern int handle_ctl_recv(struct sd_peer_info *pi, int len);
 
-/*! \brief Send a message over the control connection */
+/*! \brief Queue a message and send as much as the control connection takes */
 extern int handle_ctl_send(struct sd_peer_info *pi, char *b, int len);
 
+/*! \brief Send queued messages until the control connection would block */
+extern int handle_ctl_send_flush(struct sd_peer_info *pi);
+
 /*! \brief Check if we have the end of the message and format message appropriatly */
 extern int get_end_of_message(char *b);
 
-/*! \brief Iterate function to recieve data over control connection in idle */
-extern int ctl_recv_iter_cb(void *v, int index);
+/*! \brief Event callback to recieve data over control connection */
+extern void ctl_con_event_cb(void *v, int events);
 
 /*! \brief Close and cleanup control connection */
 extern void ctl_con_close(struct sd_peer_info *pi);
@@ -74,12 +171,53 @@ extern int ctl_process_cmd_entry_iter_cb(void *v, int index);
 
 /* -[ data connection specific ] -------------------------------------- */
 
+/*! \brief Close and cleanup data connection then abort the transfer */
+extern void data_con_close(struct sd_data_transfer_info *dti);
+
+/*! \brief Decide if the data of a transfer whose file was just opened can
+ *         go out with sendfile() */
+extern void data_sendfile_init(struct sd_data_transfer_info *dti);
+
+/*! \brief Decide if the data of a transfer whose file was just opened can
+ *         come in with splice(), opens its pipe */
+extern void data_splice_init(struct sd_data_transfer_info *dti);
+
+/*! \brief Close the splice() pipe of a transfer */
+extern void data_splice_deinit(struct sd_data_transfer_info *dti);
+
+/*! \brief Decide if the file of an outgoing transfer that is sent from
+ *         data_buffer is read ahead, starts the first read */
+extern void data_read_ahead_init(struct sd_data_transfer_info *dti);
+
+/*! \brief Return the second buffer, a read still running finishes on its own */
+extern void data_read_ahead_deinit(struct sd_data_transfer_info *dti);
+
+/*! \brief Set up the limit of what all transfers queue to be written */
+extern void data_write_behind_account_init(void);
+
+/*! \brief Cleanup the write behind limit */
+extern void data_write_behind_account_deinit(void);
+
+/*! \brief Decide if the file of an incoming transfer that is received in
+ *         data_buffer is written behind */
+extern void data_write_behind_init(struct sd_data_transfer_info *dti);
+
+/*! \brief Drop what is not written yet, a write still running finishes on
+ *         its own */
+extern void data_write_behind_deinit(struct sd_data_transfer_info *dti);
+
+/*! \brief Close data connection and mark the transfer completed */
+extern void data_transfer_set_completed(struct sd_data_transfer_info *dti);
+
 /*! \brief Handle network socket and file input for data transfer */
-extern int handle_data_recv(struct sd_data_transfer_info *dti, fd_set *m, int mfd, int len);
+extern int handle_data_recv(struct sd_data_transfer_info *dti, int len);
 
 /*! \brief Handle network socket and file output for data transfer */
 extern int handle_data_send(struct sd_data_transfer_info *dti, char *b, int len);
 
+/*! \brief Event callback to move data for a transfer */
+extern void data_con_event_cb(void *v, int events);
+
 
 #endif
 
@@ -38,6 +38,7 @@
 #include "sd_dynamic_memory.h"
 #include "sd_version.h"
 #include "sd_protocol_commands.h"
+#include "sd_stream.h"
 
 /* 
  * structure:
@@ -52,10 +53,13 @@
 struct sd_protocol_command_info control_command[] = {
   { "VERSION",
     /* args:
-     *   version_string */
-    "%"SD_TOSTRING(SD_MAX_PROTOCOL_VERSION_LEN)"s",
-    "%."SD_TOSTRING(SD_MAX_PROTOCOL_VERSION_LEN)"s",
-    1,
+     *   version_string
+     *   capabilities (not sent by 0.9.1 and older) */
+    "%"SD_TOSTRING(SD_MAX_PROTOCOL_VERSION_LEN)"s "
+    "%"SD_TOSTRING(SD_MAX_PROTOCOL_CAPS_LEN)"s",
+    "%."SD_TOSTRING(SD_MAX_PROTOCOL_VERSION_LEN)"s "
+    "%."SD_TOSTRING(SD_MAX_PROTOCOL_CAPS_LEN)"s",
+    2,
     &version_command_unpack_cb,
     &version_command_process_cb },
 
@@ -78,6 +82,9 @@ struct sd_protocol_command_info control_command[] = {
      *   data_connection_method
      *   net_address
      *   port
+     *   streams
+     *   group (id of the first stream, 0 for the first)
+     *   checksum (frames carry a CRC32C)
      */
     "%"PRIu64" "
     "%"SD_TOSTRING(SD_MAX_FILENAME_LEN)"s "
@@ -86,7 +93,10 @@ struct sd_protocol_command_info control_command[] = {
     "%"SD_TOSTRING(SD_MAX_PROTOCOL_CONST_VALUE_LEN)"s "
     "%"SD_TOSTRING(SD_MAX_PROTOCOL_CONST_VALUE_LEN)"s "
     "%"SD_TOSTRING(LOOKUP_SERVICE_LEN)"s "
-    "%"SD_TOSTRING(LOOKUP_SERVICE_LEN)"s",
+    "%"SD_TOSTRING(LOOKUP_SERVICE_LEN)"s "
+    "%d "
+    "%"PRIu64" "
+    "%d",
 
     "%"PRIu64" "
     "%."SD_TOSTRING(SD_MAX_FILENAME_LEN)"s "
@@ -95,9 +105,12 @@ struct sd_protocol_command_info control_command[] = {
     "%."SD_TOSTRING(SD_MAX_PROTOCOL_CONST_VALUE_LEN)"s "
     "%."SD_TOSTRING(SD_MAX_PROTOCOL_CONST_VALUE_LEN)"s "
     "%."SD_TOSTRING(LOOKUP_SERVICE_LEN)"s "
-    "%."SD_TOSTRING(LOOKUP_SERVICE_LEN)"s",
+    "%."SD_TOSTRING(LOOKUP_SERVICE_LEN)"s "
+    "%d "
+    "%"PRIu64" "
+    "%d",
 
-    8,
+    11,
     &file_suggest_command_unpack_cb,
     &file_suggest_command_process_cb },
 
@@ -138,6 +151,36 @@ struct sd_protocol_command_info control_command[] = {
     2,
     &file_prepared_command_unpack_cb,
     &file_prepared_command_process_cb },
+
+  { "FILE-RESEND",
+    /* args:
+     *   file id (of any stream)
+     *   offset
+     *   length
+     *   */
+    "%"PRIu64" "
+    "%"PRIu64" "
+    "%"PRIu64"",
+
+    "%"PRIu64" "
+    "%"PRIu64" "
+    "%"PRIu64"",
+
+    3,
+    &file_resend_command_unpack_cb,
+    &file_resend_command_process_cb },
+
+  { "FILE-CHECKED",
+    /* args:
+     *   file id (of any stream)
+     *   */
+    "%"PRIu64"",
+
+    "%"PRIu64"",
+
+    1,
+    &file_checked_command_unpack_cb,
+    &file_checked_command_process_cb },
 };
 
 int get_control_command_qty()
@@ -171,13 +214,24 @@ void template_command_process_cb(struct sd_peer_info *pi, linked_list *args)
 int version_command_unpack_cb(struct sd_peer_info *pi,
     struct sd_protocol_command_info *pci, const char *args)
 {
-  char vstr[SD_MAX_PROTOCOL_VERSION_LEN], *nstr;
-  if (sscanf(args, pci->unpack_arg_fmt, vstr) != pci->nargs)
+  char vstr[SD_MAX_PROTOCOL_VERSION_LEN + 1], *nstr;
+  char cstr[SD_MAX_PROTOCOL_CAPS_LEN + 1], *ncstr;
+  int n;
+
+  n = sscanf(args, pci->unpack_arg_fmt, vstr, cstr);
+
+  /* older peers send the version alone */
+  if (n == pci->nargs - 1)
+    cstr[0] = '\0';
+  else if (n != pci->nargs)
     return -1;
-  SAFE_CALLOC(nstr, 1, SD_MAX_PROTOCOL_VERSION_LEN);
-  strncpy(nstr, vstr, SD_MAX_PROTOCOL_VERSION_LEN);
+
+  SAFE_CALLOC(nstr, 1, sizeof vstr);
+  memcpy(nstr, vstr, sizeof vstr);
+  SAFE_CALLOC(ncstr, 1, sizeof cstr);
+  memcpy(ncstr, cstr, sizeof cstr);
   
-  init_protocol_command_entry(pi, pci, nstr);
+  init_protocol_command_entry(pi, pci, nstr, ncstr);
   return 0;
 }
 
@@ -190,7 +244,7 @@ void con_send_protocol_version(struct sd_con_info *ci)
   if (!pi)
     ON_ERROR_EXIT("Could not find peer.\n");
 
-  send_protocol_command(pi, "VERSION", SD_VERSION);
+  send_protocol_command(pi, "VERSION", SD_VERSION, SD_PROTOCOL_CAPS);
 }
 
 void version_command_process_cb(struct sd_peer_info *pi, linked_list *args)
@@ -207,6 +261,18 @@ void version_command_process_cb(struct sd_peer_info *pi, linked_list *args)
   snprintf(pi->peer_protocol_version, sizeof pi->peer_protocol_version,
       "%s", (char *)(a[0]));
 
+  /* only what the peer names is used with it */
+  char *cap;
+  pi->peer_caps = 0;
+  for (cap = strtok((char *)(a[1]), SD_PROTOCOL_CAPS_DELIM); cap != NULL;
+      cap = strtok(NULL, SD_PROTOCOL_CAPS_DELIM))
+  {
+    if (!strcmp(cap, SD_PROTOCOL_CAP_STREAMS))
+      pi->peer_caps |= PEER_CAP_STREAMS;
+    else if (!strcmp(cap, SD_PROTOCOL_CAP_CHECKSUM))
+      pi->peer_caps |= PEER_CAP_CHECKSUM;
+  }
+
   SAFE_FREE(a);
 
   /* get peer info */
@@ -229,6 +295,7 @@ void version_command_process_cb(struct sd_peer_info *pi, linked_list *args)
   }
 
   pi->ctl_con_verified = SD_OPTION_ON;
+  timer_del(&pi->verify_timer);
 }
 /* -------------------- version command end ------------------------ */
 
@@ -276,37 +343,58 @@ void talk_command_process_cb(struct sd_peer_info *pi, linked_list *args)
 int file_suggest_command_unpack_cb(struct sd_peer_info *pi,
     struct sd_protocol_command_info *pci, const char *args)
 {
-  char fn_str[SD_MAX_FILENAME_LEN], *n_fn_str;
-  char mt_str[SD_MAX_MODIFICATION_TIME_LEN], *n_mt_str;
-  char na_str[LOOKUP_ADDRESS_LEN], *n_na_str;
-  char ns_str[LOOKUP_SERVICE_LEN], *n_ns_str;
-  char essl_str[SD_MAX_PROTOCOL_CONST_VALUE_LEN], *n_essl_str;
-  char cm_str[SD_MAX_PROTOCOL_CONST_VALUE_LEN], *n_cm_str;
+  char fn_str[SD_MAX_FILENAME_LEN + 1], *n_fn_str;
+  char mt_str[SD_MAX_MODIFICATION_TIME_LEN + 1], *n_mt_str;
+  char na_str[LOOKUP_ADDRESS_LEN + 1], *n_na_str;
+  char ns_str[LOOKUP_SERVICE_LEN + 1], *n_ns_str;
+  char essl_str[SD_MAX_PROTOCOL_CONST_VALUE_LEN + 1], *n_essl_str;
+  char cm_str[SD_MAX_PROTOCOL_CONST_VALUE_LEN + 1], *n_cm_str;
 
   uint64_t *id;
   uint64_t *size;
+  int *streams;
+  uint64_t *group;
+  int *checksum;
+  int n;
 
 
   /* allocate all arguments */
   SAFE_CALLOC(id, 1, sizeof(uint64_t));
   SAFE_CALLOC(size, 1, sizeof(uint64_t));
+  SAFE_CALLOC(streams, 1, sizeof(int));
+  SAFE_CALLOC(group, 1, sizeof(uint64_t));
+  SAFE_CALLOC(checksum, 1, sizeof(int));
 
-  if (sscanf(args, pci->unpack_arg_fmt,
+  n = sscanf(args, pci->unpack_arg_fmt,
       /* args */
-      id, fn_str, size, mt_str, essl_str, cm_str, na_str, ns_str
-      ) != pci->nargs)
+      id, fn_str, size, mt_str, essl_str, cm_str, na_str, ns_str,
+      streams, group, checksum
+      );
+
+  /* the form the peer said it sends, older peers send the file over a
+   * single connection */
+  if (!(pi->peer_caps & PEER_CAP_STREAMS) && n == pci->nargs - 3)
+  {
+    *streams = 1;
+    *group = 0;
+    *checksum = 0;
+  }
+  else if (!(pi->peer_caps & PEER_CAP_STREAMS) || n != pci->nargs)
   {
     SAFE_FREE(id);
     SAFE_FREE(size);
+    SAFE_FREE(streams);
+    SAFE_FREE(group);
+    SAFE_FREE(checksum);
     return -1;
   }
   
-  SAFE_CALLOC(n_fn_str, 1, SD_MAX_FILENAME_LEN);
-  SAFE_CALLOC(n_mt_str, 1, SD_MAX_MODIFICATION_TIME_LEN);
-  SAFE_CALLOC(n_na_str, 1, LOOKUP_ADDRESS_LEN);
-  SAFE_CALLOC(n_ns_str, 1, LOOKUP_SERVICE_LEN);
-  SAFE_CALLOC(n_essl_str, 1, SD_MAX_PROTOCOL_CONST_VALUE_LEN);
-  SAFE_CALLOC(n_cm_str, 1, SD_MAX_PROTOCOL_CONST_VALUE_LEN);
+  SAFE_CALLOC(n_fn_str, 1, sizeof fn_str);
+  SAFE_CALLOC(n_mt_str, 1, sizeof mt_str);
+  SAFE_CALLOC(n_na_str, 1, sizeof na_str);
+  SAFE_CALLOC(n_ns_str, 1, sizeof ns_str);
+  SAFE_CALLOC(n_essl_str, 1, sizeof essl_str);
+  SAFE_CALLOC(n_cm_str, 1, sizeof cm_str);
 
   string_url_decode(n_fn_str, fn_str, sizeof fn_str);
   string_url_decode(n_mt_str, mt_str, sizeof mt_str);
@@ -317,7 +405,8 @@ int file_suggest_command_unpack_cb(struct sd_peer_info *pi,
   
   init_protocol_command_entry(pi, pci,
       /* args */
-      id, n_fn_str, size, n_mt_str, n_essl_str, n_cm_str, n_na_str, n_ns_str
+      id, n_fn_str, size, n_mt_str, n_essl_str, n_cm_str, n_na_str, n_ns_str,
+      streams, group, checksum
       );
   return 0;
 }
@@ -364,14 +453,37 @@ int file_suggest_command_pack_and_send(struct sd_data_transfer_info *dti)
       break;
   }
 
+  /* a peer that did not say it can would take the frames for the file */
+  int nargs;
+  nargs = 0;
+  if (!(dti->parent_peer->peer_caps & PEER_CAP_STREAMS))
+  {
+    dti->streams = 1;
+    dti->checksum = SD_OPTION_OFF;
+    nargs = 8;
+  }
+
+  /* nor could it tell of or resend a range that failed the check */
+  if (!(dti->parent_peer->peer_caps & PEER_CAP_CHECKSUM))
+    dti->checksum = SD_OPTION_OFF;
+
+  /* the peer adds another stream to the transfer it has accepted */
+  uint64_t group;
+  group = 0;
+  if (dti->stream.group && dti->stream.group->leader &&
+      dti->stream.group->leader != dti)
+    group = dti->stream.group->leader->id;
+
   int ret;
   
-  if (!(ret = send_protocol_command(dti->parent_peer, "FILE-SUGGEST",
+  if (!(ret = send_protocol_command_nargs(dti->parent_peer, "FILE-SUGGEST",
+      nargs,
       /* args */
       dti->id,
       enc_f_name, dti->file.size, enc_m_time,
       e_ssl,
-      cm, enc_a, enc_s)))
+      cm, enc_a, enc_s,
+      dti->streams, group, (int) dti->checksum)))
   {
   }
 
@@ -386,6 +498,50 @@ int file_suggest_command_pack_and_send(struct sd_data_transfer_info *dti)
   return ret;
 }
 
+/* another data connection for the file of an accepted transfer, it is set
+ * up like that one was */
+static void file_suggest_stream_accept(struct sd_data_transfer_info *dti,
+    uint64_t *group)
+{
+  struct sd_data_transfer_info *leader;
+
+  leader = get_data_transfer_from_id(dti->parent_peer,
+      DATA_TRANSFER_DIRECTION_INCOMING, group);
+
+  if (!leader || leader->con_meth != dti->con_meth ||
+      leader->file.size != dti->file.size ||
+      data_stream_join(dti, leader) == -1)
+  {
+    ui_notify_printf("Recieved a stream for transfer %"PRIu64" which is not "
+        "taking one.", *group);
+    file_verdict_command_pack_and_send(dti, DATA_TRANSFER_VERDICT_DECLINDED);
+    return;
+  }
+
+  snprintf(dti->file.directory, sizeof dti->file.directory, "%s",
+      leader->file.directory);
+  snprintf(dti->file.name, sizeof dti->file.name, "%s", leader->file.name);
+
+  dti->data_con.enable_ssl = leader->data_con.enable_ssl;
+  memcpy(&dti->data_con.ssl_verify, &leader->data_con.ssl_verify,
+      sizeof dti->data_con.ssl_verify);
+  data_transfer_set_wan(dti, leader->wan_address, leader->wan_service);
+
+  switch (dti->con_meth)
+  {
+    case CON_METH_PASSIVE:
+      data_transfer_set_passive(dti, leader->using_local_address,
+          leader->data_server, leader->allow_any_port);
+      data_transfer_setup_passive_accept(dti);
+      break;
+    case CON_METH_ACTIVE:
+      data_transfer_set_active(dti,
+          leader->data_con.resolve_src_addr.lookup_address, NULL);
+      data_transfer_setup_active_resolve_source(dti);
+      break;
+  }
+}
+
 void file_suggest_command_process_cb(struct sd_peer_info *pi, linked_list *args)
 {
   int na;
@@ -432,6 +588,9 @@ void file_suggest_command_process_cb(struct sd_peer_info *pi, linked_list *args)
      *   data_connection_method
      *   net_address
      *   port
+     *   streams
+     *   group
+     *   checksum
      */
   
 
@@ -468,6 +627,13 @@ void file_suggest_command_process_cb(struct sd_peer_info *pi, linked_list *args)
       break;
   }
 
+  data_transfer_set_streams(dti, *((int *)a[8]));
+  dti->checksum = *((int *)a[10]) && (pi->peer_caps & PEER_CAP_CHECKSUM) ?
+    SD_OPTION_ON : SD_OPTION_OFF;
+
+  if (*((uint64_t *)a[9]))
+    file_suggest_stream_accept(dti, (uint64_t *)a[9]);
+
 
 file_suggest_cleanup:
   SAFE_FREE(saddr);
@@ -574,6 +740,9 @@ int file_verdict_command_pack_and_send(struct sd_data_transfer_info *dti, char v
   {
     /* finished setting up */
     //data_transfer_set_state(dti, DATA_TRANSFER_STATE_PREPARATION_PENDING);
+
+    /* the resume position is final, the other streams may join */
+    data_stream_group_init(dti);
   }
 
   SAFE_FREE(enc_a);
@@ -653,6 +822,9 @@ void file_verdict_command_process_cb(struct sd_peer_info *pi, linked_list *args)
 
           break;
       }
+
+      /* suggest the other streams of the file */
+      data_stream_group_init(dti);
       break;
     case DATA_TRANSFER_VERDICT_DECLINDED:
       data_transfer_abort(dti);
@@ -744,6 +916,7 @@ void file_prepared_command_process_cb(struct sd_peer_info *pi, linked_list *args
 
   /* set prepared */
   dti->peer_prepared = SD_OPTION_ON;
+  data_transfer_step(dti);
   
 file_prepared_cleanup:
   SAFE_FREE(saddr);
@@ -751,4 +924,130 @@ file_prepared_cleanup:
 }
 /* --------------------- file-prepared command end ------------------------ */
 
+/* --------------------- file-resend command begin ------------------------ */
+int file_resend_command_pack_and_send(struct sd_data_transfer_info *dti,
+    uint64_t pos, uint64_t len)
+{
+  if (!(dti->parent_peer->peer_caps & PEER_CAP_CHECKSUM))
+    return -1;
+
+  return send_protocol_command(dti->parent_peer, "FILE-RESEND", dti->id,
+      pos, len);
+}
+int file_resend_command_unpack_cb(struct sd_peer_info *pi,
+    struct sd_protocol_command_info *pci, const char *args)
+{
+  uint64_t *id, *pos, *len;
+
+  /* not a command the peer said it sends */
+  if (!(pi->peer_caps & PEER_CAP_CHECKSUM))
+    return -1;
+
+  SAFE_CALLOC(id, 1, sizeof(uint64_t));
+  SAFE_CALLOC(pos, 1, sizeof(uint64_t));
+  SAFE_CALLOC(len, 1, sizeof(uint64_t));
+
+  if (sscanf(args, pci->unpack_arg_fmt, id, pos, len) != pci->nargs)
+  {
+    SAFE_FREE(id);
+    SAFE_FREE(pos);
+    SAFE_FREE(len);
+    return -1;
+  }
+
+  init_protocol_command_entry(pi, pci, id, pos, len);
+  return 0;
+}
+void file_resend_command_process_cb(struct sd_peer_info *pi, linked_list *args)
+{
+  void **a;
+
+  linked_list_get_all_values(args, &a);
+
+  char *saddr;
+  saddr = get_sockaddr_storage_string(&pi->ctl_con.dst_sa);
+
+  /* check if id is valid */
+  struct sd_data_transfer_info *dti;
+  dti = get_data_transfer_from_id(pi, DATA_TRANSFER_DIRECTION_OUTGOING,
+      (uint64_t *)a[0]);
+  if (!dti)
+  {
+    ui_notify_printf("Recieved a resend message with invalid ID from %s",
+        saddr);
+    goto file_resend_cleanup;
+  }
+
+  /* the file can not be made whole without it */
+  if (data_stream_resend(dti, *((uint64_t *)a[1]), *((uint64_t *)a[2])) == -1)
+  {
+    ui_notify_printf("Recieved a resend message for a range that can not be "
+        "sent again from %s", saddr);
+    data_transfer_abort(dti);
+  }
+
+file_resend_cleanup:
+  SAFE_FREE(saddr);
+  SAFE_FREE(a);
+}
+/* --------------------- file-resend command end ------------------------ */
+
+/* --------------------- file-checked command begin ------------------------ */
+int file_checked_command_pack_and_send(struct sd_data_transfer_info *dti)
+{
+  if (!(dti->parent_peer->peer_caps & PEER_CAP_CHECKSUM))
+    return -1;
+
+  return send_protocol_command(dti->parent_peer, "FILE-CHECKED", dti->id);
+}
+int file_checked_command_unpack_cb(struct sd_peer_info *pi,
+    struct sd_protocol_command_info *pci, const char *args)
+{
+  uint64_t *id;
+
+  /* not a command the peer said it sends */
+  if (!(pi->peer_caps & PEER_CAP_CHECKSUM))
+    return -1;
+
+  SAFE_CALLOC(id, 1, sizeof(uint64_t));
+
+  if (sscanf(args, pci->unpack_arg_fmt, id) != pci->nargs)
+  {
+    SAFE_FREE(id);
+    return -1;
+  }
+
+  init_protocol_command_entry(pi, pci, id);
+  return 0;
+}
+void file_checked_command_process_cb(struct sd_peer_info *pi, linked_list *args)
+{
+  void **a;
+
+  linked_list_get_all_values(args, &a);
+
+  char *saddr;
+  saddr = get_sockaddr_storage_string(&pi->ctl_con.dst_sa);
+
+  /* check if id is valid */
+  struct sd_data_transfer_info *dti;
+  dti = get_data_transfer_from_id(pi, DATA_TRANSFER_DIRECTION_OUTGOING,
+      (uint64_t *)a[0]);
+  if (!dti)
+  {
+    ui_notify_printf("Recieved a checked message with invalid ID from %s",
+        saddr);
+    goto file_checked_cleanup;
+  }
+
+  if (data_stream_checked(dti) == -1)
+    ui_notify_printf("Recieved a checked message for a file that is not all "
+        "sent from %s", saddr);
+
+file_checked_cleanup:
+  SAFE_FREE(saddr);
+  SAFE_FREE(a);
+}
+/* --------------------- file-checked command end ------------------------ */
+
 // vim:ts=2:expandtab
@@ -60,6 +60,17 @@ extern int file_prepared_command_unpack_cb(struct sd_peer_info *pi,
     struct sd_protocol_command_info *pci, const char *args);
 extern void file_prepared_command_process_cb(struct sd_peer_info *pi, linked_list *args);
 
+extern int file_resend_command_pack_and_send(struct sd_data_transfer_info *dti,
+    uint64_t pos, uint64_t len);
+extern int file_resend_command_unpack_cb(struct sd_peer_info *pi,
+    struct sd_protocol_command_info *pci, const char *args);
+extern void file_resend_command_process_cb(struct sd_peer_info *pi, linked_list *args);
+
+extern int file_checked_command_pack_and_send(struct sd_data_transfer_info *dti);
+extern int file_checked_command_unpack_cb(struct sd_peer_info *pi,
+    struct sd_protocol_command_info *pci, const char *args);
+extern void file_checked_command_process_cb(struct sd_peer_info *pi, linked_list *args);
+
 #endif
 
 
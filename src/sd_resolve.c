@@ -0,0 +1,365 @@
+/*
+   Address resolver
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_resolve.h"
+#include "sd_globals.h"
+#include "sd_dynamic_memory.h"
+#include "sd_error.h"
+#include "sd_timing.h"
+#include "sd_thread.h"
+#include "sd_ui.h"
+#include "sd.h"
+
+/* for the linked list callbacks, used under the resolver lock */
+static struct sd_resolve_addr_info *rai_to_find;
+static struct sd_resolve_entry *entry_to_find;
+static uint64_t resolve_now;
+
+
+/* -[ results ]-------------------------------------------------------- */
+
+/* each node and its address in one block, so every user can change and
+ * free its copy on its own */
+static struct addrinfo *resolve_ai_copy(const struct addrinfo *ai)
+{
+  struct addrinfo *head, **tail, *n;
+  char *b;
+
+  head = NULL;
+  tail = &head;
+
+  for (; ai != NULL; ai = ai->ai_next)
+  {
+    SAFE_CALLOC(b, 1, sizeof(struct addrinfo) + ai->ai_addrlen);
+    n = (struct addrinfo *) b;
+    memcpy(n, ai, sizeof(struct addrinfo));
+    n->ai_canonname = NULL;
+    n->ai_addr = (struct sockaddr *) (b + sizeof(struct addrinfo));
+    memcpy(n->ai_addr, ai->ai_addr, ai->ai_addrlen);
+    n->ai_next = NULL;
+
+    *tail = n;
+    tail = &n->ai_next;
+  }
+
+  return head;
+}
+
+static void resolve_ai_free(struct addrinfo *ai)
+{
+  struct addrinfo *next;
+
+  for (; ai != NULL; ai = next)
+  {
+    next = ai->ai_next;
+    SAFE_FREE(ai);
+  }
+}
+
+
+/* -[ cache ]---------------------------------------------------------- */
+
+static int resolve_entry_match_iterate(void *value, int index)
+{
+  struct sd_resolve_entry *e = (struct sd_resolve_entry *)value;
+
+  if (e->family == rai_to_find->family &&
+      e->any_service == rai_to_find->any_service &&
+      (e->any_service ||
+       !strcmp(e->service, rai_to_find->lookup_service)) &&
+      !strcmp(e->address, rai_to_find->lookup_address))
+    return 1;
+  return 0;
+}
+
+static int resolve_entry_find_iterate(void *value, int index)
+{
+  return ((struct sd_resolve_entry *)value) == entry_to_find;
+}
+
+static int resolve_waiting_find_iterate(void *value, int index)
+{
+  return ((struct sd_resolve_addr_info *)value) == rai_to_find;
+}
+
+/* a lookup still running has waiters pointing at it */
+static int resolve_entry_expired_iterate(void *value, int index)
+{
+  struct sd_resolve_entry *e = (struct sd_resolve_entry *)value;
+
+  return e->state != RESOLVE_ENTRY_PENDING && e->expires <= resolve_now;
+}
+
+static int resolve_entry_done_iterate(void *value, int index)
+{
+  return ((struct sd_resolve_entry *)value)->state != RESOLVE_ENTRY_PENDING;
+}
+
+static void resolve_entry_free(struct sd_resolve_entry *e)
+{
+  resolve_ai_free(e->res_ai);
+  linked_list_rem_all_entries(&e->waiting, SD_OPTION_OFF);
+  SAFE_FREE(e);
+}
+
+static void resolve_entry_rem(struct sd_resolver *r, list_item *li)
+{
+  struct sd_resolve_entry *e = (struct sd_resolve_entry *)li->value;
+
+  linked_list_rem(&r->cache, li, SD_OPTION_OFF);
+  resolve_entry_free(e);
+  r->stats.entries--;
+}
+
+/* drop what has expired, then the oldest until there is room */
+static void resolve_cache_prune(struct sd_resolver *r)
+{
+  list_item *li;
+
+  resolve_now = time_get_ms();
+  while ((li = linked_list_iterate(&r->cache,
+          &resolve_entry_expired_iterate)) != NULL)
+    resolve_entry_rem(r, li);
+
+  while (r->stats.entries >= RESOLVE_CACHE_MAX &&
+      (li = linked_list_iterate(&r->cache,
+          &resolve_entry_done_iterate)) != NULL)
+    resolve_entry_rem(r, li);
+}
+
+/* hand the result to a waiter, under the resolver lock */
+static void resolve_entry_complete(struct sd_resolve_entry *e,
+    struct sd_resolve_addr_info *rai, struct sd_completion *c)
+{
+  rai->pending = NULL;
+  rai->done = NULL;
+
+  if (e->state == RESOLVE_ENTRY_DONE) {
+    rai->res_ai = resolve_ai_copy(e->res_ai);
+    completion_post(c, PROC_STATE_COMPLETE);
+  }
+  else {
+    completion_post(c, PROC_STATE_COMPLETE_WITH_ERROR);
+  }
+}
+
+/* job pool thread, getaddrinfo() blocks */
+static void *resolve_job_func(void *v)
+{
+  struct sd_resolver *r = gbls->resolver;
+  struct sd_resolve_entry *e = (struct sd_resolve_entry *)v;
+  struct sd_resolve_addr_info *rai;
+  struct addrinfo hints, *res_ai;
+  int rt;
+
+  /* the key does not change while the lookup is pending */
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = e->family;
+  hints.ai_socktype = SOCK_STREAM;
+
+  res_ai = NULL;
+  if ((rt = getaddrinfo(e->address, (e->any_service ? NULL : e->service),
+          &hints, &res_ai)) != 0)
+    ui_gai_err(rt, "getaddrinfo");
+
+  sd_cs_lock(&r->mutex.cs_mutex);
+
+  if (rt == 0) {
+    e->res_ai = resolve_ai_copy(res_ai);
+    e->state = RESOLVE_ENTRY_DONE;
+    e->expires = time_get_ms() + r->ttl_ms;
+  }
+  else {
+    e->gai_err = rt;
+    e->state = RESOLVE_ENTRY_FAILED;
+    e->expires = time_get_ms() + RESOLVE_NEGATIVE_TTL_MS;
+    r->stats.failed++;
+  }
+
+  while (e->waiting.top)
+  {
+    rai = (struct sd_resolve_addr_info *) e->waiting.list.value;
+    linked_list_rem(&e->waiting, &e->waiting.list, SD_OPTION_OFF);
+    resolve_entry_complete(e, rai, rai->done);
+  }
+
+  /* nothing to keep it for */
+  if (!r->ttl_ms) {
+    entry_to_find = e;
+    resolve_entry_rem(r, linked_list_iterate(&r->cache,
+          &resolve_entry_find_iterate));
+  }
+
+  sd_cs_unlock(&r->mutex.cs_mutex);
+
+  if (res_ai)
+    freeaddrinfo(res_ai);
+
+  return NULL;
+}
+
+
+/* -[ resolver ]------------------------------------------------------- */
+
+void resolver_init(int ttl)
+{
+  struct sd_resolver *r = gbls->resolver;
+
+  sd_thread_init(&r->mutex.cs_mutex);
+  linked_list_init(&r->cache);
+  memset(&r->stats, 0, sizeof r->stats);
+
+  if (ttl < 0)
+    ttl = RESOLVE_CACHE_TTL_DEFAULT;
+  r->ttl_ms = ttl * 1000;
+}
+
+void resolver_deinit(void)
+{
+  struct sd_resolver *r = gbls->resolver;
+
+  /* lookups dropped from the job pool queue are still pending */
+  linked_list_deinit_rem_all_entries(&r->cache, SD_OPTION_OFF,
+      (void (*)(void *)) &resolve_entry_free);
+  sd_thread_deinit(&r->mutex.cs_mutex);
+}
+
+void resolver_get_stats(struct sd_resolve_stats *st)
+{
+  struct sd_resolver *r = gbls->resolver;
+
+  sd_cs_lock(&r->mutex.cs_mutex);
+  memcpy(st, &r->stats, sizeof(struct sd_resolve_stats));
+  sd_cs_unlock(&r->mutex.cs_mutex);
+}
+
+void resolve_addr_set_info(struct sd_resolve_addr_info *ri, const char *a,
+    const char *s, char as)
+{
+  if (a)
+    snprintf(ri->lookup_address, sizeof ri->lookup_address, "%s", a);
+  if (s)
+    snprintf(ri->lookup_service, sizeof ri->lookup_service, "%s", s);
+  ri->any_service = as;
+  ri->family = AF_UNSPEC;
+}
+
+/* under the resolver lock */
+static void resolve_addr_cancel(struct sd_resolver *r,
+    struct sd_resolve_addr_info *rai)
+{
+  list_item *li;
+
+  if (!rai->pending)
+    return;
+
+  rai_to_find = rai;
+  if ((li = linked_list_iterate(&rai->pending->waiting,
+          &resolve_waiting_find_iterate)) != NULL)
+    linked_list_rem(&rai->pending->waiting, li, SD_OPTION_OFF);
+
+  rai->pending = NULL;
+  rai->done = NULL;
+}
+
+void resolve_addr_lookup(struct sd_resolve_addr_info *rai,
+    struct sd_completion *c)
+{
+  struct sd_resolver *r = gbls->resolver;
+  struct sd_resolve_entry *e;
+  list_item *li;
+  int gai_err;
+  char state;
+
+  resolve_addr_free(rai);
+  c->proc_state = PROC_STATE_INCOMPLETE;
+
+  sd_cs_lock(&r->mutex.cs_mutex);
+
+  resolve_cache_prune(r);
+
+  rai_to_find = rai;
+  li = linked_list_iterate(&r->cache, &resolve_entry_match_iterate);
+
+  if (li) {
+    e = (struct sd_resolve_entry *)li->value;
+
+    if (e->state == RESOLVE_ENTRY_PENDING) {
+      /* somebody asked first, wait with them */
+      r->stats.coalesced++;
+      rai->pending = e;
+      rai->done = c;
+      linked_list_add(&e->waiting, rai);
+      sd_cs_unlock(&r->mutex.cs_mutex);
+      return;
+    }
+
+    r->stats.hits++;
+    state = e->state;
+    gai_err = e->gai_err;
+    resolve_entry_complete(e, rai, c);
+    sd_cs_unlock(&r->mutex.cs_mutex);
+
+    if (state == RESOLVE_ENTRY_FAILED)
+      ui_gai_err(gai_err, "getaddrinfo");
+    return;
+  }
+
+  SAFE_CALLOC(e, 1, sizeof(struct sd_resolve_entry));
+  snprintf(e->address, sizeof e->address, "%s", rai->lookup_address);
+  snprintf(e->service, sizeof e->service, "%s", rai->lookup_service);
+  e->any_service = rai->any_service;
+  e->family = rai->family;
+  e->state = RESOLVE_ENTRY_PENDING;
+  linked_list_init(&e->waiting);
+
+  linked_list_add(&r->cache, e);
+  r->stats.entries++;
+  r->stats.lookups++;
+
+  rai->pending = e;
+  rai->done = c;
+  linked_list_add(&e->waiting, rai);
+
+  sd_cs_unlock(&r->mutex.cs_mutex);
+
+  job_pool_submit(&resolve_job_func, (void *)e);
+}
+
+void resolve_addr_free(struct sd_resolve_addr_info *rai)
+{
+  struct sd_resolver *r = gbls->resolver;
+
+  /* the lookup may be finishing on a pool thread */
+  sd_cs_lock(&r->mutex.cs_mutex);
+  resolve_addr_cancel(r, rai);
+  sd_cs_unlock(&r->mutex.cs_mutex);
+
+  resolve_ai_free(rai->res_ai);
+  rai->res_ai = NULL;
+}
+
+
+// vim:ts=2:expandtab
@@ -0,0 +1,113 @@
+#ifndef SD_RESOLVE_H
+#define SD_RESOLVE_H
+
+#ifdef WIN32
+
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h> /* addrinfo */
+
+#else
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#endif
+
+#include <stdint.h>
+
+#include "sd_thread.h"
+#include "sd_linked_list.h"
+
+#define RESOLVE_CACHE_TTL_DEFAULT           60 /* seconds */
+#define RESOLVE_NEGATIVE_TTL_MS           5000 /* a failed lookup is not retried sooner */
+#define RESOLVE_CACHE_MAX                  256 /* entries */
+
+struct sd_resolve_entry;
+
+/*! \brief Information for resolving network addresses */
+struct sd_resolve_addr_info
+{
+  /* address lookup info */
+#define LOOKUP_ADDRESS_LEN                   512
+  char lookup_address[LOOKUP_ADDRESS_LEN];
+#define LOOKUP_SERVICE_LEN                    64
+  char lookup_service[LOOKUP_SERVICE_LEN];
+
+  char any_service;
+  int family; /* AF_UNSPEC for any */
+
+  struct addrinfo *res_ai; /* own copy of the result */
+
+  /* set while waiting for a lookup */
+  struct sd_resolve_entry *pending;
+  struct sd_completion *done;
+};
+
+/*! \brief A lookup, shared by everyone asking for the same address */
+struct sd_resolve_entry
+{
+  /* key */
+  char address[LOOKUP_ADDRESS_LEN];
+  char service[LOOKUP_SERVICE_LEN];
+  char any_service;
+  int family;
+
+  char state;
+#define RESOLVE_ENTRY_PENDING                0
+#define RESOLVE_ENTRY_DONE                   1
+#define RESOLVE_ENTRY_FAILED                 2
+  int gai_err;
+
+  struct addrinfo *res_ai;
+  uint64_t expires; /* ms */
+
+  linked_list waiting; /* struct sd_resolve_addr_info */
+};
+
+/*! \brief Resolver statistics */
+struct sd_resolve_stats
+{
+  uint64_t lookups;   /* getaddrinfo() calls */
+  uint64_t hits;      /* answered from the cache */
+  uint64_t coalesced; /* joined a lookup already running */
+  uint64_t failed;
+  int entries;
+};
+
+/*! \brief Lookups run on the job pool, results are cached */
+struct sd_resolver
+{
+  struct sd_mutex_state_info mutex;
+  linked_list cache; /* struct sd_resolve_entry */
+  struct sd_resolve_stats stats;
+  int ttl_ms; /* 0 to not cache */
+};
+
+/*! \brief Initialise the resolver */
+extern void resolver_init(int ttl);
+
+/*! \brief Free the cache, the job pool must be stopped */
+extern void resolver_deinit(void);
+
+/*! \brief Get a copy of the resolver statistics */
+extern void resolver_get_stats(struct sd_resolve_stats *st);
+
+/*! \brief Set what to look up */
+extern void resolve_addr_set_info(struct sd_resolve_addr_info *ri, const char *a,
+    const char *s, char as);
+
+/*! \brief Start a lookup, c is posted once rai->res_ai is filled in,
+ *         before returning if the address is cached */
+extern void resolve_addr_lookup(struct sd_resolve_addr_info *rai,
+    struct sd_completion *c);
+
+/*! \brief Free the result, stops waiting for a lookup still running */
+extern void resolve_addr_free(struct sd_resolve_addr_info *rai);
+
+#endif
+
+
+// vim:ts=2:expandtab
@@ -18,11 +18,22 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#ifdef WIN32
+
+#include <winsock2.h>
+
+#else
+
+#include <errno.h>
+
+#endif
+
 #include "sd_ssl.h"
 #include "sd_globals.h"
 #include "sd_ui.h"
 #include "sd_error.h"
 #include "sd_net.h"
+#include "sd_timing.h"
 
 void ssl_init()
 {
@@ -59,6 +70,12 @@ int ssl_ssl_ctx_init(SSL_CTX **ctx)
     return -1;
   }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  /* sessions are never resumed, and tickets left unread on a socket that
+   * only sends make close() reset the connection */
+  SSL_CTX_set_num_tickets(*ctx, 0);
+#endif
+
   return 0;
 }
 
@@ -127,32 +144,6 @@ int ssl_ssl_init(SSL_CTX *ctx, SSL **ssl, struct sd_ssl_verify_info *vi, int fd)
   return 0;
 }
 
-int ssl_handshake_connect(SSL *ssl)
-{
-  /* preform the handshake as client */
-  if (SSL_connect(ssl) <= 0)
-  {
-    ui_ssl_err("SSL_connect");
-    SSL_free(ssl);
-    return -1;
-  }
-
-  return 0;
-}
-
-int ssl_handshake_accept(SSL *ssl)
-{
-  /* preform the handshake as server */
-  if (SSL_accept(ssl) <= 0)
-  {
-    ui_ssl_err("SSL_accept");
-    SSL_free(ssl);
-    return -1;
-  }
-
-  return 0;
-}
-
 void ssl_ssl_deinit(SSL *ssl)
 {
   SSL_free(ssl);
@@ -200,39 +191,132 @@ void ssl_set_verify_info(struct sd_ssl_verify_info *vi, char ucert,
 
 int con_ssl_init(struct sd_con_info *ci)
 {
-  int ret;
+  ui_notify("Performing SSL handshake...");
 
   if (ssl_ssl_init(gbls->net->ssl_ctx, &ci->ssl, &ci->ssl_verify,
         ci->sock_fd) == -1)
   {
     ui_sd_err("SSL initialisation failed.");
     /* close & no need shutdown ssl */
-    socket_close(&ci->sock_fd, SD_OPTION_ON, SD_OPTION_OFF, NULL);
+    socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
+    completion_post(&ci->step, PROC_STATE_COMPLETE_WITH_ERROR);
     return -1;
   }
+
+  ci->ssl_handshake_start = time_get_ms();
+  ci->ssl_handshake_ms = -1;
+
+  ci->ssl_ktls = 0;
+#ifdef SD_KTLS
+  /* only data connections move enough to gain from it */
+  if (ci->type == CON_TYPE_DATA && gbls->conf->data_ktls == SD_OPTION_ON)
+    SSL_set_options(ci->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+  /* a peer that stops answering fails the handshake */
+  if (gbls->conf->con_timeout > 0)
+    event_timer_add(&gbls->net->event_loops[0], &ci->setup_timer,
+        gbls->conf->con_timeout * 1000);
+
+  return con_ssl_handshake(ci);
+}
+
+#ifdef SD_KTLS
+/* openssl falls back to encrypting itself when the kernel has no tls
+ * module or does not know the negotiated cipher */
+static void con_ssl_ktls_check(struct sd_con_info *ci)
+{
+  if (BIO_get_ktls_send(SSL_get_wbio(ci->ssl)))
+    ci->ssl_ktls |= SSL_KTLS_SEND;
+  if (BIO_get_ktls_recv(SSL_get_rbio(ci->ssl)))
+    ci->ssl_ktls |= SSL_KTLS_RECV;
+
+  if (!ci->ssl_ktls)
+    ui_notify_printf("Kernel TLS is unavailable for %s, encrypting in user space.",
+        SSL_get_cipher_name(ci->ssl));
   else
+    ui_notify_printf("Kernel TLS is used for %s%s%s.",
+        ci->ssl_ktls & SSL_KTLS_SEND ? "sending" : "",
+        ci->ssl_ktls == (SSL_KTLS_SEND | SSL_KTLS_RECV) ? " and " : "",
+        ci->ssl_ktls & SSL_KTLS_RECV ? "receiving" : "");
+}
+#endif
+
+int con_ssl_handshake(struct sd_con_info *ci)
+{
+  int ret, events;
+
+  switch (ci->ssl_verify.ssl_hs_action)
   {
-    switch (ci->ssl_verify.ssl_hs_action)
-    {
-      case SSL_HANDSHAKE_ACTION_ACCEPT:
-        ret = ssl_handshake_accept(ci->ssl);
-        break;
-      case SSL_HANDSHAKE_ACTION_CONNECT:
-        ret = ssl_handshake_connect(ci->ssl);
-        break;
-    }
+    case SSL_HANDSHAKE_ACTION_ACCEPT:
+      ret = SSL_accept(ci->ssl);
+      break;
+    case SSL_HANDSHAKE_ACTION_CONNECT:
+    default:
+      ret = SSL_connect(ci->ssl);
+      break;
+  }
 
-    if (ret == -1)
-    {
+  if (ret == 1)
+  {
+    event_handler_del(&ci->ev);
+    timer_del(&ci->setup_timer);
+    ci->ssl_handshake_ms = (int) (time_get_ms() - ci->ssl_handshake_start);
+#ifdef SD_KTLS
+    if (SSL_get_options(ci->ssl) & SSL_OP_ENABLE_KTLS)
+      con_ssl_ktls_check(ci);
+#endif
+
+    /* handle_con_state() takes it from here */
+    completion_post(&ci->step, PROC_STATE_COMPLETE);
+    return 0;
+  }
+
+  switch (SSL_get_error(ci->ssl, ret))
+  {
+    case SSL_ERROR_WANT_READ:
+      events = SD_EVENT_READ;
+      break;
+    case SSL_ERROR_WANT_WRITE:
+      events = SD_EVENT_WRITE;
+      break;
+    default:
+      ui_ssl_err(ci->ssl_verify.ssl_hs_action == SSL_HANDSHAKE_ACTION_ACCEPT ?
+          "SSL_accept" : "SSL_connect");
       ui_sd_err("SSL handshake failed.");
-      /* close & no need shutdown ssl */
-      socket_close(&ci->sock_fd, SD_OPTION_ON, SD_OPTION_OFF, NULL);
+      con_ssl_fail(ci);
       return -1;
-    }
   }
+
+  /* carried on from the event loop once the socket is ready */
+  if (ci->ev.loop)
+    ret = event_handler_mod(&ci->ev, events);
+  else
+    ret = event_handler_add(&gbls->net->event_loops[0], &ci->ev, ci->sock_fd,
+        events);
+
+  if (ret == -1)
+  {
+    con_ssl_fail(ci);
+    return -1;
+  }
+
   return 0;
 }
 
+void con_ssl_fail(struct sd_con_info *ci)
+{
+  event_handler_del(&ci->ev);
+  timer_del(&ci->setup_timer);
+
+  SSL_free(ci->ssl);
+  ci->ssl = NULL;
+  /* close & no need shutdown ssl */
+  socket_close(&ci->sock_fd, SD_OPTION_OFF, NULL);
+
+  completion_post(&ci->step, PROC_STATE_COMPLETE_WITH_ERROR);
+}
+
 void ssl_verify_set_defaults(struct sd_ssl_verify_info *vi)
 {
   memcpy(vi, &gbls->conf->ssl_verify, sizeof (struct sd_ssl_verify_info));
@@ -22,6 +22,13 @@ struct sd_ssl_verify_info
 #define SSL_HANDSHAKE_ACTION_CONNECT    1
 };
 
+/* openssl can hand the session keys to the kernel after the handshake */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define SD_KTLS
+#endif
+#define SSL_KTLS_SEND                   1
+#define SSL_KTLS_RECV                   2
+
 /*! \brief Initialise the SSL library */
 extern void ssl_init();
 
@@ -44,16 +51,17 @@ extern int ssl_ssl_init(SSL_CTX *ctx, SSL **ssl, struct sd_ssl_verify_info *vi,
 /*! \brief Deinitialise a SSL session */
 extern void ssl_ssl_deinit(SSL *ssl);
 
-/*! \brief Perform SSL connect */
-extern int ssl_handshake_connect(SSL *ssl);
-
-/*! \brief Perform SSL accept */
-extern int ssl_handshake_accept(SSL *ssl);
-
 struct sd_con_info;
-/*! \brief Perform SSL routines for new connection */
+/*! \brief Start the SSL handshake for a new connection, the result is
+ *         posted to ci->step */
 extern int con_ssl_init(struct sd_con_info *ci);
 
+/*! \brief Carry on with the handshake, called when the socket is ready */
+extern int con_ssl_handshake(struct sd_con_info *ci);
+
+/*! \brief Give up on the handshake and close the connection */
+extern void con_ssl_fail(struct sd_con_info *ci);
+
 #endif
 
 
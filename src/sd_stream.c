@@ -0,0 +1,622 @@
+/*
+   Files split over several data connections
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "sd.h"
+#include "sd_globals.h"
+#include "sd_peers.h"
+#include "sd_net.h"
+#include "sd_ui.h"
+#include "sd_error.h"
+#include "sd_protocol.h"
+#include "sd_protocol_commands.h"
+#include "sd_dynamic_memory.h"
+#include "sd_idle.h"
+#include "sd_crc.h"
+#include "sd_stream.h"
+
+
+/* -[ frames ]--------------------------------------------------------- */
+
+static void stream_put_hdr(char *b, uint64_t pos, uint32_t len, uint32_t sum)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, pos >>= 8)
+    b[i] = (char) (pos & 0xff);
+  for (i = 11; i >= 8; i--, len >>= 8)
+    b[i] = (char) (len & 0xff);
+  for (i = 15; i >= 12; i--, sum >>= 8)
+    b[i] = (char) (sum & 0xff);
+}
+
+static void stream_get_hdr(const char *b, uint64_t *pos, uint64_t *len,
+    uint32_t *sum)
+{
+  int i;
+
+  *pos = 0;
+  for (i = 0; i < 8; i++)
+    *pos = (*pos << 8) | (unsigned char) b[i];
+  *len = 0;
+  for (i = 8; i < 12; i++)
+    *len = (*len << 8) | (unsigned char) b[i];
+  *sum = 0;
+  for (i = 12; i < 16; i++)
+    *sum = (*sum << 8) | (unsigned char) b[i];
+}
+
+
+/* -[ groups ]--------------------------------------------------------- */
+
+void data_stream_group_init(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_group *g;
+  struct sd_data_transfer_info *m;
+  int i;
+
+  /* a single stream is framed for its checksums */
+  if ((dti->streams < 2 && !dti->checksum) || dti->stream.group)
+    return;
+
+  SAFE_CALLOC(g, 1, sizeof(struct sd_stream_group));
+  g->leader = dti;
+  g->base = dti->file.position;
+  g->next = g->base;
+  g->slice = (dti->file.size - g->base) / dti->streams;
+  if (g->slice < DATA_STREAM_SLICE_MIN)
+    g->slice = DATA_STREAM_SLICE_MIN;
+  g->check = dti->checksum;
+  g->member[g->n++] = dti;
+  dti->stream.group = g;
+
+  /* the peer sets up its side when they are suggested */
+  if (dti->direction != DATA_TRANSFER_DIRECTION_OUTGOING)
+    return;
+
+  for (i = 1; i < dti->streams; i++)
+  {
+    m = data_transfer_init(
+        dti->parent_peer,
+        dti->data_con.enable_ssl, &dti->data_con.ssl_verify,
+        &dti->file, DATA_TRANSFER_DIRECTION_OUTGOING);
+
+    data_transfer_set_id(m, DATA_TRANSFER_DIRECTION_OUTGOING, 0);
+    data_transfer_set_wan(m, dti->wan_address, dti->wan_service);
+    m->peer_using_ssl = dti->peer_using_ssl;
+    m->streams = dti->streams;
+    m->checksum = dti->checksum;
+    data_stream_join(m, dti);
+
+    switch (dti->con_meth)
+    {
+      case CON_METH_PASSIVE:
+        data_transfer_set_passive(m, dti->using_local_address,
+            dti->data_server, dti->allow_any_port);
+        file_suggest_command_pack_and_send(m);
+        break;
+      case CON_METH_ACTIVE:
+        data_transfer_set_active(m,
+            dti->data_con.resolve_src_addr.lookup_address, NULL);
+        data_transfer_setup_active_resolve_source(m);
+        break;
+    }
+  }
+}
+
+int data_stream_join(struct sd_data_transfer_info *dti,
+    struct sd_data_transfer_info *leader)
+{
+  struct sd_stream_group *g = leader->stream.group;
+
+  if (!g || g->aborted || g->n >= leader->streams ||
+      g->n >= DATA_STREAMS_MAX)
+    return -1;
+
+  g->member[g->n++] = dti;
+  dti->stream.group = g;
+
+  return 0;
+}
+
+void data_stream_leave(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_group *g = dti->stream.group;
+  int i;
+
+  if (!g)
+    return;
+  dti->stream.group = NULL;
+
+  if (g->leader == dti)
+    g->leader = NULL;
+
+  for (i = 0; i < g->n; i++)
+  {
+    if (g->member[i] == dti)
+    {
+      memmove(&g->member[i], &g->member[i + 1],
+          (g->n - i - 1) * sizeof(g->member[0]));
+      g->n--;
+      break;
+    }
+  }
+
+  if (!g->n)
+    SAFE_FREE(g);
+}
+
+int data_stream_done(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_group *g = dti->stream.group;
+
+  return g && g->base + g->moved >= dti->file.size;
+}
+
+void data_stream_abort(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_group *g = dti->stream.group;
+  int i;
+
+  /* a member left over once the file is whole does not matter */
+  if (!g || data_stream_done(dti) || g->aborted)
+    return;
+  g->aborted = 1;
+
+  for (i = 0; i < g->n; i++)
+    if (g->member[i] != dti)
+      data_transfer_step(g->member[i]);
+}
+
+void data_stream_check(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_group *g = dti->stream.group;
+
+  if (!g)
+    return;
+
+  /* the peer finds the group by the id of any of its streams */
+  if (dti->direction == DATA_TRANSFER_DIRECTION_INCOMING && !g->aborted)
+  {
+    while (g->resend_n > 0)
+    {
+      g->resend_n--;
+      file_resend_command_pack_and_send(dti, g->resend[g->resend_n].pos,
+          g->resend[g->resend_n].len);
+    }
+
+    if (g->checked == 1) {
+      g->checked = 2;
+      file_checked_command_pack_and_send(dti);
+    }
+  }
+
+  if (!g->aborted)
+    return;
+
+  switch (dti->state)
+  {
+    case DATA_TRANSFER_STATE_COMPLETED:
+    case DATA_TRANSFER_STATE_ABORTED:
+      return;
+    case DATA_TRANSFER_STATE_TRANSFERING:
+      if (dti->data_con.state == CON_STATE_ESTABLISHED) {
+        data_con_close(dti);
+        return;
+      }
+      break;
+  }
+
+  data_transfer_abort(dti);
+}
+
+void data_stream_set_transfer_state(struct sd_data_transfer_info *dti, char v)
+{
+  struct sd_stream_group *g = dti->stream.group;
+  struct sd_data_transfer_info *m;
+  int i;
+
+  if (!g || g->leader != dti)
+    return;
+
+  for (i = 0; i < g->n; i++)
+  {
+    m = g->member[i];
+    if (m != dti && m->state != DATA_TRANSFER_STATE_COMPLETED &&
+        m->state != DATA_TRANSFER_STATE_ABORTED)
+      data_transfer_set_transfer_state(m, v);
+  }
+}
+
+/* the file bytes of a frame were sent or written, the leader shows all of
+ * them */
+static void stream_moved(struct sd_data_transfer_info *dti, uint64_t n)
+{
+  struct sd_stream_group *g = dti->stream.group;
+
+  g->moved += n;
+  if (g->leader != dti)
+    dti->io_total_bytes_current += n;
+  if (g->leader)
+    g->leader->io_total_bytes_current = g->base + g->moved;
+}
+
+/* the whole file is there, the others may not have seen their close yet */
+static void stream_completed(struct sd_stream_group *g)
+{
+  struct sd_data_transfer_info *m;
+  int i;
+
+  for (i = 0; i < g->n; i++)
+  {
+    m = g->member[i];
+    if (m->state == DATA_TRANSFER_STATE_TRANSFERING &&
+        m->data_con.state == CON_STATE_ESTABLISHED)
+    {
+      m->stream.waiting = 0;
+      data_transfer_set_completed(m);
+    }
+  }
+}
+
+
+/* -[ outgoing ]------------------------------------------------------- */
+
+/* a range the peer asked for again, a part of what no stream has taken
+ * yet, then the back half of the longest range left so a slow connection
+ * does not hold up the file */
+static int stream_take(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_info *st = &dti->stream;
+  struct sd_stream_group *g = st->group;
+  struct sd_data_transfer_info *m, *from;
+  uint64_t len, rem;
+  int i;
+
+  if (g->resend_n > 0)
+  {
+    g->resend_n--;
+    st->pos = g->resend[g->resend_n].pos;
+    st->end = st->pos + g->resend[g->resend_n].len;
+    return 0;
+  }
+
+  if (g->next < dti->file.size)
+  {
+    len = dti->file.size - g->next;
+    if (len > g->slice)
+      len = g->slice;
+
+    st->pos = g->next;
+    st->end = g->next + len;
+    g->next += len;
+    return 0;
+  }
+
+  from = NULL;
+  rem = 0;
+  for (i = 0; i < g->n; i++)
+  {
+    m = g->member[i];
+    if (m != dti && m->stream.end - m->stream.pos > rem) {
+      from = m;
+      rem = m->stream.end - m->stream.pos;
+    }
+  }
+
+  if (!from || rem < DATA_STREAM_STEAL_MIN)
+    return -1;
+
+  st->end = from->stream.end;
+  st->pos = from->stream.pos + rem / 2;
+  from->stream.end = st->pos;
+
+  return 0;
+}
+
+int data_stream_refill(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_info *st = &dti->stream;
+  struct sd_stream_group *g = st->group;
+  int want, filled, bread;
+  uint32_t sum;
+
+  if (st->pos >= st->end && stream_take(dti) == -1)
+  {
+    /* the leader stays until the others have sent the rest, with checksums
+     * until the peer has it all intact */
+    if (g->leader == dti && (g->check || !data_stream_done(dti))) {
+      st->waiting = 1;
+      event_handler_mod(&dti->data_con.ev, 0);
+      return 0;
+    }
+
+    data_transfer_set_completed(dti);
+    return 0;
+  }
+
+  want = dti->data_window_len - DATA_STREAM_HDR_LEN;
+  if (st->end - st->pos < (uint64_t) want)
+    want = (int) (st->end - st->pos);
+
+  for (filled = 0; filled < want; filled += bread)
+  {
+    bread = file_pread(&dti->file,
+        dti->data_buffer + DATA_STREAM_HDR_LEN + filled,
+        want - filled,
+        st->pos + filled);
+
+    /* error occured, abort */
+    if (bread == -1) {
+      ui_sys_err(errno, "pread");
+      data_con_close(dti);
+      return -1;
+    }
+
+    /* premature EOF, abort */
+    if (bread == 0) {
+      ui_sd_err("File is shorter than its size.");
+      data_con_close(dti);
+      return -1;
+    }
+  }
+
+  sum = 0;
+  if (g->check)
+    sum = crc32c(0, dti->data_buffer + DATA_STREAM_HDR_LEN, want);
+
+  stream_put_hdr(dti->data_buffer, st->pos, (uint32_t) want, sum);
+  st->pos += want;
+  st->hdr_left = DATA_STREAM_HDR_LEN;
+
+  dti->data_buffer_lower_offset = 0;
+  dti->data_buffer_window_size = DATA_STREAM_HDR_LEN + want;
+
+  return 0;
+}
+
+void data_stream_sent(struct sd_data_transfer_info *dti, int len)
+{
+  struct sd_stream_info *st = &dti->stream;
+  struct sd_data_transfer_info *l = st->group->leader;
+  int hdr;
+
+  hdr = len < st->hdr_left ? len : st->hdr_left;
+  st->hdr_left -= hdr;
+  stream_moved(dti, len - hdr);
+
+  /* the last of the file went out on another stream, with checksums the
+   * peer tells when it has all of it */
+  if (l && l != dti && l->stream.waiting && !st->group->check &&
+      l->state == DATA_TRANSFER_STATE_TRANSFERING && data_stream_done(dti))
+  {
+    l->stream.waiting = 0;
+    data_transfer_set_completed(l);
+  }
+}
+
+int data_stream_resend(struct sd_data_transfer_info *dti,
+    uint64_t pos, uint64_t len)
+{
+  struct sd_stream_group *g = dti->stream.group;
+  struct sd_data_transfer_info *l;
+
+  if (!g || !g->check || dti->direction != DATA_TRANSFER_DIRECTION_OUTGOING ||
+      !len || pos < g->base || pos > dti->file.size ||
+      len > dti->file.size - pos || g->resend_n >= DATA_STREAM_RESEND_MAX)
+    return -1;
+
+  /* the leader waits for these */
+  l = g->leader;
+  if (!l || l->state != DATA_TRANSFER_STATE_TRANSFERING)
+    return -1;
+
+  g->resend[g->resend_n].pos = pos;
+  g->resend[g->resend_n].len = len;
+  g->resend_n++;
+
+  /* it has to move again */
+  g->moved -= len < g->moved ? len : g->moved;
+  l->io_total_bytes_current = g->base + g->moved;
+
+  if (l->stream.waiting) {
+    l->stream.waiting = 0;
+    event_handler_mod(&l->data_con.ev, data_transfer_get_events(l));
+  }
+
+  return 0;
+}
+
+int data_stream_checked(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_group *g = dti->stream.group;
+
+  if (!g || !g->check || dti->direction != DATA_TRANSFER_DIRECTION_OUTGOING ||
+      !data_stream_done(dti))
+    return -1;
+
+  stream_completed(g);
+
+  return 0;
+}
+
+
+/* -[ incoming ]------------------------------------------------------- */
+
+/* the streams that still have a connection, or will have one */
+static int stream_live_count(struct sd_stream_group *g)
+{
+  struct sd_data_transfer_info *m;
+  int i, n;
+
+  for (i = 0, n = 0; i < g->n; i++)
+  {
+    m = g->member[i];
+    if (m->state != DATA_TRANSFER_STATE_COMPLETED &&
+        m->state != DATA_TRANSFER_STATE_ABORTED && !m->stream.waiting)
+      n++;
+  }
+
+  return n;
+}
+
+/* a frame is in the file, a damaged one is asked for again by the core */
+static int stream_frame_end(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_info *st = &dti->stream;
+  struct sd_stream_group *g = st->group;
+
+  if (!g->check)
+    return 0;
+
+  if (st->frame_crc == st->frame_sum) {
+    stream_moved(dti, st->frame_len);
+    return 0;
+  }
+
+  if (g->resends >= DATA_STREAM_RESEND_MAX) {
+    ui_sd_err("Too many damaged data frames, giving up on the file.");
+    data_con_close(dti);
+    return -1;
+  }
+
+  ui_notify_printf("Recieved a damaged data frame at %"PRIu64", asking for "
+      "it again.", st->frame_start);
+
+  g->resend[g->resend_n].pos = st->frame_start;
+  g->resend[g->resend_n].len = st->frame_len;
+  g->resend_n++;
+  g->resends++;
+  data_transfer_step(dti);
+
+  return 0;
+}
+
+int data_stream_received(struct sd_data_transfer_info *dti, int len)
+{
+  struct sd_stream_info *st = &dti->stream;
+  struct sd_stream_group *g = st->group;
+  char *b = dti->data_buffer;
+  uint64_t flen;
+  int n;
+
+  while (len > 0)
+  {
+    /* the header of the next frame */
+    if (!st->frame_left)
+    {
+      n = DATA_STREAM_HDR_LEN - st->hdr_len;
+      if (n > len)
+        n = len;
+      memcpy(st->hdr + st->hdr_len, b, n);
+      st->hdr_len += n;
+      b += n;
+      len -= n;
+
+      if (st->hdr_len < DATA_STREAM_HDR_LEN)
+        break;
+      st->hdr_len = 0;
+
+      stream_get_hdr(st->hdr, &st->frame_pos, &flen, &st->frame_sum);
+      if (!flen || st->frame_pos < g->base || st->frame_pos > dti->file.size ||
+          flen > dti->file.size - st->frame_pos)
+      {
+        ui_sd_err("Recieved a data frame outside of the file.");
+        data_con_close(dti);
+        return -1;
+      }
+
+      st->frame_start = st->frame_pos;
+      st->frame_len = flen;
+      st->frame_left = flen;
+      st->frame_crc = 0;
+      continue;
+    }
+
+    /* write to file at the frame position, all of it or fail */
+    n = st->frame_left < (uint64_t) len ? (int) st->frame_left : len;
+    if (file_pwrite(&dti->file, b, n, st->frame_pos) == -1) {
+      ui_sys_err(errno, "pwrite");
+      data_con_close(dti);
+      return -1;
+    }
+
+    /* with checksums a frame counts once it is known to be intact */
+    if (g->check)
+      st->frame_crc = crc32c(st->frame_crc, b, n);
+    else
+      stream_moved(dti, n);
+
+    st->frame_pos += n;
+    st->frame_left -= n;
+    b += n;
+    len -= n;
+
+    if (!st->frame_left && stream_frame_end(dti) == -1)
+      return -1;
+  }
+
+  /* the last frame may have come in on any of them, the core tells the
+   * peer it can stop waiting for damaged ones */
+  if (data_stream_done(dti))
+  {
+    if (g->check && !g->checked) {
+      g->checked = 1;
+      data_transfer_step(dti);
+    }
+    stream_completed(g);
+  }
+
+  return 0;
+}
+
+int data_stream_closed(struct sd_data_transfer_info *dti)
+{
+  struct sd_stream_info *st = &dti->stream;
+  struct sd_stream_group *g = st->group;
+
+  /* closed in the middle of a frame */
+  if (st->hdr_len || st->frame_left) {
+    data_con_close(dti);
+    return -1;
+  }
+
+  /* the leader stays until the others have brought the rest */
+  if (g->leader == dti) {
+    st->waiting = 1;
+    event_handler_mod(&dti->data_con.ev, 0);
+  }
+  else {
+    data_transfer_set_completed(dti);
+  }
+
+  /* nothing is left to bring the rest */
+  if (!stream_live_count(g) && g->leader && g->leader->stream.waiting)
+  {
+    ui_sd_err("All data connections of a file closed before it was complete.");
+    data_con_close(g->leader);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// vim:ts=2:expandtab
@@ -0,0 +1,121 @@
+#ifndef SD_STREAM_H
+#define SD_STREAM_H
+
+#include <stdint.h>
+
+#define DATA_STREAMS_MAX                    16 /* data connections per file */
+#define DATA_STREAM_HDR_LEN                 16 /* frame offset, length and
+                                                  CRC32C */
+#define DATA_STREAM_SLICE_MIN          1048576 /* 1 MB, first take of a stream */
+#define DATA_STREAM_STEAL_MIN          1048576 /* 1 MB, shorter ranges are left
+                                                  where they are */
+#define DATA_STREAM_RESEND_MAX              64 /* damaged frames asked for
+                                                  again per file */
+
+/* partial declerations */
+struct sd_data_transfer_info;
+
+/*! \brief A part of the file */
+struct sd_stream_range
+{
+  uint64_t pos;
+  uint64_t len;
+};
+
+/*! \brief Transfers that move one file over several data connections,
+ *         all of them belong to the same peer and so to the same worker */
+struct sd_stream_group
+{
+  struct sd_data_transfer_info *leader; /* the suggested transfer, NULL once gone */
+  struct sd_data_transfer_info *member[DATA_STREAMS_MAX]; /* the leader first */
+  int n; /* members left */
+
+  uint64_t base; /* position of the leader, nothing before it is moved */
+  uint64_t next; /* outgoing, start of the part no stream has taken */
+  uint64_t slice; /* outgoing, first take of each stream */
+  uint64_t moved; /* file bytes sent or written by all members */
+
+  char aborted; /* a member failed, the core aborts the rest */
+
+  /* frames carry a CRC32C, outgoing ranges the peer asked for again or
+   * incoming ones the core has still to ask for */
+  char check;
+  struct sd_stream_range resend[DATA_STREAM_RESEND_MAX];
+  int resend_n;
+  int resends; /* incoming, asked for so far */
+  char checked; /* incoming, 1 once the file is whole, 2 once told */
+};
+
+/*! \brief Where a transfer is in its part of the file, data goes in frames
+ *         of an offset and a length, both in network byte order */
+struct sd_stream_info
+{
+  struct sd_stream_group *group; /* NULL for a plain transfer */
+
+  /* outgoing, range still to be framed and how much of the header in
+   * data_buffer is not sent yet */
+  uint64_t pos;
+  uint64_t end;
+  int hdr_left;
+
+  /* incoming, header being received and where the payload goes */
+  char hdr[DATA_STREAM_HDR_LEN];
+  int hdr_len;
+  uint64_t frame_pos;
+  uint64_t frame_left;
+  uint64_t frame_start;
+  uint64_t frame_len;
+  uint32_t frame_sum; /* sent with the frame */
+  uint32_t frame_crc; /* of what came so far */
+
+  char waiting; /* the leader has nothing left, interest is dropped */
+};
+
+/*! \brief Split the file of an accepted transfer, an outgoing one also
+ *         suggests the other streams to the peer */
+extern void data_stream_group_init(struct sd_data_transfer_info *dti);
+
+/*! \brief Add a transfer suggested for the file of leader to its group */
+extern int data_stream_join(struct sd_data_transfer_info *dti,
+    struct sd_data_transfer_info *leader);
+
+/*! \brief Leave the group, the last member frees it */
+extern void data_stream_leave(struct sd_data_transfer_info *dti);
+
+/*! \brief Get if the members of the group have moved the whole file */
+extern int data_stream_done(struct sd_data_transfer_info *dti);
+
+/*! \brief Have the core abort the other members of the group */
+extern void data_stream_abort(struct sd_data_transfer_info *dti);
+
+/*! \brief On the core, ask the peer for damaged frames, tell it once the
+ *         file is whole and abort a transfer whose group failed */
+extern void data_stream_check(struct sd_data_transfer_info *dti);
+
+/*! \brief Pause or resume the other members with the leader */
+extern void data_stream_set_transfer_state(struct sd_data_transfer_info *dti,
+    char v);
+
+/*! \brief Send a damaged range again, the peer asked for it */
+extern int data_stream_resend(struct sd_data_transfer_info *dti,
+    uint64_t pos, uint64_t len);
+
+/*! \brief The peer has all of the file intact, finish the streams */
+extern int data_stream_checked(struct sd_data_transfer_info *dti);
+
+/*! \brief Frame the next part of the range into data_buffer */
+extern int data_stream_refill(struct sd_data_transfer_info *dti);
+
+/*! \brief Count what went out of data_buffer, less the frame headers */
+extern void data_stream_sent(struct sd_data_transfer_info *dti, int len);
+
+/*! \brief Write the frames received into data_buffer */
+extern int data_stream_received(struct sd_data_transfer_info *dti, int len);
+
+/*! \brief The peer closed the data connection */
+extern int data_stream_closed(struct sd_data_transfer_info *dti);
+
+#endif
+
+
+// vim:ts=2:expandtab
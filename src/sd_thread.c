@@ -22,11 +22,20 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
 
 #include "sd_net.h"
 #include "sd_thread.h"
 #include "sd_error.h"
 #include "sd_peers.h"
+#include "sd_idle.h"
+#include "sd_globals.h"
+#include "sd_dynamic_memory.h"
 
 
 void sd_thread_init(void *mutex)
@@ -98,113 +107,404 @@ int sd_create_thread(thread_pos_cb f, void *args)
   {
     ON_ERROR_EXIT("pthread_create() failed.");
   }
+  /* nobody joins them */
+  pthread_detach(id);
 #endif
   return 0;
 }
 
-void *sd_mutex_con_func(void *v)
+
+/* -[ completions ]---------------------------------------------------- */
+
+static struct sd_completion *completion_load(struct sd_completion **p)
 {
-  int ret;
-  //sd_cs_lock(&((struct sd_con_info *)v)->mutex_state.cs_mutex);
+#ifdef WIN32
+  return *(struct sd_completion * volatile *)p;
+#else
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
+}
 
-  /* thread safe processing */
-  sd_set_mutex_state(&((struct sd_con_info *)v)->mutex_state.proc_state,
-      PROC_STATE_INCOMPLETE);
-  ret = handle_con_thread((struct sd_con_info *)v);
-  sd_set_mutex_state(&((struct sd_con_info *)v)->mutex_state.proc_state, ret);
+/* on failure *o is set to what is there now */
+static int completion_cas(struct sd_completion **p, struct sd_completion **o,
+    struct sd_completion *n)
+{
+#ifdef WIN32
+  struct sd_completion *was;
 
-  //sd_cs_unlock(&((struct sd_con_info *)v)->mutex_state.cs_mutex);
+  was = (struct sd_completion *) InterlockedCompareExchangePointer(
+      (PVOID volatile *)p, n, *o);
+  if (was == *o)
+    return 1;
+  *o = was;
+  return 0;
+#else
+  return __atomic_compare_exchange_n(p, o, n, 0, __ATOMIC_RELEASE,
+      __ATOMIC_RELAXED);
+#endif
+}
 
+/* returns what was there, 1 when c was queued already */
+static int completion_set_queued(struct sd_completion *c, int q)
+{
 #ifdef WIN32
-  _endthread();
+  return (int) InterlockedExchange((LONG volatile *)&c->queued, q);
 #else
+  return __atomic_exchange_n(&c->queued, q, __ATOMIC_ACQ_REL);
 #endif
-  return NULL;
 }
 
-int sd_mutex_con_idle(void *value, int index)
+static struct sd_completion *completion_xchg(struct sd_completion **p,
+    struct sd_completion *n)
 {
-  handle_con_state((struct sd_con_info *)value);
-  return 0;
+#ifdef WIN32
+  return (struct sd_completion *) InterlockedExchangePointer(
+      (PVOID volatile *)p, n);
+#else
+  return __atomic_exchange_n(p, n, __ATOMIC_ACQUIRE);
+#endif
 }
 
-int sd_mutex_data_con_idle(void *value, int index)
+/* move everything posted so far to the ready list, oldest first */
+static void completion_queue_take(struct sd_completion_queue *q)
 {
-  handle_con_state(&((struct sd_data_transfer_info *)value)->data_con);
-  return 0;
+  struct sd_completion *c, *next, *first, *last;
+
+  if (!(c = completion_xchg(&q->head, NULL)))
+    return;
+
+  first = NULL;
+  last = c;
+  for (; c != NULL; c = next)
+  {
+    next = c->next;
+    c->next = first;
+    first = c;
+  }
+
+  if (q->ready_last)
+    q->ready_last->next = first;
+  else
+    q->ready = first;
+  q->ready_last = last;
 }
-int sd_mutex_data_con_idle_iter(void *value, int index)
+
+void completion_init(struct sd_completion *c, completion_cb cb, void *v)
 {
-  linked_list_iterate(&((struct sd_peer_info *)value)->data_transfers,
-      &sd_mutex_data_con_idle);
-  return 0;
+  memset(c, 0, sizeof(struct sd_completion));
+  c->cb = cb;
+  c->v = v;
 }
 
+void completion_post(struct sd_completion *c, char ps)
+{
+  struct sd_completion_queue *q = &gbls->core->done;
+  struct sd_completion *head;
 
+  c->proc_state = ps;
+  if (completion_set_queued(c, 1))
+    return;
 
-void *sd_mutex_server_func(void *v)
+  head = completion_load(&q->head);
+  do {
+    c->next = head;
+  } while (!completion_cas(&q->head, &head, c));
+}
+
+int completion_is_queued(struct sd_completion *c)
 {
-  int ret;
-  //sd_cs_lock(&((struct sd_serv_info *)v)->mutex_state.cs_mutex);
+#ifdef WIN32
+  return *(volatile int *)&c->queued;
+#else
+  return __atomic_load_n(&c->queued, __ATOMIC_ACQUIRE);
+#endif
+}
+
+int completion_cancel(struct sd_completion *c)
+{
+  struct sd_completion_queue *q = &gbls->core->done;
+  struct sd_completion *p, **pp;
+
+  if (!completion_is_queued(c))
+    return 0;
+
+  /* it may still be on the lock free side */
+  completion_queue_take(q);
+
+  p = NULL;
+  for (pp = &q->ready; *pp != NULL; pp = &(*pp)->next)
+  {
+    if (*pp == c)
+    {
+      *pp = c->next;
+      if (q->ready_last == c)
+        q->ready_last = p;
+      break;
+    }
+    p = *pp;
+  }
+
+  c->next = NULL;
+  completion_set_queued(c, 0);
+  return 1;
+}
+
+int completion_queue_pending(void)
+{
+  struct sd_completion_queue *q = &gbls->core->done;
+
+  return q->ready != NULL || completion_load(&q->head) != NULL;
+}
+
+int completion_queue_run(void)
+{
+  struct sd_completion_queue *q = &gbls->core->done;
+  struct sd_completion *c;
+  int n = 0;
+
+  for (;;)
+  {
+    /* callbacks may post more, those are run too */
+    if (!q->ready)
+      completion_queue_take(q);
+    if (!(c = q->ready))
+      break;
+
+    q->ready = c->next;
+    if (!q->ready)
+      q->ready_last = NULL;
+    c->next = NULL;
+    completion_set_queued(c, 0);
+
+    (*c->cb)(c->v);
+    n++;
+  }
 
-  /* thread safe processing */
+  return n;
+}
 
-  sd_set_mutex_state(&((struct sd_serv_info *)v)->mutex_state.proc_state,
-      PROC_STATE_INCOMPLETE);
-  ret = handle_server_thread((struct sd_serv_info *)v);
-  sd_set_mutex_state(&((struct sd_serv_info *)v)->mutex_state.proc_state, ret);
 
+/* -[ job pool ]------------------------------------------------------- */
 
-  //sd_cs_unlock(&((struct sd_serv_info *)v)->mutex_state.cs_mutex);
+static void pool_start(struct sd_job_pool *jp, int nthreads)
+{
+  int i;
 
+  sd_thread_init(&jp->mutex.cs_mutex);
 #ifdef WIN32
-  _endthread();
+  if ((jp->sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL)) == NULL)
+    ON_ERROR_EXIT("CreateSemaphore() failed.");
 #else
+  pthread_cond_init(&jp->cond, NULL);
 #endif
-  return NULL;
+  linked_list_init(&jp->jobs);
+  memset(&jp->stats, 0, sizeof jp->stats);
+
+  jp->stats.threads = nthreads;
+  jp->alive = nthreads;
+  jp->running = 1;
+
+  for (i = 0; i < nthreads; i++)
+    sd_create_thread(&sd_job_pool_func, jp);
 }
 
-int sd_mutex_serv_idle(void *value, int index)
+static void pool_stop(struct sd_job_pool *jp)
 {
-  handle_server_state((struct sd_serv_info *)value);
-  return 0;
+
+  sd_cs_lock(&jp->mutex.cs_mutex);
+  jp->running = 0;
+#ifdef WIN32
+  ReleaseSemaphore(jp->sem, jp->stats.threads, NULL);
+#else
+  pthread_cond_broadcast(&jp->cond);
+#endif
+  sd_cs_unlock(&jp->mutex.cs_mutex);
+
+  /* a connect or lookup in progress can not be interrupted */
+  while (jp->alive)
+  {
+#ifdef WIN32
+    Sleep(JOB_POOL_STOP_POLL_MS);
+#else
+    usleep(JOB_POOL_STOP_POLL_MS * 1000);
+#endif
+  }
+
+  linked_list_rem_all_entries(&jp->jobs, SD_OPTION_ON);
+#ifdef WIN32
+  CloseHandle(jp->sem);
+#else
+  pthread_cond_destroy(&jp->cond);
+#endif
+  sd_thread_deinit(&jp->mutex.cs_mutex);
 }
 
+static void pool_submit(struct sd_job_pool *jp, thread_pos_cb f, void *args)
+{
+  struct sd_job *job;
+
+  SAFE_CALLOC(job, 1, sizeof(struct sd_job));
+  job->f = f;
+  job->args = args;
+
+  sd_cs_lock(&jp->mutex.cs_mutex);
+
+  linked_list_add(&jp->jobs, job);
+  jp->stats.submitted++;
+  jp->stats.queued++;
+  if (jp->stats.queued > jp->stats.queued_max)
+    jp->stats.queued_max = jp->stats.queued;
 
+#ifdef WIN32
+  ReleaseSemaphore(jp->sem, 1, NULL);
+#else
+  pthread_cond_signal(&jp->cond);
+#endif
+
+  sd_cs_unlock(&jp->mutex.cs_mutex);
+}
 
-void *sd_mutex_server_accept_func(void *v)
+static void pool_get_stats(struct sd_job_pool *jp, struct sd_job_pool_stats *st)
 {
-  int ret;
-  //sd_cs_lock(&((struct sd_serv_info *)v)->mutex_state.cs_mutex);
+  sd_cs_lock(&jp->mutex.cs_mutex);
+  memcpy(st, &jp->stats, sizeof(struct sd_job_pool_stats));
+  sd_cs_unlock(&jp->mutex.cs_mutex);
+}
+
+void job_pool_init(int nthreads)
+{
+  if (nthreads <= 0)
+    nthreads = JOB_POOL_THREADS_DEFAULT;
+  if (nthreads < JOB_POOL_THREADS_MIN)
+    nthreads = JOB_POOL_THREADS_MIN;
+  if (nthreads > JOB_POOL_THREADS_MAX)
+    nthreads = JOB_POOL_THREADS_MAX;
+
+  pool_start(gbls->pool, nthreads);
+}
+
+void job_pool_deinit(void)
+{
+  pool_stop(gbls->pool);
+}
+
+void job_pool_submit(thread_pos_cb f, void *args)
+{
+  pool_submit(gbls->pool, f, args);
+}
+
+void job_pool_get_stats(struct sd_job_pool_stats *st)
+{
+  pool_get_stats(gbls->pool, st);
+}
 
-  /* thread safe processing */
 
-  sd_set_mutex_state(&((struct sd_serv_accept_info *)v)->mutex_state.proc_state,
-      PROC_STATE_INCOMPLETE);
-  ret = handle_server_accept_thread((struct sd_serv_accept_info *)v);
-  sd_set_mutex_state(&((struct sd_serv_accept_info *)v)->mutex_state.proc_state, ret);
+/* -[ io pool ]-------------------------------------------------------- */
 
+/* the same threads and queue as the job pool, kept apart so a slow disk
+ * holds up only the transfers and never a lookup or connect */
+void io_pool_init(int nthreads)
+{
+  if (nthreads <= 0)
+    nthreads = IO_POOL_THREADS_DEFAULT;
+  if (nthreads > IO_POOL_THREADS_MAX)
+    nthreads = IO_POOL_THREADS_MAX;
 
-  //sd_cs_unlock(&((struct sd_serv_info *)v)->mutex_state.cs_mutex);
+  pool_start(gbls->io_pool, nthreads);
+}
+
+void io_pool_deinit(void)
+{
+  pool_stop(gbls->io_pool);
+}
+
+void io_pool_submit(thread_pos_cb f, void *args)
+{
+  pool_submit(gbls->io_pool, f, args);
+}
+
+void io_pool_get_stats(struct sd_job_pool_stats *st)
+{
+  pool_get_stats(gbls->io_pool, st);
+}
+
+/* take the oldest job, NULL when the pool is stopping */
+static struct sd_job *job_pool_next(struct sd_job_pool *jp)
+{
+  struct sd_job *job;
 
 #ifdef WIN32
-  _endthread();
+  WaitForSingleObject(jp->sem, INFINITE);
+  sd_cs_lock(&jp->mutex.cs_mutex);
 #else
+  sd_cs_lock(&jp->mutex.cs_mutex);
+  while (jp->running && !jp->jobs.top)
+    pthread_cond_wait(&jp->cond, &jp->mutex.cs_mutex);
 #endif
-  return NULL;
+
+  if (!jp->running || !jp->jobs.top)
+  {
+    sd_cs_unlock(&jp->mutex.cs_mutex);
+    return NULL;
+  }
+
+  job = (struct sd_job *) jp->jobs.list.value;
+  linked_list_rem(&jp->jobs, &jp->jobs.list, SD_OPTION_OFF);
+  jp->stats.queued--;
+  jp->stats.busy++;
+
+  sd_cs_unlock(&jp->mutex.cs_mutex);
+
+  return job;
 }
 
-int sd_mutex_serv_accept_idle_iter(void *value, int index)
+void *sd_job_pool_func(void *v)
 {
-  handle_server_accept_state((struct sd_serv_accept_info *)value);
-  return 0;
+  struct sd_job_pool *jp = (struct sd_job_pool *)v;
+  struct sd_job *job;
+
+  while ((job = job_pool_next(jp)))
+  {
+    (*job->f)(job->args);
+    SAFE_FREE(job);
+
+    sd_cs_lock(&jp->mutex.cs_mutex);
+    jp->stats.busy--;
+    jp->stats.completed++;
+    sd_cs_unlock(&jp->mutex.cs_mutex);
+
+    /* the state machine waiting on it can go on */
+    core_wake();
+  }
+
+  sd_cs_lock(&jp->mutex.cs_mutex);
+  jp->alive--;
+  sd_cs_unlock(&jp->mutex.cs_mutex);
+
+#ifdef WIN32
+  _endthread();
+#else
+#endif
+  return NULL;
 }
 
-int sd_mutex_serv_accept_idle(void *value, int index)
+void *sd_mutex_core_func(void *v)
 {
-  linked_list_iterate(&((struct sd_serv_info *)value)->accept_addresses,
-      &sd_mutex_serv_accept_idle_iter);
-  return 0;
+  struct sd_core_worker *w = (struct sd_core_worker *)v;
+  int ret;
+
+  /* state was set to incomplete by core_start */
+  if (w->id == 0)
+    ret = core_loop();
+  else
+    ret = core_worker_loop(w);
+  sd_set_mutex_state(&w->mutex.proc_state, ret);
+
+#ifdef WIN32
+  _endthread();
+#else
+#endif
+  return NULL;
 }
 
 
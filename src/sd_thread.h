@@ -1,6 +1,18 @@
 #ifndef SD_THREAD_H
 #define SD_THREAD_H
 
+#include <stdint.h>
+
+#include "sd_linked_list.h"
+
+#define JOB_POOL_THREADS_DEFAULT             8
+#define JOB_POOL_THREADS_MIN                 2 /* one slow lookup does not stall the rest */
+#define JOB_POOL_THREADS_MAX               256
+#define JOB_POOL_STOP_POLL_MS                1 /* ms */
+
+#define IO_POOL_THREADS_DEFAULT              2
+#define IO_POOL_THREADS_MAX                 64
+
 /*! \brief Mutural exclusion and volatile state information */
 struct sd_mutex_state_info
 {
@@ -17,6 +29,62 @@ struct sd_mutex_state_info
 
 typedef void *(*thread_pos_cb)(void *);
 typedef void (*thread_win_cb)(void *);
+typedef void (*completion_cb)(void *v);
+
+/*! \brief Result of a step that finishes later, embedded in whatever
+ *         waits for it */
+struct sd_completion
+{
+  struct sd_completion *next;
+  int queued; /* set and cleared atomically, posts can race */
+  char proc_state; /* PROC_STATE_ */
+
+  completion_cb cb; /* run by the core once posted */
+  void *v;
+};
+
+/*! \brief Completions for the core, any thread may post, only the holder
+ *         of the core locks takes them */
+struct sd_completion_queue
+{
+  struct sd_completion *head; /* lock free, newest first */
+  struct sd_completion *ready; /* taken off head, oldest first */
+  struct sd_completion *ready_last;
+};
+
+/*! \brief A blocking call waiting for a pool thread */
+struct sd_job
+{
+  thread_pos_cb f;
+  void *args;
+};
+
+/*! \brief Job pool statistics */
+struct sd_job_pool_stats
+{
+  int threads;       /* pool size */
+  int busy;          /* threads running a job */
+  int queued;        /* jobs waiting for a thread */
+  int queued_max;    /* deepest the queue has been */
+  uint64_t submitted;
+  uint64_t completed;
+};
+
+/*! \brief Fixed set of threads for blocking calls, the job pool runs
+ *         address lookups and connects, the io pool file reads and writes */
+struct sd_job_pool
+{
+  struct sd_mutex_state_info mutex;
+#ifdef WIN32
+  HANDLE sem; /* one count per queued job */
+#else
+  pthread_cond_t cond;
+#endif
+  linked_list jobs; /* struct sd_job */
+  struct sd_job_pool_stats stats;
+  int alive; /* threads that have not exited */
+  volatile char running;
+};
 
 /*! \brief Set the mutex state */
 extern void sd_set_mutex_state(volatile char *s, char ns);
@@ -30,26 +98,59 @@ extern void sd_thread_deinit(void *);
 /*! \brief Create a thread */
 extern int sd_create_thread(thread_pos_cb f, void *args);
 
-/*! \brief Server thread processing */
-extern void *sd_mutex_server_func(void *v);
+/*! \brief Set the callback for a completion */
+extern void completion_init(struct sd_completion *c, completion_cb cb, void *v);
+
+/*! \brief Set the result and queue c for the core, nothing may post c
+ *         again before its callback has run */
+extern void completion_post(struct sd_completion *c, char ps);
+
+/*! \brief Get if c is posted and its callback has not run yet */
+extern int completion_is_queued(struct sd_completion *c);
+
+/*! \brief Drop c if it is queued, with the core locks held, returns 1
+ *         if it was */
+extern int completion_cancel(struct sd_completion *c);
+
+/*! \brief Get if anything posted has not run yet, with worker 0's lock
+ *         held */
+extern int completion_queue_pending(void);
+
+/*! \brief Run the callbacks of everything posted, with the core locks
+ *         held, returns how many were run */
+extern int completion_queue_run(void);
+
+/*! \brief Start the job pool threads */
+extern void job_pool_init(int nthreads);
+
+/*! \brief Stop the job pool, waits for running jobs to finish */
+extern void job_pool_deinit(void);
+
+/*! \brief Queue f(args) for the next free pool thread, core_wake() is
+ *         called when it has run */
+extern void job_pool_submit(thread_pos_cb f, void *args);
+
+/*! \brief Get a copy of the job pool statistics */
+extern void job_pool_get_stats(struct sd_job_pool_stats *st);
 
-/*! \brief Accept server thread processing */
-extern void *sd_mutex_server_accept_func(void *v);
+/*! \brief Start the io pool threads */
+extern void io_pool_init(int nthreads);
 
-/*! \brief Connection thread processing */
-extern void *sd_mutex_con_func(void *v);
+/*! \brief Stop the io pool, waits for running reads and writes to finish */
+extern void io_pool_deinit(void);
 
-/*! \brief Mutex wrapper for control connection idle handling */
-extern int sd_mutex_con_idle(void *value, int index);
+/*! \brief Queue f(args) for the next free io thread, core_wake() is
+ *         called when it has run */
+extern void io_pool_submit(thread_pos_cb f, void *args);
 
-/*! \brief Mutex wrapper for server idle handling */
-extern int sd_mutex_serv_idle(void *value, int index);
+/*! \brief Get a copy of the io pool statistics */
+extern void io_pool_get_stats(struct sd_job_pool_stats *st);
 
-/*! \brief Mutex wrapper for data connection idle handling */
-extern int sd_mutex_data_con_idle_iter(void *value, int index);
+/*! \brief Job pool thread processing */
+extern void *sd_job_pool_func(void *v);
 
-/*! \brief Mutex wrapper for server accept idle handling */
-extern int sd_mutex_serv_accept_idle(void *value, int index);
+/*! \brief Networking core thread processing */
+extern void *sd_mutex_core_func(void *v);
 
 /*! \brief Start a critical section */
 extern void sd_cs_lock(
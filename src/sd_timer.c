@@ -0,0 +1,199 @@
+/*
+   Timer wheel
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_timer.h"
+#include "sd_timing.h"
+
+static uint64_t timer_wheel_now(struct sd_timer_wheel *tw)
+{
+  return (time_get_ms() - tw->start_ms) / SD_TIMER_TICK_MS;
+}
+
+/* put an armed timer in the slot for its expiry, the further away the
+ * coarser the level */
+static void timer_wheel_insert(struct sd_timer_wheel *tw, struct sd_timer *t)
+{
+  struct sd_timer **slot;
+  uint64_t delta;
+  int level;
+
+  if (t->expires < tw->tick)
+    t->expires = tw->tick;
+
+  delta = t->expires - tw->tick;
+
+  for (level = 0; level < SD_TIMER_WHEEL_LEVELS - 1; level++)
+    if (delta < ((uint64_t) 1 << (SD_TIMER_WHEEL_BITS * (level + 1))))
+      break;
+
+  /* anything further than the wheel reaches is cut short */
+  if (delta >= ((uint64_t) 1 << (SD_TIMER_WHEEL_BITS * SD_TIMER_WHEEL_LEVELS)))
+    t->expires = tw->tick + ((uint64_t) 1 <<
+        (SD_TIMER_WHEEL_BITS * SD_TIMER_WHEEL_LEVELS)) - 1;
+
+  slot = &tw->slots[level][(t->expires >> (SD_TIMER_WHEEL_BITS * level)) &
+    SD_TIMER_WHEEL_MASK];
+
+  t->next = *slot;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+/* move the timers of a slot down a level */
+static void timer_wheel_cascade(struct sd_timer_wheel *tw, int level, int index)
+{
+  struct sd_timer *t, *next;
+
+  t = tw->slots[level][index];
+  tw->slots[level][index] = NULL;
+
+  for (; t; t = next)
+  {
+    next = t->next;
+    timer_wheel_insert(tw, t);
+  }
+}
+
+void timer_wheel_init(struct sd_timer_wheel *tw)
+{
+  memset(tw->slots, 0, sizeof tw->slots);
+  tw->start_ms = time_get_ms();
+  tw->tick = 0;
+  tw->count = 0;
+}
+
+void timer_wheel_deinit(struct sd_timer_wheel *tw)
+{
+  int level, i;
+
+  for (level = 0; level < SD_TIMER_WHEEL_LEVELS; level++)
+    for (i = 0; i < SD_TIMER_WHEEL_SLOTS; i++)
+      while (tw->slots[level][i])
+        timer_del(tw->slots[level][i]);
+}
+
+int timer_wheel_run(struct sd_timer_wheel *tw)
+{
+  struct sd_timer *t;
+  uint64_t now;
+  int level, index, n = 0;
+
+  now = timer_wheel_now(tw);
+
+  /* nothing to catch up on */
+  if (!tw->count) {
+    tw->tick = now + 1;
+    return 0;
+  }
+
+  while (tw->tick <= now)
+  {
+    index = tw->tick & SD_TIMER_WHEEL_MASK;
+
+    /* at the start of a lap bring the next slot of each level down */
+    for (level = 1; !index && level < SD_TIMER_WHEEL_LEVELS; level++)
+    {
+      index = (tw->tick >> (SD_TIMER_WHEEL_BITS * level)) & SD_TIMER_WHEEL_MASK;
+      timer_wheel_cascade(tw, level, index);
+    }
+
+    /* a callback may arm or disarm anything, so take one at a time */
+    while ((t = tw->slots[0][tw->tick & SD_TIMER_WHEEL_MASK]))
+    {
+      timer_del(t);
+      t->cb(t->v);
+      n++;
+    }
+
+    tw->tick++;
+  }
+
+  return n;
+}
+
+uint64_t timer_wheel_next(struct sd_timer_wheel *tw)
+{
+  uint64_t tick;
+  int i;
+
+  if (!tw->count)
+    return 0;
+
+  /* exact for the first level, otherwise wake for the next cascade */
+  for (i = 0; i < SD_TIMER_WHEEL_SLOTS; i++)
+  {
+    tick = tw->tick + i;
+    if (tw->slots[0][tick & SD_TIMER_WHEEL_MASK])
+      break;
+    if (!(tick & SD_TIMER_WHEEL_MASK))
+      break;
+  }
+
+  return tw->start_ms + (tw->tick + i) * SD_TIMER_TICK_MS;
+}
+
+void timer_init(struct sd_timer *t, timer_cb cb, void *v)
+{
+  t->wheel = NULL;
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->cb = cb;
+  t->v = v;
+}
+
+uint64_t timer_add(struct sd_timer_wheel *tw, struct sd_timer *t, int ms)
+{
+  timer_del(t);
+
+  /* round up so it never fires early */
+  t->expires = timer_wheel_now(tw) +
+    (ms + SD_TIMER_TICK_MS - 1) / SD_TIMER_TICK_MS;
+  t->wheel = tw;
+  tw->count++;
+
+  timer_wheel_insert(tw, t);
+
+  return tw->start_ms + t->expires * SD_TIMER_TICK_MS;
+}
+
+void timer_del(struct sd_timer *t)
+{
+  if (!t->wheel)
+    return;
+
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+
+  t->wheel->count--;
+  t->wheel = NULL;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+int timer_pending(struct sd_timer *t)
+{
+  return t->wheel != NULL;
+}
+
+
+// vim:ts=2:expandtab
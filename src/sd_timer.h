@@ -0,0 +1,69 @@
+#ifndef SD_TIMER_H
+#define SD_TIMER_H
+
+#include <stdint.h>
+
+#define SD_TIMER_TICK_MS                    10 /* resolution */
+
+/* each level is a ring of slots, a level covers SD_TIMER_WHEEL_SLOTS times
+ * the span of the one below, 4 levels of 64 reach 46 hours */
+#define SD_TIMER_WHEEL_BITS                  6
+#define SD_TIMER_WHEEL_SLOTS                (1 << SD_TIMER_WHEEL_BITS)
+#define SD_TIMER_WHEEL_MASK                 (SD_TIMER_WHEEL_SLOTS - 1)
+#define SD_TIMER_WHEEL_LEVELS                4
+
+typedef void (*timer_cb)(void *v);
+
+struct sd_timer_wheel;
+
+/*! \brief A timer, embedded in whatever it times */
+struct sd_timer
+{
+  struct sd_timer_wheel *wheel; /* NULL when not armed */
+  struct sd_timer *next;
+  struct sd_timer **pprev;
+  uint64_t expires; /* tick */
+
+  timer_cb cb;
+  void *v;
+};
+
+/*! \brief Hierarchical timer wheel, used under the lock of its owner */
+struct sd_timer_wheel
+{
+  uint64_t start_ms;
+  uint64_t tick; /* next tick to run */
+  int count; /* armed timers */
+
+  struct sd_timer *slots[SD_TIMER_WHEEL_LEVELS][SD_TIMER_WHEEL_SLOTS];
+};
+
+/*! \brief Initialise a timer wheel */
+extern void timer_wheel_init(struct sd_timer_wheel *tw);
+
+/*! \brief Disarm every timer still in the wheel */
+extern void timer_wheel_deinit(struct sd_timer_wheel *tw);
+
+/*! \brief Call the callbacks of timers that have expired */
+extern int timer_wheel_run(struct sd_timer_wheel *tw);
+
+/*! \brief Get the time in ms the next timer may expire at, 0 if none */
+extern uint64_t timer_wheel_next(struct sd_timer_wheel *tw);
+
+/*! \brief Set the callback for a timer (does not arm it) */
+extern void timer_init(struct sd_timer *t, timer_cb cb, void *v);
+
+/*! \brief Arm a timer to expire in ms, rearms if already armed, returns
+ *         the time in ms it will expire at */
+extern uint64_t timer_add(struct sd_timer_wheel *tw, struct sd_timer *t, int ms);
+
+/*! \brief Disarm a timer, does nothing if it is not armed */
+extern void timer_del(struct sd_timer *t);
+
+/*! \brief Check if a timer is armed */
+extern int timer_pending(struct sd_timer *t);
+
+#endif
+
+
+// vim:ts=2:expandtab
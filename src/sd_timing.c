@@ -14,6 +14,10 @@
    GNU General Public License for more details.
 */
 
+#ifdef WIN32
+#include <windows.h>
+#endif
+
 #include <time.h>
 #include <inttypes.h>
 
@@ -76,6 +80,27 @@ int time_diff(struct timeval *current, struct timeval *previous)
           * 1000;
 }
 
+uint64_t time_get_ms(void)
+{
+#ifdef WIN32
+  /* GetTickCount64() needs vista, GetTickCount() wraps after 49 days */
+  static LARGE_INTEGER f;
+  LARGE_INTEGER c;
+
+  if (!f.QuadPart)
+    QueryPerformanceFrequency(&f);
+  QueryPerformanceCounter(&c);
+
+  return (uint64_t) (c.QuadPart / f.QuadPart) * 1000 +
+    (uint64_t) (c.QuadPart % f.QuadPart) * 1000 / f.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
 #define DAY_NUM_SECONDS     86400
 #define HOUR_NUM_SECONDS     3600
 #define MINUTE_NUM_SECONDS     60
@@ -1,6 +1,7 @@
 #ifndef SD_TIMING_H
 #define SD_TIMING_H
 
+#include <stdint.h>
 #include <sys/time.h>
 
 /*! \brief Holds timing information */
@@ -26,6 +27,9 @@ extern char *get_time_string();
 /*! \brief Get difference between two time periods in ms */
 extern int time_diff(struct timeval *current, struct timeval *previous);
 
+/*! \brief Get a monotonic time in ms, only useful for differences */
+extern uint64_t time_get_ms(void);
+
 /*! \brief Get a string containing the time remaining based on time in seconds */
 extern char *time_get_time_remaining_string(uint64_t *r);
 
@@ -21,8 +21,10 @@
 #include <stdlib.h>
 #include "sd_ui.h"
 #include "sd_globals.h"
+#include "sd_idle.h"
 #include "sd_error.h"
 #include "sd_logging.h"
+#include "sd_dynamic_memory.h"
 
 extern void register_gtk_ui(void);
 
@@ -34,6 +36,7 @@ void ui_init(void)
   (*gbls->ui->init)();
   sd_thread_init(&gbls->ui->mutex.cs_mutex);
   linked_list_init(&gbls->ui->status_backlog);
+  linked_list_init(&gbls->ui->event_backlog);
   gbls->ui->initialized = 1;
 }
 
@@ -51,6 +54,7 @@ void ui_deinit(void)
     ON_ERROR_EXIT("ui_deinit called without init.");
   
   (*gbls->ui->deinit)();
+  linked_list_rem_all_entries(&gbls->ui->event_backlog, 1);
   sd_thread_deinit(&gbls->ui->mutex.cs_mutex);
   gbls->ui->initialized = 0;
 }
@@ -150,35 +154,170 @@ void set_gtk_ui(void)
   register_gtk_ui();
 }
 
+/* for finding an event allready queued for a data transfer */
+static struct sd_ui_event *ui_event_to_find;
+int ui_event_find_iter(void *v, int i)
+{
+  struct sd_ui_event *e = (struct sd_ui_event *)v;
+
+  if (e->dti == ui_event_to_find->dti &&
+      e->type == ui_event_to_find->type &&
+      e->change_type == ui_event_to_find->change_type)
+    return 1;
+  return 0;
+}
+
+/* the core thread calls these, gtk must only be used from the ui thread
+ * so queue them for ui_idle */
+static void ui_queue_event(struct sd_data_transfer_info *dti, char type,
+    char change_type)
+{
+  struct sd_ui_event find, *e;
+  list_item *li;
+
+  find.dti = dti;
+  find.type = type;
+  find.change_type = change_type;
+  find.verdict = dti->verdict;
+  find.direction = dti->direction;
+
+  sd_cs_lock(&gbls->ui->mutex.cs_mutex);
+
+  /* the ui reads the current values anyway, one update is enough */
+  ui_event_to_find = &find;
+  if ((type == SD_UI_EVENT_DATA_TRANSFER_PROGRESS_CHANGE ||
+       change_type == SD_DATA_TRANSFER_CHANGE_TYPE_UPDATE) &&
+      (li = linked_list_iterate(&gbls->ui->event_backlog, &ui_event_find_iter)))
+  {
+    e = (struct sd_ui_event *)li->value;
+    e->verdict = find.verdict;
+    e->direction = find.direction;
+    sd_cs_unlock(&gbls->ui->mutex.cs_mutex);
+    return;
+  }
+
+  SAFE_CALLOC(e, 1, sizeof(struct sd_ui_event));
+  *e = find;
+  linked_list_add(&gbls->ui->event_backlog, e);
+
+  sd_cs_unlock(&gbls->ui->mutex.cs_mutex);
+}
+
 void ui_data_transfer_change(struct sd_data_transfer_info *dti,
     char changetype)
 {
-  gbls->ui->data_transfer_change(dti, changetype);
+  ui_queue_event(dti, SD_UI_EVENT_DATA_TRANSFER_CHANGE, changetype);
 }
 
 void ui_data_transfer_accepted(struct sd_data_transfer_info *dti)
 {
-  gbls->ui->data_transfer_accepted(dti);
+  ui_queue_event(dti, SD_UI_EVENT_DATA_TRANSFER_ACCEPTED, 0);
 }
 
 void ui_data_transfer_progress_change(struct sd_data_transfer_info *dti)
 {
-  gbls->ui->data_transfer_progress_change(dti);
+  ui_queue_event(dti, SD_UI_EVENT_DATA_TRANSFER_PROGRESS_CHANGE, 0);
+}
+
+static struct sd_data_transfer_info *ui_event_purge_dti;
+int ui_event_purge_iter(void *v, int i)
+{
+  struct sd_ui_event *e = (struct sd_ui_event *)v;
+
+  /* removing only compares the pointer so let it through */
+  if (e->dti == ui_event_purge_dti &&
+      !(e->type == SD_UI_EVENT_DATA_TRANSFER_CHANGE &&
+        e->change_type == SD_DATA_TRANSFER_CHANGE_TYPE_REMOVE))
+    return 1;
+  return 0;
+}
+
+void ui_purge_data_transfer_events(struct sd_data_transfer_info *dti)
+{
+  list_item *li;
+
+  sd_cs_lock(&gbls->ui->mutex.cs_mutex);
+
+  ui_event_purge_dti = dti;
+  while ((li = linked_list_iterate(&gbls->ui->event_backlog,
+          &ui_event_purge_iter)))
+    linked_list_rem(&gbls->ui->event_backlog, li, SD_OPTION_ON);
+
+  sd_cs_unlock(&gbls->ui->mutex.cs_mutex);
+}
+
+int ui_process_event_backlog()
+{
+  struct sd_ui_event **events;
+  int i, n;
+
+  /* most ticks have nothing, leave the workers alone then */
+  sd_cs_lock(&gbls->ui->mutex.cs_mutex);
+  n = linked_list_get_size(&gbls->ui->event_backlog);
+  sd_cs_unlock(&gbls->ui->mutex.cs_mutex);
+
+  if (!n)
+    return 0;
+
+  /* the callbacks read the transfers, locked before the queue is taken so
+   * none of them can be freed in between */
+  core_lock_read();
+
+  sd_cs_lock(&gbls->ui->mutex.cs_mutex);
+  n = linked_list_get_all_values(&gbls->ui->event_backlog, (void ***) &events);
+  linked_list_rem_all_entries(&gbls->ui->event_backlog, 0);
+  sd_cs_unlock(&gbls->ui->mutex.cs_mutex);
+
+  for (i = 0; i < n; i++)
+  {
+    switch (events[i]->type)
+    {
+      case SD_UI_EVENT_DATA_TRANSFER_CHANGE:
+        gbls->ui->data_transfer_change(events[i]->dti, events[i]->change_type,
+            events[i]->verdict);
+        break;
+      case SD_UI_EVENT_DATA_TRANSFER_ACCEPTED:
+        gbls->ui->data_transfer_accepted(events[i]->dti);
+        break;
+      case SD_UI_EVENT_DATA_TRANSFER_PROGRESS_CHANGE:
+        gbls->ui->data_transfer_progress_change(events[i]->dti);
+        break;
+    }
+    SAFE_FREE(events[i]);
+  }
+
+  core_unlock_read();
+
+  if (n)
+    SAFE_FREE(events);
+
+  return n;
 }
 
 int ui_process_status_backlog()
 {
-  /* print to ui */
-  linked_list_iterate(&gbls->ui->status_backlog,
-      gbls->ui->process_status_message);
-  /* print to log */
-  if (gbls->conf->logging_enabled == SD_OPTION_ON) {
-    linked_list_iterate(&gbls->ui->status_backlog,
-        &logging_print_line_iter);
+  char **lines;
+  int i, n;
+
+  /* error functions add from any thread */
+  sd_cs_lock(&gbls->ui->mutex.cs_mutex);
+  n = linked_list_get_all_values(&gbls->ui->status_backlog, (void ***) &lines);
+  linked_list_rem_all_entries(&gbls->ui->status_backlog, 0);
+  sd_cs_unlock(&gbls->ui->mutex.cs_mutex);
+
+  for (i = 0; i < n; i++)
+  {
+    /* print to ui */
+    (*gbls->ui->process_status_message)(lines[i], i);
+    /* print to log */
+    if (gbls->conf->logging_enabled == SD_OPTION_ON)
+      logging_print_line_iter(lines[i], i);
+
+    SAFE_FREE(lines[i]);
   }
 
-  int n;
-  n = linked_list_rem_all_entries(&gbls->ui->status_backlog, 1);
+  if (n)
+    SAFE_FREE(lines);
 
   return n;
 }
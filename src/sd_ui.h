@@ -7,6 +7,20 @@
 #define SD_DATA_TRANSFER_CHANGE_TYPE_REMOVE      1
 #define SD_DATA_TRANSFER_CHANGE_TYPE_UPDATE      2
 
+/*! \brief Data transfer change queued by the core for the UI thread */
+struct sd_ui_event
+{
+  char type;
+#define SD_UI_EVENT_DATA_TRANSFER_CHANGE           0
+#define SD_UI_EVENT_DATA_TRANSFER_ACCEPTED         1
+#define SD_UI_EVENT_DATA_TRANSFER_PROGRESS_CHANGE  2
+
+  struct sd_data_transfer_info *dti; /* only a key once it was removed */
+  char change_type;
+  char verdict; /* copied when queued, the transfer may be freed by then */
+  char direction;
+};
+
 /*! \brief Initialise the User Interface */
 extern void ui_init(void);
 
@@ -59,6 +73,12 @@ extern void ui_data_transfer_progress_change(struct sd_data_transfer_info *dti);
 /*! \brief Runs in idle to process any status messages to UI */
 extern int ui_process_status_backlog();
 
+/*! \brief Runs in idle to pass queued data transfer changes to UI */
+extern int ui_process_event_backlog();
+
+/*! \brief Drop queued events for a data transfer that is going away */
+extern void ui_purge_data_transfer_events(struct sd_data_transfer_info *dti);
+
 /*! \brief Sets the UI as GTK */
 extern void set_gtk_ui();
 
@@ -0,0 +1,626 @@
+/*
+   io_uring data transfer path
+
+   Copyright (c) Thomas Pongrac
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_uring.h"
+
+#ifdef SD_URING
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "sd.h"
+#include "sd_globals.h"
+#include "sd_peers.h"
+#include "sd_net.h"
+#include "sd_ui.h"
+#include "sd_error.h"
+#include "sd_protocol.h"
+#include "sd_dynamic_memory.h"
+
+/* chunk and op packed into the user data of each request */
+#define URING_OP_FILE                        0
+#define URING_OP_SOCK                        1
+#define URING_USER_DATA(c, op)          ((uint64_t) (c) * 2 + (op))
+#define URING_USER_DATA_CANCEL          (~(uint64_t) 0)
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+  return (int) syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* check the kernel knows every op the transfer needs */
+static int uring_probe(struct sd_uring_info *ur)
+{
+  struct io_uring_probe *probe;
+  int ret = -1;
+  size_t len;
+
+  len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  SAFE_CALLOC(probe, 1, len);
+
+  if (uring_register(ur->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+      probe->last_op >= IORING_OP_RECV &&
+      (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED))
+    ret = 0;
+
+  SAFE_FREE(probe);
+  return ret;
+}
+
+static int uring_map(struct sd_uring_info *ur, struct io_uring_params *p)
+{
+  char *sq, *cq;
+
+  ur->sq_ring_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  ur->cq_ring_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+  /* both rings share one mapping on newer kernels */
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ur->cq_ring_len > ur->sq_ring_len)
+      ur->sq_ring_len = ur->cq_ring_len;
+    ur->cq_ring_len = 0;
+  }
+
+  ur->sq_ring = mmap(NULL, ur->sq_ring_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+  if (ur->sq_ring == MAP_FAILED) {
+    ur->sq_ring = NULL;
+    return -1;
+  }
+
+  if (ur->cq_ring_len)
+  {
+    ur->cq_ring = mmap(NULL, ur->cq_ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    if (ur->cq_ring == MAP_FAILED) {
+      ur->cq_ring = NULL;
+      return -1;
+    }
+  }
+  else
+    ur->cq_ring = ur->sq_ring;
+
+  ur->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+  ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED) {
+    ur->sqes = NULL;
+    return -1;
+  }
+
+  sq = (char *) ur->sq_ring;
+  ur->sq_head = (unsigned *) (sq + p->sq_off.head);
+  ur->sq_tail = (unsigned *) (sq + p->sq_off.tail);
+  ur->sq_mask = (unsigned *) (sq + p->sq_off.ring_mask);
+  ur->sq_array = (unsigned *) (sq + p->sq_off.array);
+
+  cq = (char *) ur->cq_ring;
+  ur->cq_head = (unsigned *) (cq + p->cq_off.head);
+  ur->cq_tail = (unsigned *) (cq + p->cq_off.tail);
+  ur->cq_mask = (unsigned *) (cq + p->cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+
+  return 0;
+}
+
+static void uring_free(struct sd_uring_info *ur)
+{
+  if (ur->sqes)
+    munmap(ur->sqes, ur->sqes_len);
+  if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+    munmap(ur->cq_ring, ur->cq_ring_len);
+  if (ur->sq_ring)
+    munmap(ur->sq_ring, ur->sq_ring_len);
+  if (ur->fd != -1)
+    close(ur->fd);
+
+  SAFE_FREE(ur->buffer);
+  SAFE_FREE(ur);
+}
+
+/* get the next free entry, the kernel only sees it once uring_flush()
+ * publishes the tail, the ring is only used by the owning worker */
+static struct io_uring_sqe *uring_get_sqe(struct sd_uring_info *ur)
+{
+  struct io_uring_sqe *sqe;
+  unsigned i;
+
+  if (ur->sq_prepared - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >
+      *ur->sq_mask)
+    return NULL;
+
+  i = ur->sq_prepared++ & *ur->sq_mask;
+  ur->sq_array[i] = i;
+  sqe = &ur->sqes[i];
+  memset(sqe, 0, sizeof *sqe);
+
+  return sqe;
+}
+
+/* publish everything prepared, returns how many the kernel has not taken */
+static unsigned uring_flush(struct sd_uring_info *ur)
+{
+  __atomic_store_n(ur->sq_tail, ur->sq_prepared, __ATOMIC_RELEASE);
+
+  return ur->sq_prepared - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/* queue a request for chunk i, 0 if the ring is full for now */
+static int uring_prep(struct sd_uring_info *ur, int i, int opcode, int fd,
+    char *b, int len, uint64_t off)
+{
+  struct io_uring_sqe *sqe;
+  int op;
+
+  if (!(sqe = uring_get_sqe(ur)))
+    return 0;
+
+  op = opcode == IORING_OP_SEND || opcode == IORING_OP_RECV ?
+    URING_OP_SOCK : URING_OP_FILE;
+
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) b;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = URING_USER_DATA(i, op);
+
+  switch (opcode)
+  {
+    case IORING_OP_READ_FIXED:
+    case IORING_OP_WRITE_FIXED:
+      sqe->buf_index = i;
+      break;
+    case IORING_OP_SEND:
+      sqe->msg_flags = MSG_WAITALL | SD_MSG_NOSIGNAL;
+      break;
+    case IORING_OP_RECV:
+      sqe->msg_flags = MSG_WAITALL;
+      break;
+  }
+
+  ur->chunk[i].state = op == URING_OP_SOCK ? URING_CHUNK_SOCK : URING_CHUNK_FILE;
+  if (op == URING_OP_SOCK)
+    ur->sock_busy = 1;
+  ur->pending++;
+
+  return 1;
+}
+
+/* store results of finished requests, returns how many were reaped */
+static int uring_reap(struct sd_uring_info *ur)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  int n = 0;
+
+  head = *ur->cq_head;
+  tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++)
+  {
+    cqe = &ur->cqes[head & *ur->cq_mask];
+    if (cqe->user_data != URING_USER_DATA_CANCEL)
+    {
+      ur->chunk[cqe->user_data / 2].res = cqe->res;
+      ur->chunk[cqe->user_data / 2].reaped = 1;
+      ur->pending--;
+      n++;
+    }
+  }
+
+  __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+/* write out the part of a chunk the request did not get to */
+static int uring_pwrite(int fd, char *b, int len, uint64_t off)
+{
+  ssize_t bwrite;
+
+  while (len > 0)
+  {
+    bwrite = pwrite(fd, b, len, (off_t) off);
+    if (bwrite == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    b += bwrite;
+    len -= bwrite;
+    off += bwrite;
+  }
+
+  return 0;
+}
+
+/* move the chunks whose request finished on to their next step */
+static void uring_complete(struct sd_data_transfer_info *dti)
+{
+  struct sd_uring_info *ur = dti->uring;
+  struct sd_uring_chunk *c;
+  char *b;
+  int i, r, err = 0, eof = 0;
+  const char *f = NULL;
+
+  for (i = 0; i < DATA_URING_DEPTH; i++)
+  {
+    c = &ur->chunk[i];
+    if (!c->reaped)
+      continue;
+
+    c->reaped = 0;
+    r = c->res;
+    b = ur->buffer + i * DATA_URING_CHUNK_LEN;
+
+    if (c->state == URING_CHUNK_SOCK)
+      ur->sock_busy = 0;
+
+    if (dti->direction == DATA_TRANSFER_DIRECTION_OUTGOING)
+    {
+      if (c->state == URING_CHUNK_FILE)
+      {
+        /* a short read means the file shrank under us */
+        if (r != c->len) {
+          err = r < 0 ? -r : EIO;
+          f = "read";
+          continue;
+        }
+        c->state = URING_CHUNK_FULL;
+        continue;
+      }
+
+      if (r < 0) {
+        err = -r;
+        f = "send";
+        continue;
+      }
+
+      c->sent += r;
+      ur->sock_off += r;
+      dti->file.position += r;
+      dti->io_total_bytes_current += r;
+
+      /* the rest goes on the next send */
+      c->state = c->sent < c->len ? URING_CHUNK_FULL : URING_CHUNK_FREE;
+    }
+    else
+    {
+      if (c->state == URING_CHUNK_SOCK)
+      {
+        if (r <= 0) {
+          if (r == 0)
+            eof = 1;
+          else {
+            err = -r;
+            f = "recv";
+          }
+          c->state = URING_CHUNK_FREE;
+          continue;
+        }
+
+        /* a short recv still gets written, the next one carries on */
+        c->len = r;
+        ur->sock_off += r;
+        c->state = URING_CHUNK_FULL;
+        continue;
+      }
+
+      if (r < 0) {
+        err = -r;
+        f = "write";
+        continue;
+      }
+      if (r < c->len && uring_pwrite(dti->file.fd, b + r, c->len - r,
+            c->off + r) == -1) {
+        err = errno;
+        f = "pwrite";
+        continue;
+      }
+
+      dti->file.position += c->len;
+      dti->io_total_bytes_current += c->len;
+      c->state = URING_CHUNK_FREE;
+    }
+  }
+
+  if (err)
+  {
+    ui_sys_err(err, f);
+    data_con_close(dti);
+    return;
+  }
+
+  if (dti->io_total_bytes_current >= dti->file.size)
+  {
+    data_transfer_set_completed(dti);
+    return;
+  }
+
+  if (eof)
+  {
+    data_con_close(dti);
+    return;
+  }
+
+  data_uring_submit(dti);
+}
+
+int data_uring_init(struct sd_data_transfer_info *dti, struct sd_event_loop *el)
+{
+  struct sd_uring_info *ur;
+  struct io_uring_params p;
+  struct iovec iov[DATA_URING_DEPTH];
+  int i;
+
+  /* ssl records and frames are built in user space */
+  if (gbls->conf->data_io_uring != SD_OPTION_ON ||
+      dti->data_con.enable_ssl == SD_OPTION_ON || dti->stream.group)
+    return -1;
+
+  SAFE_CALLOC(ur, 1, sizeof(struct sd_uring_info));
+  SAFE_CALLOC(ur->buffer, DATA_URING_DEPTH, DATA_URING_CHUNK_LEN);
+
+  memset(&p, 0, sizeof p);
+  if ((ur->fd = uring_setup(DATA_URING_ENTRIES, &p)) == -1)
+    goto data_uring_init_error;
+
+  if (uring_map(ur, &p) == -1 || uring_probe(ur) == -1)
+    goto data_uring_init_error;
+
+  for (i = 0; i < DATA_URING_DEPTH; i++)
+  {
+    iov[i].iov_base = ur->buffer + i * DATA_URING_CHUNK_LEN;
+    iov[i].iov_len = DATA_URING_CHUNK_LEN;
+  }
+  if (uring_register(ur->fd, IORING_REGISTER_BUFFERS, iov, DATA_URING_DEPTH) == -1)
+    goto data_uring_init_error;
+
+  ur->sq_prepared = *ur->sq_tail;
+  ur->file_off = ur->sock_off = dti->file.position;
+
+  event_handler_init(&ur->ev, &data_uring_event_cb, (void *) dti);
+  if (event_handler_add(el, &ur->ev, ur->fd, SD_EVENT_READ) == -1)
+    goto data_uring_init_error;
+
+  dti->uring = ur;
+
+  return data_uring_submit(dti);
+
+data_uring_init_error:
+  ui_notify_printf("io_uring is unavailable (%s), using normal socket io.",
+      strerror(errno));
+  uring_free(ur);
+  return -1;
+}
+
+void data_uring_deinit(struct sd_data_transfer_info *dti)
+{
+  struct sd_uring_info *ur = dti->uring;
+  struct io_uring_sqe *sqe;
+  unsigned n;
+  int i;
+
+  if (!ur)
+    return;
+
+  event_handler_del(&ur->ev);
+
+  /* the kernel may still be using the buffers, wait for it to let go */
+  if (ur->pending)
+  {
+    for (i = 0; i < DATA_URING_DEPTH; i++)
+    {
+      if ((ur->chunk[i].state != URING_CHUNK_FILE &&
+            ur->chunk[i].state != URING_CHUNK_SOCK) || ur->chunk[i].reaped)
+        continue;
+      if (!(sqe = uring_get_sqe(ur)))
+        break;
+
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = URING_USER_DATA(i, ur->chunk[i].state == URING_CHUNK_SOCK ?
+          URING_OP_SOCK : URING_OP_FILE);
+      sqe->user_data = URING_USER_DATA_CANCEL;
+    }
+
+    n = uring_flush(ur);
+    uring_reap(ur);
+    while (ur->pending > 0)
+    {
+      if (uring_enter(ur->fd, n, 1, IORING_ENTER_GETEVENTS) == -1 &&
+          errno != EINTR)
+        break;
+      n = 0;
+      uring_reap(ur);
+    }
+  }
+
+  uring_free(ur);
+  dti->uring = NULL;
+}
+
+/* outgoing, the chunk holding what the socket takes next */
+static int uring_next_send(struct sd_uring_info *ur)
+{
+  int i;
+
+  for (i = 0; i < DATA_URING_DEPTH; i++)
+    if (ur->chunk[i].state == URING_CHUNK_FULL &&
+        ur->chunk[i].off + ur->chunk[i].sent == ur->sock_off)
+      return i;
+
+  return -1;
+}
+
+int data_uring_submit(struct sd_data_transfer_info *dti)
+{
+  struct sd_uring_info *ur = dti->uring;
+  struct sd_uring_chunk *c;
+  uint64_t size;
+  unsigned n;
+  int i, fd, sock, len;
+  char *b;
+
+  if (!ur || dti->state != DATA_TRANSFER_STATE_TRANSFERING)
+    return 0;
+
+  fd = dti->file.fd;
+  sock = dti->data_con.sock_fd;
+  size = dti->file.size;
+
+  if (dti->direction == DATA_TRANSFER_DIRECTION_OUTGOING && ur->sock_off >= size)
+  {
+    data_transfer_set_completed(dti);
+    return 0;
+  }
+
+  for (i = 0; i < DATA_URING_DEPTH; i++)
+  {
+    c = &ur->chunk[i];
+    b = ur->buffer + i * DATA_URING_CHUNK_LEN;
+
+    /* what was recieved is written even while paused */
+    if (dti->direction == DATA_TRANSFER_DIRECTION_INCOMING &&
+        c->state == URING_CHUNK_FULL)
+      uring_prep(ur, i, IORING_OP_WRITE_FIXED, fd, b, c->len, c->off);
+  }
+
+  if (dti->transfer_state == DATA_TRANSFER_TRANSFER_STATE_PAUSED)
+    goto data_uring_submit_flush;
+
+  if (dti->direction == DATA_TRANSFER_DIRECTION_OUTGOING)
+  {
+    /* the socket keeps one send going, the file reads ahead of it */
+    if (!ur->sock_busy && (i = uring_next_send(ur)) != -1)
+    {
+      c = &ur->chunk[i];
+      uring_prep(ur, i, IORING_OP_SEND, sock,
+          ur->buffer + i * DATA_URING_CHUNK_LEN + c->sent, c->len - c->sent, 0);
+    }
+
+    for (i = 0; i < DATA_URING_DEPTH && ur->file_off < size; i++)
+    {
+      c = &ur->chunk[i];
+      if (c->state != URING_CHUNK_FREE)
+        continue;
+
+      len = size - ur->file_off < DATA_URING_CHUNK_LEN ?
+        (int) (size - ur->file_off) : DATA_URING_CHUNK_LEN;
+      if (!uring_prep(ur, i, IORING_OP_READ_FIXED, fd,
+            ur->buffer + i * DATA_URING_CHUNK_LEN, len, ur->file_off))
+        break;
+
+      c->off = ur->file_off;
+      c->len = len;
+      c->sent = 0;
+      ur->file_off += len;
+    }
+  }
+  else if (!ur->sock_busy && ur->sock_off < size)
+  {
+    /* one recv at a time keeps the stream in order, the writes of the
+     * chunks before it are still going */
+    for (i = 0; i < DATA_URING_DEPTH; i++)
+    {
+      c = &ur->chunk[i];
+      if (c->state != URING_CHUNK_FREE)
+        continue;
+
+      len = size - ur->sock_off < DATA_URING_CHUNK_LEN ?
+        (int) (size - ur->sock_off) : DATA_URING_CHUNK_LEN;
+      if (uring_prep(ur, i, IORING_OP_RECV, sock,
+            ur->buffer + i * DATA_URING_CHUNK_LEN, len, 0))
+      {
+        c->off = ur->sock_off;
+        c->len = len;
+      }
+      break;
+    }
+  }
+
+data_uring_submit_flush:
+  /* one tail update for everything prepared, anything the kernel does
+   * not take now goes in with the next enter */
+  if (!(n = uring_flush(ur)))
+    return 0;
+
+  if (uring_enter(ur->fd, n, 0, 0) == -1 && errno != EAGAIN &&
+      errno != EBUSY && errno != EINTR)
+  {
+    ui_sys_err(errno, "io_uring_enter");
+    data_con_close(dti);
+    return -1;
+  }
+
+  return 0;
+}
+
+void data_uring_event_cb(void *v, int events)
+{
+  struct sd_data_transfer_info *dti = (struct sd_data_transfer_info *) v;
+
+  if (uring_reap(dti->uring))
+    uring_complete(dti);
+}
+
+#else
+
+int data_uring_init(struct sd_data_transfer_info *dti, struct sd_event_loop *el)
+{
+  return -1;
+}
+
+void data_uring_deinit(struct sd_data_transfer_info *dti)
+{
+}
+
+int data_uring_submit(struct sd_data_transfer_info *dti)
+{
+  return 0;
+}
+
+void data_uring_event_cb(void *v, int events)
+{
+}
+
+#endif
+
+
+// vim:ts=2:expandtab
@@ -0,0 +1,91 @@
+#ifndef SD_URING_H
+#define SD_URING_H
+
+#include <stdint.h>
+
+#if defined(__linux__) && defined(SD_IO_URING)
+#define SD_URING
+#endif
+
+#ifdef SD_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "sd_event.h"
+
+#define DATA_URING_ENTRIES                  16 /* submission queue size */
+#define DATA_URING_DEPTH                     4 /* chunks in flight per transfer */
+#define DATA_URING_CHUNK_LEN             65536 /* 64 kB */
+
+/* partial declerations */
+struct sd_data_transfer_info;
+
+#ifdef SD_URING
+
+/* what a chunk waits on, it has at most one request in flight */
+#define URING_CHUNK_FREE                     0
+#define URING_CHUNK_FILE                     1 /* read or write of the file */
+#define URING_CHUNK_SOCK                     2 /* send or recv */
+#define URING_CHUNK_FULL                     3 /* holds data for the next op */
+
+/*! \brief A registered buffer and the part of the file it holds */
+struct sd_uring_chunk
+{
+  uint64_t off; /* file offset of the data */
+  int len; /* bytes read or recieved into it */
+  int sent; /* outgoing, bytes of it on the socket */
+  int state;
+  int res; /* of the request that finished */
+  int reaped; /* res is set and not acted on yet */
+};
+
+/*! \brief io_uring state for a single plain data transfer */
+struct sd_uring_info
+{
+  int fd;
+  struct sd_event_handler ev; /* ring fd, readable when completions are posted */
+
+  /* shared with the kernel */
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned sq_prepared; /* tail the kernel sees once published */
+
+  /* registered buffers, one per chunk */
+  char *buffer;
+
+  /* the file side runs ahead on every free chunk while the socket takes
+   * the chunks in order, one request at a time */
+  struct sd_uring_chunk chunk[DATA_URING_DEPTH];
+  uint64_t file_off; /* outgoing, where the next read starts */
+  uint64_t sock_off; /* where the next send or recv starts */
+  int sock_busy;
+  int pending; /* completions not reaped yet */
+};
+
+#endif
+
+/*! \brief Move the transfer with io_uring, -1 if the normal socket path
+ *         has to be used instead */
+extern int data_uring_init(struct sd_data_transfer_info *dti, struct sd_event_loop *el);
+
+/*! \brief Cancel outstanding requests and free the ring */
+extern void data_uring_deinit(struct sd_data_transfer_info *dti);
+
+/*! \brief Put every chunk that is ready for its next step in flight */
+extern int data_uring_submit(struct sd_data_transfer_info *dti);
+
+/*! \brief Event callback to reap completions for a transfer */
+extern void data_uring_event_cb(void *v, int events);
+
+#endif
+
+
+// vim:ts=2:expandtab
@@ -26,6 +26,7 @@
 #include "sd_gtk_approved_transfers.h"
 #include "sd_protocol.h"
 #include "sd_protocol_commands.h"
+#include "sd_idle.h"
 
 static struct sd_data_transfer_info *popup_menu_approved_transfer_selected;
 
@@ -40,6 +41,7 @@ enum
   COL_PROGRESS_METER_TEXT,
   COL_THROUGHPUT,
   COL_ETA,
+  COL_WINDOW,
   COL_TRANSFER_STATE,
   COL_CON_METH,
   COL_STATE,
@@ -96,6 +98,11 @@ void gtk_init_data_transfers_approved_treeview(void)
   gtk_tree_view_insert_column_with_attributes(
       GTK_TREE_VIEW(w), -1, "ETA", renderer, "text", COL_ETA, NULL);
   
+  /* --- window ---*/
+  renderer = gtk_cell_renderer_text_new();
+  gtk_tree_view_insert_column_with_attributes(
+      GTK_TREE_VIEW(w), -1, "Window", renderer, "text", COL_WINDOW, NULL);
+  
   /* --- transfer state ---*/
   renderer = gtk_cell_renderer_text_new();
   gtk_tree_view_insert_column_with_attributes(
@@ -135,6 +142,7 @@ void gtk_init_data_transfers_approved_treeview(void)
       G_TYPE_STRING,
       G_TYPE_STRING,
       G_TYPE_STRING,
+      G_TYPE_STRING,
       G_TYPE_POINTER
       );
   gtk_tree_view_set_model(GTK_TREE_VIEW(w), GTK_TREE_MODEL(ls));
@@ -194,7 +202,9 @@ void set_data_transfer_approved_list_store_progress_row(
   if (!dti->file.size)
     return;
 
-  byte_difference = dti->io_total_bytes_current - dti->io_total_bytes_last;
+  /* a stream resend can take the count back */
+  byte_difference = dti->io_total_bytes_current > dti->io_total_bytes_last ?
+    dti->io_total_bytes_current - dti->io_total_bytes_last : 0;
 
   /* not going to be accurate */
   if (((!byte_difference) && (!dti->io_byte_diff_zero)) &&
@@ -247,6 +257,11 @@ void set_data_transfer_approved_list_store_progress_row(
   //snprintf(eta_s, sizeof eta_s, "%"PRIu64"m", time_remaining);
   eta_s = time_get_time_remaining_string(&time_remaining);
 
+  /* buffer size the transfer has settled on */
+  char window_s[64];
+
+  snprintf(window_s, sizeof window_s, "%ikB", dti->data_window_len / 1024);
+
   gtk_list_store_set(ls, ti,
       COL_PROGRESS_METER_VALUE, (int) percent_i,
       COL_PROGRESS_METER_PULSE, 0,
@@ -254,6 +269,7 @@ void set_data_transfer_approved_list_store_progress_row(
 
       COL_THROUGHPUT, throughput_s,
       COL_ETA, eta_s,
+      COL_WINDOW, window_s,
 
       -1);
 
@@ -424,30 +440,38 @@ G_MODULE_EXPORT gboolean data_transfers_approved_treeview_button_press_event_cb(
 G_MODULE_EXPORT void data_transfer_approved_state_pause_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock();
   data_transfer_set_transfer_state(popup_menu_approved_transfer_selected,
       DATA_TRANSFER_TRANSFER_STATE_PAUSED);
+  core_unlock();
 }
 
 /* transfer state RESUME */
 G_MODULE_EXPORT void data_transfer_approved_state_resume_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock();
   data_transfer_set_transfer_state(popup_menu_approved_transfer_selected,
       DATA_TRANSFER_TRANSFER_STATE_RESUMED);
+  core_unlock();
 }
 
 /* abort */
 G_MODULE_EXPORT void data_transfer_approved_abort_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock();
   data_transfer_abort(popup_menu_approved_transfer_selected);
+  core_unlock();
 }
 
 /* clear from treeview */
 G_MODULE_EXPORT void data_transfers_approved_clear_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   ui_data_transfer_change(popup_menu_approved_transfer_selected, SD_DATA_TRANSFER_CHANGE_TYPE_REMOVE);
+  core_unlock_read();
 }
 
 
@@ -21,6 +21,7 @@
 #include "sd_globals.h"
 #include "sd_error.h"
 #include "sd_net.h"
+#include "sd_idle.h"
 #include "sd_dynamic_memory.h"
 
 /* ---------- server [begin] ---------- */
@@ -74,8 +75,10 @@ start_server_button_clicked_cb(GtkObject *object, gpointer user_data)
 
   /* store into server */
   struct sd_serv_info *si;
+  core_lock();
   si = server_init(ip, port, essl, &vi, type);
   server_start_state_machine(si, SERVER_STATE_RESOLVE_IP, SD_OPTION_ON);
+  core_unlock();
   
   gtk_widget_hide_name("start_server_dialog");
 
@@ -188,8 +191,10 @@ connect_button_clicked_cb(GtkObject *object, gpointer user_data)
 
   struct sd_peer_info *pi;
 
+  core_lock();
   pi = peer_init(ip, port, essl, &vi);
   con_start_state_machine(&pi->ctl_con, CON_STATE_RESOLVE_DST_IP, SD_OPTION_ON);
+  core_unlock();
   
   gtk_widget_hide_name("connect_dialog");
 }
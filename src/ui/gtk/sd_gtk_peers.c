@@ -24,6 +24,7 @@
 #include "sd_dynamic_memory.h"
 #include "sd_gtk_peers.h"
 #include "sd_protocol.h"
+#include "sd_idle.h"
 
 GtkListStore *peers_list_store;
 
@@ -36,22 +37,28 @@ peers_close_button_clicked_cb(GtkObject *object, gpointer user_data)
 G_MODULE_EXPORT void 
 peers_toolbutton_clicked_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_peers_treeview();
+  core_unlock_read();
   gtk_widget_show_name("peers_dialog");
 }
 
 G_MODULE_EXPORT void 
 refresh_peers_button_clicked_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_peers_treeview();
   gtk_update_transfers_treeview();
+  core_unlock_read();
 }
 
 G_MODULE_EXPORT void
 peers_treeview_cursor_changed_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_peer_information();
   gtk_update_transfers_treeview();
+  core_unlock_read();
 }
 
 
@@ -60,6 +67,7 @@ disconnect_peer_button_clicked_cb(GtkObject *object, gpointer user_data)
 {
   struct sd_peer_info *pi;
 
+  core_lock();
   pi = (struct sd_peer_info *) gtk_get_pointer_selected("peers_treeview", 1);
   if (pi == NULL)
     ui_sd_err("No peer selected.");
@@ -67,6 +75,7 @@ disconnect_peer_button_clicked_cb(GtkObject *object, gpointer user_data)
     ui_sd_err("This control connection is allready closed.");
   else
     ctl_con_close(pi);
+  core_unlock();
 }
 
 G_MODULE_EXPORT void
@@ -79,6 +88,7 @@ message_peer_button_clicked_cb(GtkObject *object, gpointer user_data)
   if (msg[0] == '\0')
     return;
 
+  core_lock();
   pi = (struct sd_peer_info *) gtk_get_pointer_selected("peers_treeview", 1);
   if (pi == NULL) {
     ui_sd_err("No peer selected.");
@@ -93,6 +103,7 @@ message_peer_button_clicked_cb(GtkObject *object, gpointer user_data)
     SAFE_FREE(encmsg);
     ui_notify("Message sent to peer.");
   }
+  core_unlock();
 }
 
 void gtk_init_peers_treeview(void)
@@ -251,7 +262,9 @@ void gtk_update_peer_information(void)
 G_MODULE_EXPORT void
 transfers_treeview_cursor_changed_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_transfer_information();
+  core_unlock_read();
 }
 
 void gtk_init_transfers_treeview(void)
@@ -20,6 +20,7 @@
 #include "sd_globals.h"
 #include "sd_error.h"
 #include "sd_net.h"
+#include "sd_idle.h"
 #include "sd_dynamic_memory.h"
 #include "sd_gtk_servers.h"
 
@@ -32,20 +33,26 @@ servers_close_button_clicked_cb(GtkObject *object, gpointer user_data)
 G_MODULE_EXPORT void 
 servers_toolbutton_clicked_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_servers_treeview();
+  core_unlock_read();
   gtk_widget_show_name("servers_dialog");
 }
 
 G_MODULE_EXPORT void 
 refresh_servers_button_clicked_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_servers_treeview();
+  core_unlock_read();
 }
 
 G_MODULE_EXPORT void
 servers_treeview_cursor_changed_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_server_information();
+  core_unlock_read();
 }
 
 G_MODULE_EXPORT void
@@ -53,6 +60,7 @@ stop_server_button_clicked_cb(GtkObject *object, gpointer user_data)
 {
   struct sd_serv_info *si;
 
+  core_lock();
   si = (struct sd_serv_info *) gtk_get_pointer_selected("servers_treeview", 1);
   if (si == NULL)
     ui_sd_err("No server selected.");
@@ -66,7 +74,7 @@ stop_server_button_clicked_cb(GtkObject *object, gpointer user_data)
     ui_notify_printf("Server %s was closed.", saddr);
     SAFE_FREE(saddr);
   }
-    
+  core_unlock();
 }
 
 G_MODULE_EXPORT void
@@ -74,6 +82,7 @@ restart_server_button_clicked_cb(GtkObject *object, gpointer user_data)
 {
   struct sd_serv_info *si;
 
+  core_lock();
   si = (struct sd_serv_info *) gtk_get_pointer_selected("servers_treeview", 1);
   if (si == NULL)
     ui_sd_err("No server selected.");
@@ -83,7 +92,7 @@ restart_server_button_clicked_cb(GtkObject *object, gpointer user_data)
   {
     server_start_state_machine(si, SERVER_STATE_RESOLVE_IP, SD_OPTION_ON);
   }
-    
+  core_unlock();
 }
 
 void gtk_init_servers_dialog(void)
@@ -27,6 +27,7 @@
 #include "sd_gtk_suggest_files.h"
 #include "sd_protocol.h"
 #include "sd_protocol_commands.h"
+#include "sd_idle.h"
 
 GtkListStore *added_files_list_store;
 GtkListStore *peers_combobox_list_store;
@@ -42,8 +43,10 @@ add_toolbutton_clicked_cb(GtkObject *object, gpointer user_data)
 {
   /* reset exisitng files */
   gtk_list_store_clear(added_files_list_store);
+  core_lock_read();
   gtk_update_peers_combobox();
   gtk_update_listen_addresses_combobox();
+  core_unlock_read();
   gtk_widget_show_name("suggest_files_dialog");
 }
 
@@ -214,13 +217,17 @@ void gtk_init_suggest_files_dialog(void)
       gbls->conf->data_wide_net_address);
   gtk_entry_set_text_name("passive_method_connect_port_entry",
       gbls->conf->data_wide_service);
+  gtk_set_spinbutton_int_value_name("data_streams_spinbutton",
+      gbls->conf->data_streams);
 }
 
 G_MODULE_EXPORT void 
 refresh_select_peer_button_clicked_cb(GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_peers_combobox();
   gtk_update_listen_addresses_combobox();
+  core_unlock_read();
 }
 
 void gtk_init_added_files_treeview(void)
@@ -398,14 +405,17 @@ suggest_button_clicked_cb(GtkObject *object, gpointer user_data)
   /* error checking */
   struct sd_peer_info *pi;
 
+  core_lock();
   pi = (struct sd_peer_info *)gtk_get_pointer_combobox_selected("peer_select_combobox");
   
   if (pi == NULL) {
     ui_sd_err("No peer selected.");
+    core_unlock();
     return;
   }
   else if (pi->ctl_con.state == CON_STATE_CLOSED) {
     ui_sd_err("This connection is not active.");
+    core_unlock();
     return;
   }
   else {
@@ -429,10 +439,12 @@ suggest_button_clicked_cb(GtkObject *object, gpointer user_data)
 
         if (si == NULL) {
           ui_sd_err("If listening on local address, must select server.");
+          core_unlock();
           return;
         }
         else if (si->state != SERVER_STATE_LISTENING) {
           ui_sd_err("The selected listening address must be in listening state.");
+          core_unlock();
           return;
         }
 
@@ -489,6 +501,7 @@ suggest_button_clicked_cb(GtkObject *object, gpointer user_data)
   
   if (gtk_tree_model_get_iter_first(m, &iter) == FALSE) {
     ui_sd_err("No files to suggest.");
+    core_unlock();
     return;
   }
 
@@ -508,6 +521,8 @@ suggest_button_clicked_cb(GtkObject *object, gpointer user_data)
 
       data_transfer_set_id(dti, DATA_TRANSFER_DIRECTION_OUTGOING, 0);
       data_transfer_set_wan(dti, nwa_str, nws_str);
+      data_transfer_set_streams(dti,
+          gtk_get_spinbutton_int_value_name("data_streams_spinbutton"));
       
       dti->peer_using_ssl = c_essl;
 
@@ -528,7 +543,7 @@ suggest_button_clicked_cb(GtkObject *object, gpointer user_data)
     if (gtk_tree_model_iter_next(m, &iter) == FALSE)
       break;
   }
-  
+  core_unlock();
 
   gtk_widget_hide_name("suggest_files_dialog");
   
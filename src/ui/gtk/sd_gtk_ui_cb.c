@@ -29,6 +29,7 @@
 #include "sd_gtk_unapproved_transfers.h"
 #include "sd_gtk_approved_transfers.h"
 #include "sd_gtk_servers.h"
+#include "sd_idle.h"
 
 void gtk_ui_init(void)
 {
@@ -86,6 +87,8 @@ void gtk_ui_init(void)
 
 void gtk_ui_begin(void)
 {
+  /* the core lock is taken by the handlers that use the core data, never
+   * while gtk waits or draws */
   gtk_widget_show_name("main_window");
 
 #ifdef WIN32
@@ -238,10 +241,12 @@ void gtk_ui_state_set(int os, int ns)
 
 }
 
+/* verdict is the one when the change was queued, a removed dti may be freed
+ * already and is only compared with the rows */
 void gtk_ui_data_transfer_change(struct sd_data_transfer_info *dti,
-    char change_type)
+    char change_type, char verdict)
 {
-  switch (dti->verdict)
+  switch (verdict)
   {
     case DATA_TRANSFER_VERDICT_PENDING:
     case DATA_TRANSFER_VERDICT_DECLINDED:
@@ -17,7 +17,7 @@ extern void gtk_ui_wsa_err(int n, const char *f);
 extern void gtk_ui_notify(const char *m);
 extern void gtk_ui_state_set(int os, int ns);
 extern void gtk_ui_data_transfer_change(struct sd_data_transfer_info *dti,
-    char change_type);
+    char change_type, char verdict);
 extern void gtk_ui_data_transfer_accepted(struct sd_data_transfer_info *dti);
 extern int gtk_ui_process_status_message(void *v, int i);
 extern void gtk_ui_data_transfer_progress_change(struct sd_data_transfer_info *dti);
@@ -26,6 +26,7 @@
 #include "sd_protocol.h"
 #include "sd_protocol_commands.h"
 #include "sd_file.h"
+#include "sd_idle.h"
 
 /* popup menu begin */
 static struct sd_data_transfer_info *popup_menu_unapproved_transfer_selected;
@@ -309,6 +310,7 @@ void gtk_update_data_transfers_unapproved_treeview(void)
 G_MODULE_EXPORT void data_transfers_unapproved_edit_settings_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   if (popup_menu_unapproved_transfer_selected->direction ==
       DATA_TRANSFER_DIRECTION_OUTGOING)
   {
@@ -322,12 +324,14 @@ G_MODULE_EXPORT void data_transfers_unapproved_edit_settings_menuitem_activate_c
     transfer_settings_dialog_spawn();
     gtk_widget_show_name("transfer_settings_dialog");
   }
+  core_unlock_read();
 }
 
 /* transfer ACCEPTED */
 G_MODULE_EXPORT void data_transfers_unapproved_verdict_accept_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock();
   if (popup_menu_unapproved_transfer_selected->direction ==
       DATA_TRANSFER_DIRECTION_OUTGOING) {
     ui_sd_err("Only the peer can verify outgoing transfers.");
@@ -352,13 +356,14 @@ G_MODULE_EXPORT void data_transfers_unapproved_verdict_accept_menuitem_activate_
       ui_sd_err("This transfer is not waiting for verification.");
     }
   }
-
+  core_unlock();
 }
 
 /* transfer DECLINED */
 G_MODULE_EXPORT void data_transfers_unapproved_verdict_decline_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock();
   if (popup_menu_unapproved_transfer_selected->direction ==
       DATA_TRANSFER_DIRECTION_OUTGOING) {
     ui_sd_err("Only the peer can verify outgoing transfers.");
@@ -371,20 +376,25 @@ G_MODULE_EXPORT void data_transfers_unapproved_verdict_decline_menuitem_activate
           DATA_TRANSFER_VERDICT_DECLINDED);
     }
   }
+  core_unlock();
 }
 
 /* abort */
 G_MODULE_EXPORT void data_transfers_unapproved_abort_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock();
   data_transfer_abort(popup_menu_unapproved_transfer_selected);
+  core_unlock();
 }
 
 /* clear from treeview */
 G_MODULE_EXPORT void data_transfers_unapproved_clear_menuitem_activate_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   ui_data_transfer_change(popup_menu_unapproved_transfer_selected, SD_DATA_TRANSFER_CHANGE_TYPE_REMOVE);
+  core_unlock_read();
 }
 
 /* right click popup menu */
@@ -647,6 +657,7 @@ G_MODULE_EXPORT void transfer_settings_apply_button_clicked_cb(
   int vdepth;
   struct sd_ssl_verify_info vi;
 
+  core_lock();
   switch (popup_menu_unapproved_transfer_selected->con_meth)
   {
     case CON_METH_ACTIVE:
@@ -693,10 +704,12 @@ G_MODULE_EXPORT void transfer_settings_apply_button_clicked_cb(
 
         if (si == NULL) {
           ui_sd_err("If listening on local address, must select server.");
+          core_unlock();
           return;
         }
         else if (si->state != SERVER_STATE_LISTENING) {
           ui_sd_err("The selected listening address must be in listening state.");
+          core_unlock();
           return;
         }
 
@@ -732,6 +745,7 @@ G_MODULE_EXPORT void transfer_settings_apply_button_clicked_cb(
 
     popup_menu_unapproved_transfer_selected->file.position = ipos;
   }
+  core_unlock();
 
   gtk_widget_hide_name("transfer_settings_dialog");
 }
@@ -800,7 +814,9 @@ void gtk_update_transfer_settings_listen_addresses_combobox()
 G_MODULE_EXPORT void transfer_settings_refresh_addresses_button_clicked_cb(
     GtkObject *object, gpointer user_data)
 {
+  core_lock_read();
   gtk_update_transfer_settings_listen_addresses_combobox();
+  core_unlock_read();
 }
 
 G_MODULE_EXPORT void data_transfer_unapproved_scan_button_clicked_cb(
@@ -811,7 +827,9 @@ G_MODULE_EXPORT void data_transfer_unapproved_scan_button_clicked_cb(
 
   char *d = gtk_get_filechooser_filename("transfer_settings_output_directory_filechooserbutton");
 
+  core_lock_read();
   filepath = file_make_full_path(popup_menu_unapproved_transfer_selected->file.name, d);
+  core_unlock_read();
   
   if (file_get_size(filepath, &size) == -1)
   {